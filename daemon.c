@@ -0,0 +1,425 @@
+/* Resident server for a database file.  The daemon listens on a Unix
+ * domain socket named after the database file, and clients forward
+ * their arguments to it.  Requests are run one at a time, with their
+ * output written to memory, while an epoll loop gathers requests from
+ * any number of clients and sends each its output, and then its exit
+ * status, as fast as the client reads it, so a client slow to read
+ * holds up no other. */
+
+#define _GNU_SOURCE  /* accept4, memfd_create */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+
+#include "daemon.h"
+
+#define DMN_SUFFIX ".sock"
+
+enum {
+    MAXEVENTS = 64,
+    MAXREQ = 65536,  /* largest request accepted, in bytes */
+    NOUT = 2,        /* request's stdout and stderr */
+    FRAMEHDR = 5     /* bytes before a reply frame's data */
+};
+
+/* Request: the length of what follows, then the arguments as strings,
+ * each with its terminating NUL.
+ * Reply: frames of a byte naming the client's file to write to, 1 or
+ * 2, and the length of the data following, ending with a frame naming
+ * file 0 whose length is the exit status. */
+struct st_client {
+    int fd;
+    char* buf;          /* request received so far */
+    size_t len;
+    char* reply;        /* reply, once the request has run */
+    size_t replylen, sent;
+    struct st_client* next;
+    struct st_client* prev;
+};
+
+typedef struct st_client CLIENT;
+
+static CLIENT* clients = NULL;
+static volatile sig_atomic_t stopping = 0;
+static int outfds[NOUT] = {-1, -1};  /* request's output, in memory */
+
+static void on_signal(int sig)
+{
+    stopping = 1;
+}
+
+/* Set addr to the socket for the database file, returning -1 if the
+ * name is too long for a socket */
+static int socket_addr(char* dbname, struct sockaddr_un* addr)
+{
+    memset(addr,0,sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(dbname)+sizeof(DMN_SUFFIX)+4 > sizeof(addr->sun_path)) {
+        return -1;
+    }
+    sprintf(addr->sun_path,"%s%s",dbname,DMN_SUFFIX);
+    return 0;
+}
+
+static void client_close(CLIENT* c)
+{
+    close(c->fd);
+    if (c->prev != NULL) c->prev->next = c->next;
+    else clients = c->next;
+    if (c->next != NULL) c->next->prev = c->prev;
+    free(c->buf);
+    free(c->reply);
+    free(c);
+}
+
+static void client_accept(int lfd, int epfd)
+{
+    int fd;
+    CLIENT* c;
+    struct epoll_event ev;
+
+    while ((fd = accept4(lfd,NULL,NULL,SOCK_NONBLOCK|SOCK_CLOEXEC)) >= 0) {
+        if ((c = calloc(1,sizeof(CLIENT))) == NULL ||
+            (c->buf = malloc(MAXREQ)) == NULL) {
+            free(c);
+            close(fd);
+            continue;
+        }
+        c->fd = fd;
+        c->next = clients;
+        if (clients != NULL) clients->prev = c;
+        clients = c;
+        ev.events = EPOLLIN;
+        ev.data.ptr = c;
+        if (epoll_ctl(epfd,EPOLL_CTL_ADD,fd,&ev) != 0) client_close(c);
+    }
+}
+
+/* Add a reply frame for file, of len bytes of data */
+static char* frame_add(char* p, int file, unsigned int len, char* data)
+{
+    *p++ = (char) file;
+    memcpy(p,&len,sizeof(len));
+    p += sizeof(len);
+    if (data != NULL) memcpy(p,data,len);
+    return p + (data != NULL? len : 0);
+}
+
+/* Run a complete request with its stdout and stderr written to memory,
+ * and make the reply to the client from them */
+static int client_run(CLIENT* c, unsigned int reqlen, DMN_HANDLER handler)
+{
+    char** argv;
+    char* end = c->buf + sizeof(reqlen) + reqlen;
+    char *out[NOUT] = {NULL, NULL}, *q;
+    off_t outlen[NOUT];
+    int argc = 0, status = EXIT_FAILURE, saved[NOUT];
+
+    if (reqlen == 0 || end[-1] != '\0') goto reply;
+    for (char* p = c->buf+sizeof(reqlen); p < end; p++) {
+        if (*p == '\0') argc++;
+    }
+    if ((argv = malloc((argc+1)*sizeof(char*))) == NULL) goto reply;
+    argc = 0;
+    for (char* p = c->buf+sizeof(reqlen); p < end; p += strlen(p)+1) {
+        argv[argc++] = p;
+    }
+    argv[argc] = NULL;
+
+    fflush(stdout);
+    fflush(stderr);
+    for (int i=0; i<NOUT; i++) {
+        ftruncate(outfds[i],0);
+        lseek(outfds[i],0,SEEK_SET);
+        saved[i] = dup(i+1);
+        dup2(outfds[i],i+1);
+    }
+    status = handler(argc,argv);
+    fflush(stdout);
+    fflush(stderr);
+    for (int i=0; i<NOUT; i++) {
+        dup2(saved[i],i+1);
+        close(saved[i]);
+    }
+    free(argv);
+
+    /* errors first, as a client writing to files not terminals sees
+     * them, since its stdout is buffered to the end */
+    for (int i=NOUT-1; i>=0; i--) {
+        if ((outlen[i] = lseek(outfds[i],0,SEEK_END)) <= 0) continue;
+        if ((out[i] = malloc(outlen[i])) == NULL ||
+            pread(outfds[i],out[i],outlen[i],0) != outlen[i]) {
+            status = EXIT_FAILURE;
+            outlen[i] = 0;
+        }
+    }
+ reply:
+    c->replylen = FRAMEHDR;
+    for (int i=0; i<NOUT; i++) {
+        if (out[i] != NULL) c->replylen += FRAMEHDR + outlen[i];
+    }
+    if ((c->reply = malloc(c->replylen)) != NULL) {
+        q = c->reply;
+        for (int i=NOUT-1; i>=0; i--) {
+            if (out[i] != NULL)
+                q = frame_add(q,i+1,(unsigned int) outlen[i],out[i]);
+        }
+        frame_add(q,0,(unsigned int) status,NULL);
+    }
+    for (int i=0; i<NOUT; i++) free(out[i]);
+    return (c->reply == NULL? -1 : 0);
+}
+
+/* Send what the client will take of its reply, without waiting; once
+ * it is all sent, the client is done with */
+static void client_write(CLIENT* c)
+{
+    ssize_t n;
+
+    while (c->sent < c->replylen) {
+        if ((n = send(c->fd,c->reply+c->sent,c->replylen-c->sent,
+                      MSG_NOSIGNAL|MSG_DONTWAIT)) < 0) {
+            if (errno == EINTR) continue;
+            if (errno != EAGAIN) client_close(c);
+            return;
+        }
+        c->sent += (size_t) n;
+    }
+    client_close(c);
+}
+
+/* Read what the client has sent; once the request is complete, run it
+ * and start on the reply. */
+static void client_read(CLIENT* c, int epfd, DMN_HANDLER handler)
+{
+    struct epoll_event ev;
+    unsigned int reqlen;
+    ssize_t n;
+
+    if ((n = recv(c->fd,c->buf+c->len,MAXREQ-c->len,0)) < 0) {
+        if (errno != EAGAIN && errno != EINTR) client_close(c);
+        return;
+    }
+    if (n == 0) {
+        client_close(c);
+        return;
+    }
+    c->len += (size_t) n;
+    if (c->len < sizeof(reqlen)) return;
+    memcpy(&reqlen,c->buf,sizeof(reqlen));
+    if (reqlen > MAXREQ - sizeof(reqlen)) {
+        client_close(c);
+        return;
+    }
+    if (c->len < sizeof(reqlen) + reqlen) return;
+
+    ev.events = EPOLLOUT;
+    ev.data.ptr = c;
+    if (client_run(c,reqlen,handler) != 0 ||
+        epoll_ctl(epfd,EPOLL_CTL_MOD,c->fd,&ev) != 0) {
+        client_close(c);
+        return;
+    }
+    client_write(c);
+}
+
+/* Serve requests for the database file until interrupted.  The socket
+ * is bound under a temporary name and renamed into place once it is
+ * listening, so a client never finds a socket nobody answers. */
+int dmn_serve(char* dbname, DMN_HANDLER handler)
+{
+    struct sockaddr_un addr, tmpaddr;
+    struct sigaction sa;
+    struct epoll_event ev, events[MAXEVENTS];
+    int lfd, epfd, rc = 0;
+    mode_t mask;
+
+    if (socket_addr(dbname,&addr) != 0) return DMN_SOCKET;
+    tmpaddr = addr;
+    sprintf(tmpaddr.sun_path,"%s%s.new",dbname,DMN_SUFFIX);
+    if ((lfd = socket(AF_UNIX,SOCK_STREAM|SOCK_NONBLOCK|SOCK_CLOEXEC,0)) < 0) {
+        return DMN_SOCKET;
+    }
+    unlink(tmpaddr.sun_path);
+    mask = umask(077);  /* only the owner may connect */
+    if (bind(lfd,(struct sockaddr*) &tmpaddr,sizeof(tmpaddr)) != 0) {
+        umask(mask);
+        close(lfd);
+        return DMN_SOCKET;
+    }
+    umask(mask);
+    if (listen(lfd,SOMAXCONN) != 0 ||
+        rename(tmpaddr.sun_path,addr.sun_path) != 0) {
+        unlink(tmpaddr.sun_path);
+        close(lfd);
+        return DMN_SOCKET;
+    }
+    if ((epfd = epoll_create1(EPOLL_CLOEXEC)) < 0) {
+        unlink(addr.sun_path);
+        close(lfd);
+        return DMN_POLL;
+    }
+    for (int i=0; i<NOUT; i++) {
+        if ((outfds[i] = memfd_create("remind",MFD_CLOEXEC)) < 0) {
+            unlink(addr.sun_path);
+            close(epfd);
+            close(lfd);
+            return DMN_SOCKET;
+        }
+    }
+    ev.events = EPOLLIN;
+    ev.data.ptr = NULL;
+    epoll_ctl(epfd,EPOLL_CTL_ADD,lfd,&ev);
+
+    memset(&sa,0,sizeof(sa));
+    sa.sa_handler = on_signal;  /* no SA_RESTART: epoll_wait returns */
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGINT,&sa,NULL);
+    sigaction(SIGTERM,&sa,NULL);
+    sa.sa_handler = SIG_IGN;
+    sigaction(SIGPIPE,&sa,NULL);
+
+    stopping = 0;
+    while (!stopping) {
+        int n = epoll_wait(epfd,events,MAXEVENTS,-1);
+
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            rc = DMN_POLL;
+            break;
+        }
+        for (int i=0; i<n; i++) {
+            CLIENT* c = events[i].data.ptr;
+
+            if (c == NULL)
+                client_accept(lfd,epfd);
+            else if (c->reply != NULL)
+                client_write(c);
+            else
+                client_read(c,epfd,handler);
+        }
+    }
+
+    unlink(addr.sun_path);
+    while (clients != NULL) client_close(clients);
+    for (int i=0; i<NOUT; i++) {
+        close(outfds[i]);
+        outfds[i] = -1;
+    }
+    close(epfd);
+    close(lfd);
+    return rc;
+}
+
+/* Connect to the daemon for the database file, returning the socket,
+ * or -1 if none is running */
+static int dmn_connect(char* dbname)
+{
+    struct sockaddr_un addr;
+    int fd;
+
+    if (socket_addr(dbname,&addr) != 0) return -1;
+    if ((fd = socket(AF_UNIX,SOCK_STREAM|SOCK_CLOEXEC,0)) < 0) return -1;
+    if (connect(fd,(struct sockaddr*) &addr,sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Return true if a daemon is serving the database file */
+bool dmn_running(char* dbname)
+{
+    int fd = dmn_connect(dbname);
+
+    if (fd < 0) return false;
+    close(fd);
+    return true;
+}
+
+/* Read exactly len bytes from fd, returning false at end of file or on
+ * an error */
+static bool read_all(int fd, void* buf, size_t len)
+{
+    size_t done = 0;
+    ssize_t n;
+
+    while (done < len) {
+        if ((n = read(fd,(char*) buf+done,len-done)) < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) return false;
+        done += (size_t) n;
+    }
+    return true;
+}
+
+/* Forward a request to the daemon for the database file, if one is
+ * running, and write its output to stdout and stderr.  Returns the
+ * request's exit status, or -1 if there is no daemon to forward to. */
+int dmn_forward(char* dbname, int argc, char* argv[])
+{
+    int fd;
+    unsigned int reqlen = 0, len;
+    unsigned char file;
+    char *buf, chunk[8192];
+    size_t bufsize, done = 0;
+    ssize_t n;
+
+    if ((fd = dmn_connect(dbname)) < 0) return -1;
+    for (int i=0; i<argc; i++) reqlen += strlen(argv[i])+1;
+    bufsize = sizeof(reqlen) + reqlen;
+    if (bufsize > MAXREQ || (buf = malloc(bufsize)) == NULL) {
+        close(fd);
+        return EXIT_FAILURE;
+    }
+    memcpy(buf,&reqlen,sizeof(reqlen));
+    for (int i=0, off=sizeof(reqlen); i<argc; i++) {
+        strcpy(buf+off,argv[i]);
+        off += strlen(argv[i])+1;
+    }
+    while (done < bufsize) {
+        if ((n = send(fd,buf+done,bufsize-done,MSG_NOSIGNAL)) <= 0) {
+            if (n < 0 && errno == EINTR) continue;
+            break;
+        }
+        done += (size_t) n;
+    }
+
+    /* copy each frame of output to the file it names */
+    while (done == bufsize && read_all(fd,&file,1) &&
+           read_all(fd,&len,sizeof(len))) {
+        if (file == 0) {
+            free(buf);
+            close(fd);
+            return (int) len;
+        }
+        if (file > NOUT) break;
+        while (len > 0) {
+            size_t part = (len < sizeof(chunk)? len : sizeof(chunk));
+
+            if (!read_all(fd,chunk,part)) break;
+            /* output that can't be written is dropped, as it would
+             * be by the command run here */
+            for (size_t off = 0; off < part; off += (size_t) n) {
+                if ((n = write(file,chunk+off,part-off)) < 0 &&
+                    errno != EINTR) break;
+                if (n < 0) n = 0;
+            }
+            len -= (unsigned int) part;
+        }
+        if (len > 0) break;
+    }
+    free(buf);
+    close(fd);
+    return EXIT_FAILURE;
+}
@@ -0,0 +1,19 @@
+#ifndef DAEMON_H
+#define DAEMON_H
+
+#include <stdbool.h>
+
+enum dmn_errors {
+    DMN_SOCKET = 1,  /* can't create the socket */
+    DMN_POLL         /* can't wait for clients */
+};
+
+/* handler for a request, given the client's arguments; returns the
+ * exit status for the client */
+typedef int (*DMN_HANDLER)(int, char*[]);
+
+extern int dmn_serve(char*, DMN_HANDLER);
+extern int dmn_forward(char*, int, char*[]);
+extern bool dmn_running(char*);
+
+#endif
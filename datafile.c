@@ -1,285 +1,2543 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <limits.h>
+#include <endian.h>
+#include <fcntl.h>
+#include <libgen.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 #include "datafile.h"
+#include "index.h"
+#include "journal.h"
+#include "trace.h"
 
 enum {
-    RE_SEEKOK = 0
+    MAPMIN = 4096,  /* minimum size of mapping in bytes */
+    RECMIN = 16     /* minimum number of records room is made for */
 };
 
-static FILE* actfile;
+/* The file is laid out the same whatever the host: integers are
+ * little-endian and of fixed width. */
+#define GET32(x) ((int32_t) le32toh((uint32_t) (x)))
+#define GET64(x) ((int64_t) le64toh((uint64_t) (x)))
+#define PUT32(x) ((int32_t) htole32((uint32_t) (x)))
+#define PUT64(x) ((int64_t) htole64((uint64_t) (x)))
 
-static ACTREC action;
-static REMHDR header;
+/* The header as stored in the file */
+struct st_disk_hdr {
+    char magic[8];
+    int64_t phead[NURGENCY][SKIPLEV];
+    int64_t whead[NURGENCY][SKIPLEV];
+    int64_t xhead[NURGENCY][SKIPLEV];
+    int64_t shead[NURGENCY];
+    int64_t stail[NURGENCY];
+    int64_t pcount[NURGENCY];
+    int64_t scount[NURGENCY];
+    int64_t fhead;
+    int64_t numrec;
+    int32_t ucol[URGCOL];
+    int64_t reccap;
+    int64_t heapbase;
+    int64_t heapsize;
+    int64_t heapfree;
+    int64_t wakebase;
+};
+
+/* An action as stored in the file: fixed width and packed, with the
+ * message kept in the heap that follows the records. */
+struct st_disk_rec {
+    int64_t time;
+    int64_t next_event;
+    int64_t msgoff;          /* message offset within the heap */
+    int64_t occur;
+    int64_t wake;
+    int64_t next;
+    int64_t prev;
+    int64_t skip[SKIPLEV-1];
+    int64_t wlink[SKIPLEV];  /* wake list links, all levels */
+    int32_t warning;
+    int32_t timeout;
+    int32_t msgsize;         /* including the NUL; zero for none, as in a
+                              * nullified record, whose message reads "." */
+    int32_t repeat_nday;
+    int8_t type;
+    int8_t urgency;
+    int8_t repeat_type;
+    int8_t repeat_day;
+};
+
+typedef struct st_disk_hdr DISKHDR;
+typedef struct st_disk_rec DISKREC;
+
+static bool is_v4(int);
+static int upgrade(char*);
+static int urgency_of(int);
+static int wake_list(int, int, int);
+static int wake_insert(RECNO, int);
+static int wake_remove(RECNO, int);
+
+/* The mapping is private: changes reach the file only through the
+ * journal.  Records changed since the last commit, and records
+ * committed but not yet written to the file, are kept in sets. */
+struct st_recset {
+    RECNO* recs;          /* record numbers in the set */
+    int nrec, size;
+    unsigned char* bits;  /* membership, by record number */
+    RECNO nbits;
+};
+
+/* Likewise, the ranges of file written in the message heap */
+struct st_spans {
+    struct st_span {
+        off_t off;
+        size_t len;
+    }* v;
+    int n, size;
+};
+
+
+/* An open database file: the mapping and its state, the last action
+ * read, changes not yet committed, iteration, the journal and the
+ * message index */
+struct st_remfile {
+    int actfd;
+    char* actmap;       /* database file mapping */
+    size_t mapsize;     /* size of mapping in bytes */
+    ACTREC action;
+    char* msgbuf;       /* message of action */
+    size_t msgbufsize;
+    REMHDR header;
+    int error_code;
+    struct st_recset dirty, pending;
+    struct st_spans heapdirty, heappending;
+    DISKREC* undo;      /* dirty records as last committed */
+    int undosize;
+    REMHDR hdr_logged;  /* header as last committed */
+    REMHDR hdr_disk;    /* header as in the file */
+    bool journalled;    /* transactions logged since checkpoint */
+    bool readonly;      /* opened with OPEN_READ */
+    ACTYPE iter_type;
+    RECNO next_rec[NURGENCY];  /* iterator position on each list */
+    RECNO* due;         /* records found by act_due */
+    RECNO* dueout;      /* and put in order */
+    int duesize;
+    JOURNAL jnl;
+    INDEX idx;
+    REMSTATS stats;     /* work done through this handle */
+};
+
+static int sync_policy = SYNC_FULL;
+
+/* The handle each thread is working on; all start on the process's
+ * own */
+static REMFILE main_file = {.actfd = -1, .jnl = {.fd = -1},
+                            .idx = {.live = -1}};
+static _Thread_local REMFILE* rf = &main_file;
+
+/* Return the counts of the work done through the calling thread's
+ * handle since it was made */
+REMSTATS* rem_stats(void)
+{
+    return &rf->stats;
+}
+
+/* Return a new handle, with no file open, or NULL if out of memory */
+REMFILE* rem_new(void)
+{
+    REMFILE* f = calloc(1,sizeof(REMFILE));
+
+    if (f == NULL) return NULL;
+    f->actfd = -1;
+    jnl_init(&f->jnl);
+    idx_init(&f->idx);
+    return f;
+}
+
+/* Make f the handle the calling thread works on, returning the one it
+ * was working on */
+REMFILE* rem_use(REMFILE* f)
+{
+    REMFILE* prev = rf;
+
+    rf = f;
+    return prev;
+}
+
+/* Free handle f, whose file must be closed */
+void rem_free(REMFILE* f)
+{
+    struct st_recset* sets[] = {&f->dirty, &f->pending};
+    struct st_spans* spans[] = {&f->heapdirty, &f->heappending};
 
-static int rem_error_code;
+    for (int i=0; i<2; i++) {
+        free(sets[i]->recs);
+        free(sets[i]->bits);
+        free(spans[i]->v);
+    }
+    free(f->msgbuf);
+    free(f->undo);
+    free(f->due);
+    free(f->dueout);
+    jnl_free(&f->jnl);
+    idx_free(&f->idx);
+    if (f != &main_file) free(f);
+    return;
+}
 
 int rem_error(void) {
-    return rem_error_code;
+    return rf->error_code;
 }
 
 REMHDR* rem_header(void)
 {
-    return &header;
+    return &rf->header;
+}
+
+bool rem_readonly(void)
+{
+    return rf->readonly;
 }
 
-static int rec_read(int recno, void* dest)
+/* Note that wake times are being worked out as of now */
+void rem_set_wakebase(time_t now)
 {
-    if (fseek(actfile,(long) (sizeof(action)*recno),0) != RE_SEEKOK) {
-        return  (rem_error_code = RE_SEEK);
+    if (now > rf->header.wakebase) rf->header.wakebase = now;
+}
+
+void rem_set_sync(int policy)
+{
+    sync_policy = policy;
+}
+
+static int recset_add(struct st_recset* set, RECNO recno)
+{
+    if (recno >= set->nbits) {
+        RECNO nbits = (set->nbits == 0? 1024 : set->nbits);
+        unsigned char* bits;
+
+        while (nbits <= recno) nbits *= 2;
+        if ((bits = realloc(set->bits,nbits/8)) == NULL) return -1;
+        memset(bits+set->nbits/8,0,(nbits-set->nbits)/8);
+        set->bits = bits;
+        set->nbits = nbits;
     }
-    if (fread(dest,(recno==0?sizeof(header):sizeof(action)),1,actfile) != 1) {
-        return (rem_error_code = RE_READ);
+    if (set->bits[recno/8] & (1 << recno%8)) return 0;
+    if (set->nrec == set->size) {
+        int size = (set->size == 0? 256 : set->size*2);
+        RECNO* recs;
+
+        if ((recs = realloc(set->recs,size*sizeof(RECNO))) == NULL) return -1;
+        set->recs = recs;
+        set->size = size;
     }
+    set->bits[recno/8] |= 1 << recno%8;
+    set->recs[set->nrec++] = recno;
     return 0;
 }
 
-static int rec_write(int recno, void* data)
+static void recset_clear(struct st_recset* set)
 {
-    if (fseek(actfile,(long) sizeof(action)*recno,0) != RE_SEEKOK) {
-        return (rem_error_code = RE_SEEK);
+    for (int i=0; i<set->nrec; i++) {
+        set->bits[set->recs[i]/8] &= ~(1 << set->recs[i]%8);
+    }
+    set->nrec = 0;
+}
+
+static void recset_free(struct st_recset* set)
+{
+    free(set->recs);
+    free(set->bits);
+    memset(set,0,sizeof(*set));
+}
+
+/* Add a range to the set, extending the last range if they meet, as
+ * they do when the heap is appended to. */
+static int spans_add(struct st_spans* set, off_t off, size_t len)
+{
+    struct st_span* last = (set->n == 0? NULL : &set->v[set->n-1]);
+
+    if (last != NULL && last->off + (off_t) last->len == off) {
+        last->len += len;
+        return 0;
     }
-    if (fwrite(data,(recno==0?sizeof(header):sizeof(action)),1,actfile) != 1) {
-        return (rem_error_code = RE_WRITE);
+    if (set->n == set->size) {
+        int size = (set->size == 0? 64 : set->size*2);
+        struct st_span* v;
+
+        if ((v = realloc(set->v,size*sizeof(*v))) == NULL) return -1;
+        set->v = v;
+        set->size = size;
     }
+    set->v[set->n].off = off;
+    set->v[set->n].len = len;
+    set->n++;
     return 0;
 }
 
-/* Read action record at recno, return pointer to result. Note that
- * pointer refers to static data, so may be overwritten.  Save the
- * data needed. */
-ACTREC* act_read(int recno)
+static void spans_free(struct st_spans* set)
+{
+    free(set->v);
+    memset(set,0,sizeof(*set));
+}
+
+static void hdr_pack(DISKHDR* dh, REMHDR* h)
+{
+    memset(dh,0,sizeof(*dh));
+    memcpy(dh->magic,h->magic,sizeof(dh->magic));
+    for (int u=0; u<NURGENCY; u++) {
+        for (int lev=0; lev<SKIPLEV; lev++) {
+            dh->phead[u][lev] = PUT64(h->phead[u][lev]);
+            dh->whead[u][lev] = PUT64(h->whead[u][lev]);
+            dh->xhead[u][lev] = PUT64(h->xhead[u][lev]);
+        }
+        dh->shead[u] = PUT64(h->shead[u]);
+        dh->stail[u] = PUT64(h->stail[u]);
+        dh->pcount[u] = PUT64(h->pcount[u]);
+        dh->scount[u] = PUT64(h->scount[u]);
+    }
+    dh->fhead = PUT64(h->fhead);
+    dh->numrec = PUT64(h->numrec);
+    for (int i=0; i<URGCOL; i++) dh->ucol[i] = PUT32(h->ucol[i]);
+    dh->reccap = PUT64(h->reccap);
+    dh->heapbase = PUT64(h->heapbase);
+    dh->heapsize = PUT64(h->heapsize);
+    dh->heapfree = PUT64(h->heapfree);
+    dh->wakebase = PUT64(h->wakebase);
+}
+
+static void hdr_unpack(REMHDR* h, DISKHDR* dh)
+{
+    memset(h,0,sizeof(*h));
+    memcpy(h->magic,dh->magic,sizeof(h->magic));
+    h->magic[sizeof(h->magic)-1] = '\0';
+    for (int u=0; u<NURGENCY; u++) {
+        for (int lev=0; lev<SKIPLEV; lev++) {
+            h->phead[u][lev] = GET64(dh->phead[u][lev]);
+            h->whead[u][lev] = GET64(dh->whead[u][lev]);
+            h->xhead[u][lev] = GET64(dh->xhead[u][lev]);
+        }
+        h->shead[u] = GET64(dh->shead[u]);
+        h->stail[u] = GET64(dh->stail[u]);
+        h->pcount[u] = GET64(dh->pcount[u]);
+        h->scount[u] = GET64(dh->scount[u]);
+    }
+    h->fhead = GET64(dh->fhead);
+    h->numrec = GET64(dh->numrec);
+    for (int i=0; i<URGCOL; i++) h->ucol[i] = GET32(dh->ucol[i]);
+    h->reccap = GET64(dh->reccap);
+    h->heapbase = GET64(dh->heapbase);
+    h->heapsize = GET64(dh->heapsize);
+    h->heapfree = GET64(dh->heapfree);
+    h->wakebase = GET64(dh->wakebase);
+}
+
+/* The header occupies the start of the file and records 1 to reccap
+ * follow it, aligned for their 64 bit members.  The message heap comes
+ * after the records. */
+#define RECBASE \
+    ((sizeof(DISKHDR)+sizeof(int64_t)-1)/sizeof(int64_t)*sizeof(int64_t))
+
+static size_t rec_offset(RECNO recno)
+{
+    return (recno == 0? 0 : RECBASE + sizeof(DISKREC)*(recno-1));
+}
+
+/* Ensure the mapping covers the first need bytes of the file.  The
+ * file is grown geometrically and remapped, so pointers into the
+ * mapping are invalidated by any call that may extend the file. */
+static int map_reserve(size_t need)
+{
+    size_t newsize;
+    char* newmap;
+    struct st_recset* sets[] = {&rf->dirty, &rf->pending};
+    struct st_spans* spans[] = {&rf->heapdirty, &rf->heappending};
+
+    if (need <= rf->mapsize) return 0;
+    if (rf->readonly) return (rf->error_code = RE_WRITE);
+    newsize = rf->mapsize*2;
+    if (newsize < MAPMIN) newsize = MAPMIN;
+    if (newsize < need) newsize = need;
+    if (ftruncate(rf->actfd,(off_t) newsize) != 0) {
+        return (rf->error_code = RE_WRITE);
+    }
+    newmap = mmap(NULL,newsize,PROT_READ|PROT_WRITE,MAP_PRIVATE,rf->actfd,0);
+    if (newmap == MAP_FAILED) {
+        return (rf->error_code = RE_MAP);
+    }
+    rf->stats.maps++;
+    if (rf->actmap != NULL) {
+        /* carry over changes not yet in the file */
+        for (int s=0; s<2; s++) {
+            for (int i=0; i<sets[s]->nrec; i++) {
+                size_t off = rec_offset(sets[s]->recs[i]);
+                memcpy(newmap+off,rf->actmap+off,sizeof(DISKREC));
+            }
+            for (int i=0; i<spans[s]->n; i++) {
+                struct st_span* sp = &spans[s]->v[i];
+                memcpy(newmap+sp->off,rf->actmap+sp->off,sp->len);
+            }
+        }
+        munmap(rf->actmap,rf->mapsize);
+    }
+    rf->actmap = newmap;
+    rf->mapsize = newsize;
+    return 0;
+}
+
+/* Ensure there is room for records up to nrec-1.  Records grow into
+ * the space the heap occupies, so the heap is moved past both the
+ * records and its old place; the old copy stays intact until the move
+ * is committed, for rem_rollback. */
+static int rec_reserve(RECNO nrec)
 {
-    if (recno < 1 || recno > header.numrec) {
-        rem_error_code = RE_RECNO;
+    RECNO cap;
+    size_t newbase;
+
+    if (nrec-1 <= rf->header.reccap) return 0;
+    cap = rf->header.reccap*2;
+    if (cap < RECMIN) cap = RECMIN;
+    if (cap < nrec-1) cap = nrec-1;
+    newbase = rec_offset(cap+1);
+    if (newbase < (size_t) (rf->header.heapbase+rf->header.heapsize)) {
+        newbase = (size_t) (rf->header.heapbase+rf->header.heapsize);
+    }
+    if (map_reserve(newbase+(size_t) rf->header.heapsize) != 0) {
+        return rf->error_code;
+    }
+    memcpy(rf->actmap+newbase,rf->actmap+rf->header.heapbase,
+           (size_t) rf->header.heapsize);
+    rf->heapdirty.n = 0;
+    if (rf->header.heapsize > 0 &&
+        spans_add(&rf->heapdirty,(off_t) newbase,
+                  (size_t) rf->header.heapsize) != 0) {
+        return (rf->error_code = RE_WRITE);
+    }
+    rf->header.heapbase = (long long) newbase;
+    rf->header.reccap = (RECNO) ((newbase-RECBASE)/sizeof(DISKREC));
+    return 0;
+}
+
+/* Return pointer to record recno within the mapping, or NULL if the
+ * record lies outside the file. */
+static DISKREC* rec_ptr(RECNO recno)
+{
+    if (recno < 1 || recno > rf->header.reccap ||
+        rec_offset(recno+1) > rf->mapsize) {
+        rf->error_code = RE_READ;
         return NULL;
     }
-    if (rec_read(recno, &action) == 0) {
-        return &action;
+    return (DISKREC*) (rf->actmap + rec_offset(recno));
+}
+
+/* As rec_ptr, for a record about to be changed.  The first change
+ * since the last commit saves the record for rem_rollback. */
+static DISKREC* rec_wptr(RECNO recno)
+{
+    DISKREC* rec;
+    int ndirty = rf->dirty.nrec;
+
+    if ((rec = rec_ptr(recno)) == NULL) return NULL;
+    if (rf->readonly || recset_add(&rf->dirty,recno) != 0) {
+        rf->error_code = RE_WRITE;
+        return NULL;
     }
-    else {
+    if (rf->dirty.nrec > ndirty) {
+        if (rf->dirty.nrec > rf->undosize) {
+            DISKREC* newundo = realloc(rf->undo,
+                                       rf->dirty.size*sizeof(DISKREC));
+
+            if (newundo == NULL) {
+                rf->dirty.bits[recno/8] &= ~(1 << recno%8);
+                rf->dirty.nrec--;
+                rf->error_code = RE_WRITE;
+                return NULL;
+            }
+            rf->undo = newundo;
+            rf->undosize = rf->dirty.size;
+        }
+        rf->undo[ndirty] = *rec;
+        rf->stats.changed++;
+    }
+    return rec;
+}
+
+/* Return the message of rec within the mapping, or NULL if it does not
+ * lie within the heap.  A record with no message, as one nullified,
+ * reads ".", which takes no room in the heap. */
+static char* rec_msg(DISKREC* rec)
+{
+    int64_t off = GET64(rec->msgoff);
+    int32_t size = GET32(rec->msgsize);
+
+    if (size == 0) return ".";
+    if (off < 0 || size < 0 || off+size > rf->header.heapsize ||
+        rf->header.heapbase+rf->header.heapsize > (long long) rf->mapsize)
+        return NULL;
+    if (rf->actmap[rf->header.heapbase+off+size-1] != '\0') return NULL;
+    return rf->actmap + rf->header.heapbase + off;
+}
+
+/* Allocate size bytes at the end of the heap, returning their offset
+ * within it, or -1. */
+static long long heap_alloc(size_t size)
+{
+    long long off = rf->header.heapsize;
+
+    if (map_reserve((size_t) (rf->header.heapbase+off)+size) != 0) return -1;
+    if (spans_add(&rf->heapdirty,(off_t) (rf->header.heapbase+off),
+                  size) != 0) {
+        rf->error_code = RE_WRITE;
+        return -1;
+    }
+    rf->header.heapsize += (long long) size;
+    return off;
+}
+
+static long long heap_put(char* msg, size_t size)
+{
+    long long off = heap_alloc(size);
+
+    if (off >= 0) memcpy(rf->actmap+rf->header.heapbase+off,msg,size);
+    return off;
+}
+
+/* Copy the fields of an action, all but its message and wake list
+ * links, between the forms in memory and on file */
+static void rec_pack(DISKREC* rec, ACTREC* act)
+{
+    rec->time = PUT64(act->time);
+    rec->next_event = PUT64(act->next_event);
+    rec->occur = PUT64(act->occur);
+    rec->wake = PUT64(act->wake);
+    rec->next = PUT64(act->next);
+    rec->prev = PUT64(act->prev);
+    for (int i=0; i<SKIPLEV-1; i++) rec->skip[i] = PUT64(act->skip[i]);
+    rec->warning = PUT32(act->warning);
+    rec->timeout = PUT32(act->timeout);
+    rec->repeat_nday = PUT32(act->repeat.nday);
+    rec->type = (int8_t) act->type;
+    rec->urgency = (int8_t) act->urgency;
+    rec->repeat_type = (int8_t) act->repeat.type;
+    rec->repeat_day = (int8_t) act->repeat.day;
+}
+
+static void rec_unpack(ACTREC* act, DISKREC* rec)
+{
+    act->time = (time_t) GET64(rec->time);
+    act->next_event = (time_t) GET64(rec->next_event);
+    act->occur = (time_t) GET64(rec->occur);
+    act->wake = (time_t) GET64(rec->wake);
+    act->next = GET64(rec->next);
+    act->prev = GET64(rec->prev);
+    for (int i=0; i<SKIPLEV-1; i++) act->skip[i] = GET64(rec->skip[i]);
+    act->warning = GET32(rec->warning);
+    act->timeout = GET32(rec->timeout);
+    act->repeat.nday = GET32(rec->repeat_nday);
+    act->type = rec->type;
+    act->urgency = rec->urgency;
+    act->repeat.type = rec->repeat_type;
+    act->repeat.day = rec->repeat_day;
+}
+
+static int rec_read(RECNO recno, ACTREC* dest)
+{
+    DISKREC* rec;
+    char* msg;
+    size_t size;
+
+    if ((rec = rec_ptr(recno)) == NULL || (msg = rec_msg(rec)) == NULL) {
+        return (rf->error_code = RE_READ);
+    }
+    size = strlen(msg)+1;
+    if (size > rf->msgbufsize) {
+        char* buf = realloc(rf->msgbuf,size);
+
+        if (buf == NULL) return (rf->error_code = RE_MEMORY);
+        rf->msgbuf = buf;
+        rf->msgbufsize = size;
+    }
+    rec_unpack(dest,rec);
+    dest->msg = memcpy(rf->msgbuf,msg,size);
+    rf->stats.reads++;
+    rf->stats.read_bytes += (long long) (sizeof(DISKREC)+size);
+    return 0;
+}
+
+/* Write data to record recno.  The message goes to the heap unless the
+ * record holds it already; the space of the one it replaces is only
+ * recovered by compaction. */
+static int rec_put(RECNO recno, ACTREC* data)
+{
+    DISKREC* rec;
+    char* msg;
+    size_t size = strlen(data->msg)+1;
+    long long msgoff;
+
+    if (recno < 1 || rec_reserve(recno+1) != 0 ||
+        (rec = rec_ptr(recno)) == NULL) {
+        return (rf->error_code = RE_WRITE);
+    }
+    msgoff = GET64(rec->msgoff);
+    msg = rec_msg(rec);
+    if (msg == NULL || GET32(rec->msgsize) != (int32_t) size ||
+        strcmp(msg,data->msg) != 0) {
+        size_t oldsize = (msg == NULL? 0 : GET32(rec->msgsize));
+
+        if ((msgoff = heap_put(data->msg,size)) < 0) return rf->error_code;
+        rf->header.heapfree += (long long) oldsize;
+        idx_mark(&rf->idx,recno);
+    }
+    else if (rec->type != (int8_t) data->type) {
+        idx_mark(&rf->idx,recno);  /* a free record taken up */
+    }
+    if ((rec = rec_wptr(recno)) == NULL) return (rf->error_code = RE_WRITE);
+    rec_pack(rec,data);
+    rec->msgoff = PUT64(msgoff);
+    rec->msgsize = PUT32(size);
+    rf->stats.writes++;
+    rf->stats.write_bytes += (long long) (sizeof(DISKREC)+size);
+    return 0;
+}
+
+static int rec_write(RECNO recno, ACTREC* data)
+{
+    int rc;
+
+    trace_begin("rec_write","recno",recno);
+    rc = rec_put(recno,data);
+    trace_end("rec_write",NULL,0);
+    return rc;
+}
+
+/* Write committed changes through to the file */
+static int rec_apply(void)
+{
+    int rc = 0;
+
+    for (int i=0; i<rf->pending.nrec; i++) {
+        size_t off = rec_offset(rf->pending.recs[i]);
+
+        if (pwrite(rf->actfd,rf->actmap+off,sizeof(DISKREC),(off_t) off) !=
+            (ssize_t) sizeof(DISKREC)) rc = RE_WRITE;
+        rf->stats.pwrites++;
+        rf->stats.pwrite_bytes += (long long) sizeof(DISKREC);
+    }
+    recset_clear(&rf->pending);
+    for (int i=0; i<rf->heappending.n; i++) {
+        struct st_span* sp = &rf->heappending.v[i];
+
+        if (pwrite(rf->actfd,rf->actmap+sp->off,sp->len,sp->off) !=
+            (ssize_t) sp->len) rc = RE_WRITE;
+        rf->stats.pwrites++;
+        rf->stats.pwrite_bytes += (long long) sp->len;
+    }
+    rf->heappending.n = 0;
+    if (memcmp(&rf->hdr_logged,&rf->hdr_disk,sizeof(rf->header)) != 0) {
+        DISKHDR dh;
+
+        hdr_pack(&dh,&rf->hdr_logged);
+        if (pwrite(rf->actfd,&dh,sizeof(dh),0) != (ssize_t) sizeof(dh)) {
+            rc = RE_WRITE;
+        }
+        rf->stats.pwrites++;
+        rf->stats.pwrite_bytes += (long long) sizeof(dh);
+        rf->hdr_disk = rf->hdr_logged;
+    }
+    return (rc == 0? 0 : (rf->error_code = rc));
+}
+
+/* Log the changes made since the last commit to the journal as one
+ * transaction.  Under SYNC_FULL the journal is synced and the changes
+ * written to the file straight away; otherwise both wait for
+ * rem_cls, so a batch of commands costs a single sync. */
+int rem_commit(void)
+{
+    bool hdr_changed =
+        memcmp(&rf->header,&rf->hdr_logged,sizeof(rf->header)) != 0;
+    long long logged = (long long) (rf->dirty.nrec*sizeof(DISKREC));
+
+    if (rf->dirty.nrec == 0 && rf->heapdirty.n == 0 && !hdr_changed) return 0;
+    if (rf->readonly) return (rf->error_code = RE_WRITE);
+    for (int i=0; i<rf->dirty.nrec; i++) {
+        size_t off = rec_offset(rf->dirty.recs[i]);
+
+        if (jnl_append(&rf->jnl,(off_t) off,rf->actmap+off,
+                       sizeof(DISKREC)) != 0 ||
+            recset_add(&rf->pending,rf->dirty.recs[i]) != 0) {
+            return (rf->error_code = RE_WRITE);
+        }
+    }
+    recset_clear(&rf->dirty);
+    for (int i=0; i<rf->heapdirty.n; i++) {
+        struct st_span* sp = &rf->heapdirty.v[i];
+
+        if (jnl_append(&rf->jnl,sp->off,rf->actmap+sp->off,sp->len) != 0 ||
+            spans_add(&rf->heappending,sp->off,sp->len) != 0) {
+            return (rf->error_code = RE_WRITE);
+        }
+        logged += (long long) sp->len;
+    }
+    rf->heapdirty.n = 0;
+    if (hdr_changed) {
+        DISKHDR dh;
+
+        hdr_pack(&dh,&rf->header);
+        if (jnl_append(&rf->jnl,0,&dh,sizeof(dh)) != 0) {
+            return (rf->error_code = RE_WRITE);
+        }
+        rf->hdr_logged = rf->header;
+        logged += (long long) sizeof(dh);
+    }
+    if (jnl_commit(&rf->jnl) != 0) return (rf->error_code = RE_WRITE);
+    rf->journalled = true;
+    rf->stats.commits++;
+    rf->stats.logged += logged;
+    if (sync_policy == SYNC_FULL) {
+        rf->stats.syncs++;
+        if (jnl_sync(&rf->jnl) != 0) return (rf->error_code = RE_WRITE);
+        return rec_apply();
+    }
+    return 0;
+}
+
+/* Discard the changes made since the last commit.  Messages written
+ * since lie beyond the restored end of the heap. */
+void rem_rollback(void)
+{
+    for (int i=rf->dirty.nrec-1; i>=0; i--) {
+        memcpy(rf->actmap+rec_offset(rf->dirty.recs[i]),&rf->undo[i],
+               sizeof(DISKREC));
+    }
+    recset_clear(&rf->dirty);
+    rf->heapdirty.n = 0;
+    rf->header = rf->hdr_logged;
+    return;
+}
+
+/* Commit outstanding changes, make them durable in the file and
+ * discard the journal. */
+int rem_checkpoint(void)
+{
+    if (rem_commit() != 0) return rf->error_code;
+    if (!rf->journalled) return 0;
+    if (sync_policy != SYNC_NONE) rf->stats.syncs += 2;
+    if (sync_policy != SYNC_NONE && jnl_sync(&rf->jnl) != 0) {
+        return (rf->error_code = RE_WRITE);
+    }
+    if (rec_apply() != 0) return rf->error_code;
+    if (sync_policy != SYNC_NONE && fsync(rf->actfd) != 0) {
+        return (rf->error_code = RE_WRITE);
+    }
+    if (jnl_clear(&rf->jnl) != 0) return (rf->error_code = RE_WRITE);
+    rf->journalled = false;
+    idx_flush(&rf->idx,rf->actfd);
+    return 0;
+}
+
+/* Read action record at recno, return pointer to result. Note that
+ * pointer refers to static data, so may be overwritten.  Save the
+ * data needed. */
+ACTREC* act_read(RECNO recno)
+{
+    int rc;
+
+    if (recno < 1 || recno > rf->header.numrec) {
+        rf->error_code = RE_RECNO;
         return NULL;
     }
+    trace_begin("rec_read","recno",recno);
+    rc = rec_read(recno, &rf->action);
+    trace_end("rec_read",NULL,0);
+    return (rc == 0? &rf->action : NULL);
 }
 
-int act_write(int recno, ACTREC* data)
+/* Write data to action record recno, moving the action on the wake
+ * lists if its wake time, or the list it belongs on, changes. */
+int act_write(RECNO recno, ACTREC* data)
 {
-    if (recno < 1 || recno > header.numrec) {
-        rem_error_code = RE_RECNO;
+    DISKREC* rec;
+    int from, to;
+    bool relink;
+
+    if (recno < 1 || recno > rf->header.numrec) {
+        rf->error_code = RE_RECNO;
         return RE_RECNO;
     }
-    return rec_write(recno,data);
+    if ((rec = rec_ptr(recno)) == NULL) return rf->error_code;
+    from = wake_list(rec->type,rec->urgency,GET32(rec->timeout));
+    to = wake_list(data->type,data->urgency,data->timeout);
+    relink = (from != to ||
+              (to >= 0 && data->wake != (time_t) GET64(rec->wake)));
+    if (relink && from >= 0 && wake_remove(recno,from) != 0) {
+        return rf->error_code;
+    }
+    if (rec_write(recno,data) != 0) return rf->error_code;
+    if (relink && to >= 0) return wake_insert(recno,to);
+    return 0;
 }
 
+/* Commit any outstanding changes, write them through to the file and
+ * trim the file to the end of the heap. */
 int  rem_cls(void)
 {
-    rem_error_code = 0;
-    rec_write(0,&header);
-    return fclose(actfile);
+    int rc = 0;
+    size_t end = (size_t) (rf->header.heapbase+rf->header.heapsize);
+
+    trace_begin("rem_cls",NULL,0);
+    rf->error_code = 0;
+    if (rem_checkpoint() != 0) rc = EOF;
+    if (rf->actmap != NULL) {
+        munmap(rf->actmap,rf->mapsize);
+        rf->actmap = NULL;
+    }
+    if (!rf->readonly && rf->mapsize > end &&
+        ftruncate(rf->actfd,(off_t) end) != 0) {
+        rc = EOF;
+    }
+    if (!rf->readonly) idx_flush(&rf->idx,rf->actfd);
+    idx_close(&rf->idx);
+    rf->mapsize = 0;
+    if (close(rf->actfd) != 0) rc = EOF;
+    rf->actfd = -1;
+    recset_free(&rf->dirty);
+    recset_free(&rf->pending);
+    spans_free(&rf->heapdirty);
+    spans_free(&rf->heappending);
+    free(rf->undo);
+    rf->undo = NULL;
+    rf->undosize = 0;
+    jnl_close(&rf->jnl);
+    rf->readonly = false;
+    trace_end("rem_cls",NULL,0);
+    return rc;
 }
 
 
 bool rem_set_hilite(int ucol[])
 {
-    for (int i=0;i<URGCOL;i++) header.ucol[i] = ucol[i];
+    for (int i=0;i<URGCOL;i++) rf->header.ucol[i] = ucol[i];
     return true;
 }
 
 int* rem_get_hilite(void)
 {
-    return (int*) &(header.ucol);
+    return (int*) &(rf->header.ucol);
+}
+
+/* Open filename and lock it, shared for reading or exclusive for
+ * writing.  Compaction may replace the file while we wait for the
+ * lock, so retry until the file locked is the one named.  Returns the
+ * file descriptor, or -1. */
+static int lock_file(char* filename, bool writing)
+{
+    struct stat fst, nst;
+    int fd;
+
+    for (;;) {
+        if ((fd = open(filename,writing? O_RDWR : O_RDONLY)) < 0) return -1;
+        if (flock(fd,writing? LOCK_EX : LOCK_SH) != 0) break;
+        if (fstat(fd,&fst) != 0 || stat(filename,&nst) != 0) break;
+        if (fst.st_dev == nst.st_dev && fst.st_ino == nst.st_ino) return fd;
+        close(fd);
+    }
+    close(fd);
+    return -1;
+}
+
+/* Replay the journal into the file open, and locked exclusively, on
+ * actfd, and discard it.  A journal holding only a torn transaction is
+ * discarded too, or transactions committed after it would be appended
+ * behind it, where a later replay could not reach them. */
+static int recover(void)
+{
+    int ntx;
+
+    if ((ntx = jnl_replay(&rf->jnl,rf->actfd)) < 0 ||
+        (ntx > 0 && fsync(rf->actfd) != 0) ||
+        (jnl_pending(&rf->jnl) && jnl_clear(&rf->jnl) != 0)) {
+        return (rf->error_code = RE_JOURNAL);
+    }
+    return 0;
 }
 
 bool rem_create(char* filename, int ucol[]) {
-    actfile = fopen(filename,"w");
-    if (actfile) {
-        header.phead=header.shead=header.fhead = 0;
-        header.numrec = 1;
-        strncpy(header.magic,MAGIC,sizeof(header.magic)-1);
+    rf->actfd = open(filename,O_RDWR|O_CREAT,0666);
+    if (rf->actfd >= 0 && flock(rf->actfd,LOCK_EX) == 0 &&
+        ftruncate(rf->actfd,0) == 0 &&
+        jnl_open(&rf->jnl,filename)) {
+        /* a journal left for an earlier file must not be replayed,
+         * nor its index used */
+        jnl_clear(&rf->jnl);
+        if (idx_open(&rf->idx,filename,NULL)) idx_stale(&rf->idx);
+        rf->readonly = false;
+        memset(&rf->header,0,sizeof(rf->header));
+        memset(&rf->hdr_logged,0,sizeof(rf->header));
+        memset(&rf->hdr_disk,0,sizeof(rf->header));
+        rf->header.numrec = 1;
+        rf->header.heapbase = (long long) RECBASE;
+        strncpy(rf->header.magic,MAGIC,sizeof(rf->header.magic)-1);
         if (ucol) rem_set_hilite(ucol);
     }
     else {
-        rem_error_code = RE_CREATE;
+        if (rf->actfd >= 0) close(rf->actfd);
+        rf->actfd = -1;
+        rf->error_code = RE_CREATE;
     }
-    return actfile != NULL;
+    return rf->actfd >= 0;
 }
 
-bool rem_open(char* filename)
+static bool file_open(char* filename, int mode)
 {
-    actfile = fopen(filename,"r+");
-    if (actfile) {
-        rec_read(0,&header);
-        if (strcmp(header.magic,MAGIC) != 0) {
-            if (strncmp(header.magic, MAGIC, 3) != 0) {
-                rem_error_code = RE_VERSION;
+    struct stat st;
+    bool writing = (mode == OPEN_WRITE);
+
+    if (!jnl_open(&rf->jnl,filename)) {
+        rf->error_code = RE_OPEN;
+        return false;
+    }
+    rf->actfd = lock_file(filename,writing);
+    if (rf->actfd >= 0 && is_v4(rf->actfd)) {
+        /* a file from remind 1.4 is upgraded, under an exclusive lock,
+         * before it is used */
+        if (!writing) {
+            close(rf->actfd);
+            rf->actfd = lock_file(filename,true);
+        }
+        if (rf->actfd >= 0 && upgrade(filename) != 0) {
+            close(rf->actfd);
+            jnl_close(&rf->jnl);
+            rf->actfd = -1;
+            return false;
+        }
+        if (rf->actfd >= 0) close(rf->actfd);
+        rf->actfd = lock_file(filename,writing);
+    }
+    if (rf->actfd >= 0 && !writing && jnl_pending(&rf->jnl)) {
+        /* an update was interrupted: recover it as a writer would,
+         * then start reading afresh */
+        close(rf->actfd);
+        if ((rf->actfd = lock_file(filename,true)) >= 0 && recover() != 0) {
+            close(rf->actfd);
+            jnl_close(&rf->jnl);
+            rf->actfd = -1;
+            return false;
+        }
+        if (rf->actfd >= 0) close(rf->actfd);
+        rf->actfd = lock_file(filename,false);
+    }
+    if (rf->actfd < 0) {
+        rf->error_code = RE_OPEN;
+        jnl_close(&rf->jnl);
+        return false;
+    }
+    rf->readonly = !writing;
+
+    /* recover changes committed before a crash */
+    if (writing && recover() != 0) {
+        rf->error_code = RE_JOURNAL;
+    }
+    else if (fstat(rf->actfd,&st) != 0 || st.st_size < (off_t) RECBASE) {
+        rf->error_code = RE_VERSION;
+    }
+    else {
+        rf->actmap = mmap(NULL,(size_t) st.st_size,
+                      rf->readonly? PROT_READ : PROT_READ|PROT_WRITE,
+                      MAP_PRIVATE,rf->actfd,0);
+        rf->stats.maps++;
+        if (rf->actmap == MAP_FAILED) {
+            rf->actmap = NULL;
+            rf->error_code = RE_OPEN;
+        }
+        else {
+            rf->mapsize = (size_t) st.st_size;
+            hdr_unpack(&rf->header,(DISKHDR*) rf->actmap);
+            if (strcmp(rf->header.magic,MAGIC) != 0) {
+                if (strncmp(rf->header.magic, MAGIC, 3) != 0) {
+                    rf->error_code = RE_VERSION;
+                }
+                else {
+                    rf->error_code = RE_BADDB;
+                }
+            }
+            else if (rf->header.reccap < rf->header.numrec-1 ||
+                     rf->header.heapbase <
+                     (long long) rec_offset(rf->header.reccap+1) ||
+                     rf->header.heapsize < 0 ||
+                     rf->header.heapbase+rf->header.heapsize >
+                     (long long) rf->mapsize) {
+                rf->error_code = RE_BADDB;
             }
             else {
-                rem_error_code = RE_BADDB;
+                rf->hdr_logged = rf->hdr_disk = rf->header;
+                idx_open(&rf->idx,filename,&st);
+                return true;
             }
-            fclose(actfile);
-            actfile = NULL;
+            munmap(rf->actmap,rf->mapsize);
+            rf->actmap = NULL;
+            rf->mapsize = 0;
         }
     }
-    else {
-        rem_error_code = RE_OPEN;
-    }
-    return actfile != NULL;
+    close(rf->actfd);
+    rf->actfd = -1;
+    rf->readonly = false;
+    jnl_close(&rf->jnl);
+    return false;
 }
 
-static int next_rec = 0;
+/* Open the database file for reading, under a shared lock and without
+ * writing to it, or for writing, under an exclusive lock. */
+bool rem_open(char* filename, int mode)
+{
+    bool ok;
 
-bool act_iter_init(ACTYPE type)
+    trace_begin("rem_open",NULL,0);
+    ok = file_open(filename,mode);
+    trace_end("rem_open","records",(ok? rf->header.numrec-1 : -1));
+    return ok;
+}
+
+/* Each action type keeps one list per urgency.  Standard lists are
+ * appended to, so urgency order is kept by reading the lists in turn;
+ * periodic lists are skip lists (below) merged by date. */
+static int urgency_of(int urgency)
 {
-    switch (type) {
+    if (urgency < 0) return 0;
+    return (urgency >= NURGENCY? NURGENCY-1 : urgency);
+}
+
+/* Set up iteration over the actions of type, restricted to urgencies
+ * lo to hi inclusive. */
+bool act_iter_urgency(ACTYPE type, int lo, int hi)
+{
+    memset(rf->next_rec,0,sizeof(rf->next_rec));
+    rf->iter_type = type;
+    for (int u=urgency_of(lo); u<=urgency_of(hi); u++) {
+        switch (type) {
         case ACT_STANDARD:
-            next_rec = header.shead;
+            rf->next_rec[u] = rf->header.shead[u];
             break;
-        case  ACT_PERIODIC:
-            next_rec = header.phead;
+        case ACT_PERIODIC:
+            rf->next_rec[u] = rf->header.phead[u][0];
             break;
         case ACT_FREE:
-            next_rec = header.fhead;
-            break;
+            rf->next_rec[0] = rf->header.fhead;
+            return true;
         default:
             return false;
+        }
     }
     return true;
 }
 
-int act_iter_next()
+bool act_iter_init(ACTYPE type)
 {
-    int actno = 0;
-    ACTREC* activerec = &action;
-
-    if (next_rec != 0 && rec_read(next_rec,activerec) == 0) {
-        actno = next_rec;
-        next_rec = activerec->next;
-    }
-    return actno;
+    return act_iter_urgency(type,0,NURGENCY-1);
 }
 
-/* returns action number defined.  If negative, i/o error ocurred. */
-int act_define(ACTREC* newact)
+RECNO act_iter_next()
 {
-    int actno,last,current,*listhead;
-    ACTREC* activerec = &action;
+    RECNO actno = 0;
+    int u = -1;
+    DISKREC* activerec;
+    DISKREC* best = NULL;
 
-    /* find a free record */
-    if (header.fhead == 0)
-        actno = header.numrec++;
-    else {
-        actno = header.fhead;
-        if (rec_read(actno,activerec) != 0) return -actno;
-        header.fhead = activerec->next;
-    }
-
-    /* insert action into correct list */
-    if (newact->type == ACT_STANDARD) {
-        listhead = &header.shead;
-        current = header.shead;
-    }
-    else {
-        listhead = &header.phead;
-        current = header.phead;
-    }
-
-    last = 0;
-    while (current) {
-        if (rec_read(current, activerec) != 0) return -current;
-        if (newact->type == ACT_STANDARD &&
-            activerec->urgency > newact->urgency) break; /* urgency
-                                                            order */
-        else if (newact->type == ACT_PERIODIC) {
-            if (newact->time < activerec->time) break; /* date order */
+    trace_begin("act_iter_next",NULL,0);
+    rf->stats.iterations++;
+    for (int i=0; i<NURGENCY; i++) {
+        if (rf->next_rec[i] == 0) continue;
+        rf->stats.hops++;
+        if ((activerec = rec_ptr(rf->next_rec[i])) == NULL) {
+            u = -1;
+            break;
         }
-        last = current;
-        current = activerec->next;
-    }
-
-    if (last == 0) {  /* list empty or inserting at head */
-        newact->next = current;
-        *listhead = actno;
-    }
-    else {
-        if (current == 0) { /* inserting at end of list */
-            activerec->next = actno;
-            if (rec_write(last,activerec) != 0) return -last;
-            newact->next = 0; /* end of list marker  */
+        if (rf->iter_type != ACT_PERIODIC) {  /* lowest urgency first */
+            u = i;
+            break;
         }
-        else { /* inserting in middle of list */
-            if (rec_read(last,activerec) != 0) return -last;
-            activerec->next = actno;
-            if (rec_write(last,activerec) != 0) return -last;
-            newact->next = current;
+        if (best == NULL || GET64(activerec->time) < GET64(best->time) ||
+            (activerec->time == best->time &&
+             rf->next_rec[i] < rf->next_rec[u])) {
+            best = activerec;
+            u = i;
         }
     }
-    if (rec_write(actno,newact) != 0) return -actno;
+    if (u >= 0) {
+        actno = rf->next_rec[u];
+        rf->next_rec[u] = GET64(rec_ptr(actno)->next);
+    }
+    trace_end("act_iter_next","actno",actno);
     return actno;
 }
 
-int act_delete(int del_actno, bool nullify)
+/* Return the number of actions of type with the given urgency */
+RECNO act_count(ACTYPE type, int urgency)
 {
-    int actno,last,current;
-    ACTREC* activerec = &action;
-    ACTREC save;
-
-    if (del_actno <= 0) {
-        rem_error_code = RE_RECNO;
-        return RE_RECNO;
+    urgency = urgency_of(urgency);
+    switch (type) {
+    case ACT_STANDARD:
+        return rf->header.scount[urgency];
+    case ACT_PERIODIC:
+        return rf->header.pcount[urgency];
+    default:
+        return 0;
     }
+}
 
-    /* determine action type */
-    if (rec_read(del_actno,activerec) != 0) return rem_error_code;
-    if (activerec->type == ACT_FREE) {
-        rem_error_code = RE_ACTIONTYPE;
-        return RE_ACTIONTYPE;
-    }
+static int snapshot_grow(SNAPSHOT* snap, int size)
+{
+    void* p;
 
-    /* search correct list */
-    if (activerec->type == ACT_STANDARD)
-        current = header.shead;
-    else
-        current = header.phead;
-
-    last = 0;
-    while (current) {
-        if (rec_read(current,activerec) != 0) return rem_error_code;
-        if (current == del_actno) break;
-        last = current;
-        current = activerec->next;
-    }
-    if (last == 0) {  /* list empty or deleting head */
-        if (activerec->type == ACT_STANDARD)
-            header.shead = activerec->next;
-        else
-            header.phead = activerec->next;
+#define GROW(field) \
+    if ((p = realloc(snap->field,size*sizeof(*snap->field))) == NULL) \
+        return -1; \
+    snap->field = p;
+
+    GROW(actno);
+    GROW(time);
+    GROW(next_event);
+    GROW(warning);
+    GROW(urgency);
+    GROW(timeout);
+    GROW(repeat);
+    GROW(occur);
+#undef GROW
+    snap->size = size;
+    return 0;
+}
+
+/* Set entry i of snap to action actno, held in rec */
+static void snapshot_set(SNAPSHOT* snap, int i, RECNO actno, DISKREC* rec)
+{
+    rf->stats.snapped++;
+    snap->actno[i] = actno;
+    snap->time[i] = (time_t) GET64(rec->time);
+    snap->next_event[i] = (time_t) GET64(rec->next_event);
+    snap->warning[i] = GET32(rec->warning);
+    snap->urgency[i] = rec->urgency;
+    snap->timeout[i] = GET32(rec->timeout);
+    snap->repeat[i].type = rec->repeat_type;
+    snap->repeat[i].day = rec->repeat_day;
+    snap->repeat[i].nday = GET32(rec->repeat_nday);
+    snap->occur[i] = (time_t) GET64(rec->occur);
+}
+
+/* Fill snap with the actions on the type's lists for urgencies lo to
+ * hi, in the order act_iter_next gives them.  The arrays are reused,
+ * and grown if need be, by later calls. */
+int act_snapshot(SNAPSHOT* snap, ACTYPE type, int lo, int hi)
+{
+    RECNO actno, need = 0;
+    int n = 0;
+    DISKREC* rec;
+
+    for (int u=urgency_of(lo); u<=urgency_of(hi); u++) {
+        need += act_count(type,u);
+    }
+    if (need > snap->size &&
+        (need > INT_MAX || snapshot_grow(snap,(int) need) != 0)) {
+        return (rf->error_code = RE_MEMORY);
+    }
+    act_iter_urgency(type,lo,hi);
+    while ((actno = act_iter_next()) != 0 && n < snap->size) {
+        if ((rec = rec_ptr(actno)) == NULL) return rf->error_code;
+        snapshot_set(snap,n++,actno,rec);
+    }
+    snap->n = n;
+    return 0;
+}
+
+/* Free the arrays of snap */
+void act_snapshot_free(SNAPSHOT* snap)
+{
+    free(snap->actno);
+    free(snap->time);
+    free(snap->next_event);
+    free(snap->warning);
+    free(snap->urgency);
+    free(snap->timeout);
+    free(snap->repeat);
+    free(snap->occur);
+    memset(snap,0,sizeof(*snap));
+    return;
+}
+
+/* Periodic lists are skip lists ordered by action time.  Level 0 is
+ * the next pointer, so act_iter_next walks each as a plain list.  A
+ * record's height is a function of its record number, so it need not
+ * be stored. */
+static int skip_height(RECNO recno)
+{
+    unsigned int h = (unsigned int) (recno ^ recno >> 32);
+    int height = 1;
+
+    h ^= h >> 16;
+    h *= 0x45d9f3bu;
+    h ^= h >> 16;
+    while ((h & 3) == 0 && height < SKIPLEV) {  /* p = 1/4 */
+        height++;
+        h >>= 2;
+    }
+    return height;
+}
+
+/* Return the level lev forward link of recno, or -1 if it cannot be
+ * read; record 0 is the head of urgency u's list in the header. */
+static RECNO skip_get(RECNO recno, int lev, int u)
+{
+    DISKREC* rec;
+
+    if (recno == 0) return rf->header.phead[u][lev];
+    if ((rec = rec_ptr(recno)) == NULL) return -1;
+    return GET64(lev == 0? rec->next : rec->skip[lev-1]);
+}
+
+/* Set the level lev forward link of recno to link */
+static int skip_set(RECNO recno, int lev, int u, RECNO link)
+{
+    DISKREC* rec;
+
+    if (recno == 0) {
+        rf->header.phead[u][lev] = link;
+        return 0;
+    }
+    if ((rec = rec_wptr(recno)) == NULL) return rf->error_code;
+    *(lev == 0? &rec->next : &rec->skip[lev-1]) = PUT64(link);
+    return 0;
+}
+
+static int skip_walk(int u, time_t t, bool after_equal, RECNO update[],
+                     int* steps)
+{
+    RECNO x = 0, n;
+    DISKREC* rec;
+
+    for (int lev=SKIPLEV-1; lev>=0; lev--) {
+        for (;;) {
+            if ((n = skip_get(x,lev,u)) < 0) return rf->error_code;
+            if (n == 0) break;
+            if ((rec = rec_ptr(n)) == NULL) return rf->error_code;
+            (*steps)++;
+            if (GET64(rec->time) > t ||
+                (GET64(rec->time) == t && !after_equal)) break;
+            x = n;
+        }
+        update[lev] = x;
+    }
+    return 0;
+}
+
+/* Find, for each level of list u, the last record whose time is less
+ * than (or, if after_equal, no greater than) t. */
+static int skip_search(int u, time_t t, bool after_equal, RECNO update[])
+{
+    int rc, steps = 0;
+
+    trace_begin("skip_search","urgency",u);
+    rc = skip_walk(u,t,after_equal,update,&steps);
+    trace_end("skip_search","steps",steps);
+    return rc;
+}
+
+/* Set the prev pointer of recno, unless it is the end of the list */
+static int set_prev(RECNO recno, RECNO prev)
+{
+    DISKREC* rec;
+
+    if (recno == 0) return 0;
+    if ((rec = rec_wptr(recno)) == NULL) return rf->error_code;
+    rec->prev = PUT64(prev);
+    return 0;
+}
+
+/* Insert newact as record actno; equal times keep definition order */
+static int skip_insert(RECNO actno, ACTREC* newact)
+{
+    RECNO update[SKIPLEV];
+    int height, u = urgency_of(newact->urgency);
+
+    if (skip_search(u,newact->time,true,update) != 0) return rf->error_code;
+    newact->prev = update[0];
+    height = skip_height(actno);
+    for (int lev=0; lev<SKIPLEV; lev++) {
+        RECNO* newlink = (lev == 0? &newact->next : &newact->skip[lev-1]);
+
+        if (lev < height) {
+            if ((*newlink = skip_get(update[lev],lev,u)) < 0 ||
+                skip_set(update[lev],lev,u,actno) != 0) return rf->error_code;
+        }
+        else {
+            *newlink = 0;
+        }
+    }
+    return set_prev(newact->next,actno);
+}
+
+/* Unlink record actno, with time t, from every level of list u.  The
+ * prev pointer unlinks level 0 directly; only the upper levels of a
+ * taller record need their predecessors searched for. */
+static int skip_remove(RECNO actno, int u, time_t t)
+{
+    RECNO update[SKIPLEV], x, n, prev, next;
+    int height;
+    DISKREC* rec;
+
+    if ((rec = rec_ptr(actno)) == NULL) return rf->error_code;
+    prev = GET64(rec->prev);
+    next = GET64(rec->next);
+    if (skip_get(prev,0,u) != actno) return (rf->error_code = RE_LIST);
+    if (skip_set(prev,0,u,next) != 0 || set_prev(next,prev) != 0) {
+        return rf->error_code;
+    }
+
+    if ((height = skip_height(actno)) == 1) return 0;
+    if (skip_search(u,t,false,update) != 0) return rf->error_code;
+    for (int lev=1; lev<height; lev++) {
+        /* step over records with the same time */
+        x = update[lev];
+        while ((n = skip_get(x,lev,u)) != actno) {
+            if (n <= 0 || GET64(rec_ptr(n)->time) != t) {
+                return (rf->error_code = RE_LIST);
+            }
+            x = n;
+        }
+        if (skip_set(x,lev,u,skip_get(actno,lev,u)) != 0) {
+            return rf->error_code;
+        }
+    }
+    return 0;
+}
+
+/* Each urgency's periodic actions are also on a skip list ordered by
+ * wake time, the time from which display must look at them, then by
+ * record number, so no two keys are equal.  Its links, level 0 among
+ * them, are in wlink; record heights are as on the time lists.
+ * Standard actions that time out are likewise on an expiry list for
+ * their urgency, their wake time being the time they expire.  Lists
+ * 0 to NURGENCY-1 are the periodic wake lists and the expiry lists
+ * follow. */
+static int wake_list(int type, int urgency, int timeout)
+{
+    if (type == ACT_PERIODIC) return urgency_of(urgency);
+    if (type == ACT_STANDARD && timeout != 0)
+        return NURGENCY + urgency_of(urgency);
+    return -1;
+}
+
+/* Return the heads of wake list l in hdr */
+static RECNO* wake_head(REMHDR* hdr, int l)
+{
+    return (l < NURGENCY? hdr->whead[l] : hdr->xhead[l-NURGENCY]);
+}
+
+static RECNO wake_get(RECNO recno, int lev, int l)
+{
+    DISKREC* rec;
+
+    if (recno == 0) return wake_head(&rf->header,l)[lev];
+    if ((rec = rec_ptr(recno)) == NULL) return -1;
+    return GET64(rec->wlink[lev]);
+}
+
+static int wake_set(RECNO recno, int lev, int l, RECNO link)
+{
+    DISKREC* rec;
+
+    if (recno == 0) {
+        wake_head(&rf->header,l)[lev] = link;
+        return 0;
+    }
+    if ((rec = rec_wptr(recno)) == NULL) return rf->error_code;
+    rec->wlink[lev] = PUT64(link);
+    return 0;
+}
+
+static int wake_walk(int l, time_t wake, RECNO recno, RECNO update[],
+                     int* steps)
+{
+    RECNO x = 0, n;
+    DISKREC* rec;
+
+    for (int lev=SKIPLEV-1; lev>=0; lev--) {
+        for (;;) {
+            if ((n = wake_get(x,lev,l)) < 0) return rf->error_code;
+            if (n == 0) break;
+            if ((rec = rec_ptr(n)) == NULL) return rf->error_code;
+            (*steps)++;
+            if (GET64(rec->wake) > wake ||
+                (GET64(rec->wake) == wake && n >= recno)) break;
+            x = n;
+        }
+        update[lev] = x;
+    }
+    return 0;
+}
+
+/* Find, for each level of wake list l, the last record ordered before
+ * record recno with wake time wake. */
+static int wake_search(int l, time_t wake, RECNO recno, RECNO update[])
+{
+    int rc, steps = 0;
+
+    trace_begin("wake_search","list",l);
+    rc = wake_walk(l,wake,recno,update,&steps);
+    trace_end("wake_search","steps",steps);
+    return rc;
+}
+
+/* Link record recno, its wake time set, into wake list l */
+static int wake_insert(RECNO recno, int l)
+{
+    RECNO update[SKIPLEV], link;
+    int height = skip_height(recno);
+    DISKREC* rec;
+
+    if ((rec = rec_ptr(recno)) == NULL ||
+        wake_search(l,GET64(rec->wake),recno,update) != 0) {
+        return rf->error_code;
+    }
+    for (int lev=0; lev<SKIPLEV; lev++) {
+        link = 0;
+        if (lev < height &&
+            ((link = wake_get(update[lev],lev,l)) < 0 ||
+             wake_set(update[lev],lev,l,recno) != 0)) return rf->error_code;
+        if (wake_set(recno,lev,l,link) != 0) return rf->error_code;
+    }
+    return 0;
+}
+
+/* Unlink record recno from wake list l */
+static int wake_remove(RECNO recno, int l)
+{
+    RECNO update[SKIPLEV];
+    int height = skip_height(recno);
+    DISKREC* rec;
+
+    if ((rec = rec_ptr(recno)) == NULL ||
+        wake_search(l,GET64(rec->wake),recno,update) != 0) {
+        return rf->error_code;
+    }
+    for (int lev=0; lev<height; lev++) {
+        if (wake_get(update[lev],lev,l) != recno) {
+            return (rf->error_code = RE_LIST);
+        }
+        if (wake_set(update[lev],lev,l,wake_get(recno,lev,l)) != 0 ||
+            wake_set(recno,lev,l,0) != 0) return rf->error_code;
+    }
+    return 0;
+}
+
+/* Record numbers in order */
+static int recno_cmp(const void* a, const void* b)
+{
+    RECNO i = *(const RECNO*) a, j = *(const RECNO*) b;
+
+    return (i < j? -1 : i > j);
+}
+
+/* Records by time, then record number */
+static int due_cmp(const void* a, const void* b)
+{
+    RECNO i = *(const RECNO*) a, j = *(const RECNO*) b;
+    int64_t ti = GET64(rec_ptr(i)->time), tj = GET64(rec_ptr(j)->time);
+
+    if (ti != tj) return (ti < tj? -1 : 1);
+    return (i < j? -1 : 1);
+}
+
+/* Put the n records at recs, which share time t and are sorted by
+ * record number, in the order act_iter_next gives them: by position
+ * on each list, and between lists by record number.  Only the part
+ * of each list with time t is walked. */
+static int due_order(RECNO* recs, int n, time_t t, int lo, int hi)
+{
+    RECNO update[SKIPLEV], head[NURGENCY];
+    int m = 0;
+    DISKREC* rec;
+
+    for (int u=lo; u<=hi; u++) {
+        if (skip_search(u,t,false,update) != 0 ||
+            (head[u] = skip_get(update[0],0,u)) < 0) return rf->error_code;
+        if (head[u] != 0 && GET64(rec_ptr(head[u])->time) != t) head[u] = 0;
+    }
+    for (;;) {
+        int u = -1;
+
+        for (int v=lo; v<=hi; v++) {
+            if (head[v] != 0 && (u < 0 || head[v] < head[u])) u = v;
+        }
+        if (u < 0) break;
+        if (bsearch(&head[u],recs,n,sizeof(RECNO),recno_cmp) != NULL) {
+            if (m == n) return (rf->error_code = RE_LIST);
+            rf->dueout[m++] = head[u];
+        }
+        if ((rec = rec_ptr(head[u])) == NULL) return rf->error_code;
+        head[u] = GET64(rec->next);
+        if (head[u] != 0 &&
+            ((rec = rec_ptr(head[u])) == NULL || GET64(rec->time) != t)) {
+            head[u] = 0;
+        }
+    }
+    if (m != n) return (rf->error_code = RE_LIST);
+    memcpy(recs,rf->dueout,n*sizeof(RECNO));
+    return 0;
+}
+
+static int due_scan(SNAPSHOT* snap, int lo, int hi, time_t now)
+{
+    RECNO need = 0;
+    int n = 0;
+    DISKREC* rec;
+
+    if (now < rf->header.wakebase)
+        return act_snapshot(snap,ACT_PERIODIC,lo,hi);
+    lo = urgency_of(lo);
+    hi = urgency_of(hi);
+    for (int u=lo; u<=hi; u++) {
+        need += act_count(ACT_PERIODIC,u);
+    }
+    for (int u=lo; u<=hi; u++) {
+        for (RECNO r = rf->header.whead[u][0]; r != 0;
+             r = GET64(rec->wlink[0])) {
+            if ((rec = rec_ptr(r)) == NULL) return rf->error_code;
+            if (GET64(rec->wake) > now) break;
+            if (n == need) return (rf->error_code = RE_LIST);
+            if (n == rf->duesize) {
+                int size = (rf->duesize == 0? 64 : rf->duesize*2);
+                RECNO* p;
+
+                if ((p = realloc(rf->due,size*sizeof(RECNO))) == NULL) {
+                    return (rf->error_code = RE_MEMORY);
+                }
+                rf->due = p;
+                if ((p = realloc(rf->dueout,size*sizeof(RECNO))) == NULL) {
+                    return (rf->error_code = RE_MEMORY);
+                }
+                rf->dueout = p;
+                rf->duesize = size;
+            }
+            rf->due[n++] = r;
+        }
+    }
+
+    qsort(rf->due,n,sizeof(RECNO),due_cmp);
+    for (int i=0, j; i<n; i=j) {
+        time_t t = (time_t) GET64(rec_ptr(rf->due[i])->time);
+
+        for (j=i+1; j<n && GET64(rec_ptr(rf->due[j])->time) == t; j++) ;
+        if (j-i > 1 && due_order(rf->due+i,j-i,t,lo,hi) != 0) {
+            return rf->error_code;
+        }
+    }
+    if (n > snap->size && snapshot_grow(snap,n) != 0) {
+        return (rf->error_code = RE_MEMORY);
+    }
+    for (int i=0; i<n; i++) {
+        snapshot_set(snap,i,rf->due[i],rec_ptr(rf->due[i]));
+    }
+    snap->n = n;
+    return 0;
+}
+
+/* Fill snap, as act_snapshot does for periodic actions, with just
+ * those of urgencies lo to hi whose wake time has come by now.  Wake
+ * times worked out later than now can't be relied on, so then all are
+ * taken. */
+int act_due(SNAPSHOT* snap, int lo, int hi, time_t now)
+{
+    int rc;
+
+    trace_begin("act_due",NULL,0);
+    rc = due_scan(snap,lo,hi,now);
+    trace_end("act_due","actions",(rc == 0? snap->n : -1));
+    return rc;
+}
+
+static int expired_scan(SNAPSHOT* snap, int lo, int hi, time_t now)
+{
+    int n = 0;
+    DISKREC* rec;
+
+    for (int u=urgency_of(lo); u<=urgency_of(hi); u++) {
+        for (RECNO r = rf->header.xhead[u][0]; r != 0;
+             r = GET64(rec->wlink[0])) {
+            if ((rec = rec_ptr(r)) == NULL) return rf->error_code;
+            if (GET64(rec->wake) >= now) break;
+            if (n == snap->size &&
+                snapshot_grow(snap,(n == 0? 64 : 2*n)) != 0) {
+                return (rf->error_code = RE_MEMORY);
+            }
+            snapshot_set(snap,n++,r,rec);
+        }
+    }
+    snap->n = n;
+    return 0;
+}
+
+/* Fill snap with the standard actions of urgencies lo to hi that
+ * time out, whose wake time, when they expire, has passed by now.
+ * Only those actions are read, from the expiry lists. */
+int act_expired(SNAPSHOT* snap, int lo, int hi, time_t now)
+{
+    int rc;
+
+    trace_begin("act_expired",NULL,0);
+    rc = expired_scan(snap,lo,hi,now);
+    trace_end("act_expired","actions",(rc == 0? snap->n : -1));
+    return rc;
+}
+
+static RECNO define_rec(ACTREC* newact)
+{
+    RECNO actno;
+    int l, u = urgency_of(newact->urgency);
+    DISKREC* activerec;
+
+    /* find a free record; extend the file first, as that may move
+     * the mapping */
+    if (rf->header.fhead == 0) {
+        actno = rf->header.numrec;
+        if (rec_reserve(actno+1) != 0 ||
+            (activerec = rec_wptr(actno)) == NULL) return -actno;
+        memset(activerec,0,sizeof(DISKREC));
+        rf->header.numrec++;
     }
     else {
-        if (current == 0) { /* action not on list! */
-            rem_error_code = RE_LIST;
-            return RE_LIST;
+        actno = rf->header.fhead;
+        if ((activerec = rec_ptr(actno)) == NULL) return -actno;
+        rf->header.fhead = GET64(activerec->next);
+    }
+
+    if (newact->type == ACT_PERIODIC) {
+        /* date order */
+        if (skip_insert(actno,newact) != 0) return -actno;
+        rf->header.pcount[u]++;
+    }
+    else {
+        /* append to list for urgency */
+        memset(newact->skip,0,sizeof(newact->skip));
+        newact->next = 0;
+        newact->prev = rf->header.stail[u];
+        if (rf->header.stail[u] == 0) {
+            rf->header.shead[u] = actno;
         }
-        else { /* deleting in middle of list */
-            save = *activerec;             /* preserve action data */
-            actno = activerec->next;
-            if (rec_read(last, activerec) != 0) return rem_error_code;
-            activerec->next = actno;
-            if (rec_write(last,activerec) != 0) return rem_error_code;
-            *activerec = save;
+        else {
+            if ((activerec = rec_wptr(rf->header.stail[u])) == NULL) {
+                return -actno;
+            }
+            activerec->next = PUT64(actno);
         }
+        rf->header.stail[u] = actno;
+        rf->header.scount[u]++;
     }
-    activerec->next = header.fhead;
-    activerec->type = ACT_FREE;
+    if (rec_write(actno,newact) != 0) return -actno;
+    if ((l = wake_list(newact->type,u,newact->timeout)) >= 0 &&
+        wake_insert(actno,l) != 0) {
+        return -actno;
+    }
+    return actno;
+}
+
+/* returns action number defined.  If negative, i/o error ocurred. */
+RECNO act_define(ACTREC* newact)
+{
+    RECNO actno;
+
+    trace_begin("act_define",NULL,0);
+    actno = define_rec(newact);
+    trace_end("act_define","actno",actno);
+    return actno;
+}
+
+/* Put record actno, unlinked from its lists, at the head of the free
+ * list, clearing its fields and message if nullify is set */
+static int rec_free(RECNO actno, bool nullify)
+{
+    DISKREC* rec;
+
+    if ((rec = rec_wptr(actno)) == NULL) return rf->error_code;
+    rec->next = PUT64(rf->header.fhead);
+    rec->prev = 0;
+    rec->type = ACT_FREE;
+    memset(rec->skip,0,sizeof(rec->skip));
+    rf->header.fhead = actno;
     if (nullify) {
-        activerec->warning = 0;
-        activerec->urgency = 0;
-        activerec->time = 0;
-        activerec->timeout = 0;
-        activerec->msg[0] = '.';
-        memset(activerec->msg+1,'\0',MSGSIZ);
-    }
-    if (rec_write(current,activerec) != 0) return current;
-    header.fhead = current;
+        if (rec_msg(rec) != NULL) {
+            rf->header.heapfree += GET32(rec->msgsize);
+        }
+        rec->warning = 0;
+        rec->urgency = 0;
+        rec->time = 0;
+        rec->timeout = 0;
+        rec->occur = 0;
+        rec->wake = 0;
+        rec->msgoff = 0;
+        rec->msgsize = 0;
+    }
+    return 0;
+}
+
+static int delete_rec(RECNO del_actno, bool nullify)
+{
+    RECNO next, prev;
+    int u, l;
+    DISKREC* activerec;
+
+    if (del_actno <= 0 || del_actno >= rf->header.numrec) {
+        rf->error_code = RE_RECNO;
+        return RE_RECNO;
+    }
+
+    /* determine action type */
+    if ((activerec = rec_wptr(del_actno)) == NULL) return rf->error_code;
+    if (activerec->type == ACT_FREE) {
+        rf->error_code = RE_ACTIONTYPE;
+        return RE_ACTIONTYPE;
+    }
+
+    u = urgency_of(activerec->urgency);
+    next = GET64(activerec->next);
+    prev = GET64(activerec->prev);
+    l = wake_list(activerec->type,u,GET32(activerec->timeout));
+    if (l >= 0 && wake_remove(del_actno,l) != 0) return rf->error_code;
+    if (activerec->type == ACT_PERIODIC) {
+        if (skip_remove(del_actno,u,GET64(activerec->time)) != 0) {
+            return rf->error_code;
+        }
+        rf->header.pcount[u]--;
+    }
+    else {
+        DISKREC* prevrec = NULL;
+
+        if (prev != 0 && (prevrec = rec_wptr(prev)) == NULL) {
+            return rf->error_code;
+        }
+        if ((prevrec == NULL? rf->header.shead[u] : GET64(prevrec->next)) !=
+            del_actno) { /* action not on list! */
+            rf->error_code = RE_LIST;
+            return RE_LIST;
+        }
+        if (prevrec == NULL)
+            rf->header.shead[u] = next;
+        else
+            prevrec->next = PUT64(next);
+        if (next == 0)
+            rf->header.stail[u] = prev;
+        else if (set_prev(next,prev) != 0)
+            return rf->error_code;
+        rf->header.scount[u]--;
+    }
+    return rec_free(del_actno,nullify);
+}
+
+/* Delete action del_actno to the free list, clearing its fields and
+ * message if nullify is set.  Returns zero, or an error code. */
+int act_delete(RECNO del_actno, bool nullify)
+{
+    int rc;
+
+    trace_begin("act_delete","actno",del_actno);
+    rc = delete_rec(del_actno,nullify);
+    trace_end("act_delete",NULL,0);
+    return rc;
+}
+
+/* The links of the standard lists, for list_purge: record 0 is the
+ * head of urgency u's list, and there is only level 0 */
+static RECNO std_get(RECNO recno, int lev, int u)
+{
+    DISKREC* rec;
+
+    if (recno == 0) return rf->header.shead[u];
+    if ((rec = rec_ptr(recno)) == NULL) return -1;
+    return GET64(rec->next);
+}
+
+static int std_set(RECNO recno, int lev, int u, RECNO link)
+{
+    DISKREC* rec;
+
+    if (recno == 0) {
+        rf->header.shead[u] = link;
+        return 0;
+    }
+    if ((rec = rec_wptr(recno)) == NULL) return rf->error_code;
+    rec->next = PUT64(link);
+    return 0;
+}
+
+typedef RECNO (*LINKGET)(RECNO, int, int);
+typedef int (*LINKSET)(RECNO, int, int, RECNO);
+
+/* Splice the records marked in del out of levels 0 to nlev-1 of list
+ * l, whose links get and set give, walking each level once.  If prevs
+ * is set, level 0 is linked backwards as well, and *last set to the
+ * record left at its end. */
+static int list_purge(LINKGET get, LINKSET set, int l, int nlev,
+                      bool prevs, unsigned char* del, RECNO* last)
+{
+    RECNO x, n, after;
+
+    for (int lev=0; lev<nlev; lev++) {
+        x = 0;
+        while ((n = get(x,lev,l)) > 0) {
+            rf->stats.hops++;
+            if (!(del[n/8] & (1 << n%8))) {
+                x = n;
+                continue;
+            }
+            if ((after = get(n,lev,l)) < 0 || set(x,lev,l,after) != 0 ||
+                (prevs && lev == 0 && set_prev(after,x) != 0)) {
+                return rf->error_code;
+            }
+        }
+        if (n < 0) return rf->error_code;
+        if (lev == 0 && last != NULL) *last = x;
+    }
+    return 0;
+}
+
+static int delete_many(RECNO* recs, int n, bool nullify, unsigned char* del)
+{
+    bool plist[NURGENCY] = {false}, slist[NURGENCY] = {false};
+    bool wlist[2*NURGENCY] = {false};
+    RECNO live = 0;
+    int u, l;
+    DISKREC* rec;
+
+    /* check them all before changing any */
+    for (int i=0; i<n; i++) {
+        RECNO actno = recs[i];
+
+        if (actno <= 0 || actno >= rf->header.numrec) {
+            return (rf->error_code = RE_RECNO);
+        }
+        if ((rec = rec_ptr(actno)) == NULL) return rf->error_code;
+        if (rec->type == ACT_FREE || (del[actno/8] & (1 << actno%8))) {
+            return (rf->error_code = RE_ACTIONTYPE);
+        }
+        del[actno/8] |= 1 << actno%8;
+        u = urgency_of(rec->urgency);
+        if (rec->type == ACT_PERIODIC) plist[u] = true;
+        else slist[u] = true;
+        if ((l = wake_list(rec->type,u,GET32(rec->timeout))) >= 0) {
+            wlist[l] = true;
+        }
+    }
+
+    /* a few are cheaper to search for than to walk their lists for */
+    for (u=0; u<NURGENCY; u++) {
+        live += rf->header.pcount[u]+rf->header.scount[u];
+    }
+    if ((long long) n*32 < live) {
+        for (int i=0; i<n; i++) {
+            if (delete_rec(recs[i],nullify) != 0) return rf->error_code;
+        }
+        return 0;
+    }
+
+    for (l=0; l<2*NURGENCY; l++) {
+        if (wlist[l] && list_purge(wake_get,wake_set,l,SKIPLEV,false,del,
+                                   NULL) != 0) return rf->error_code;
+    }
+    for (u=0; u<NURGENCY; u++) {
+        if ((plist[u] && list_purge(skip_get,skip_set,u,SKIPLEV,true,del,
+                                    NULL) != 0) ||
+            (slist[u] && list_purge(std_get,std_set,u,1,true,del,
+                                    &rf->header.stail[u]) != 0)) {
+            return rf->error_code;
+        }
+    }
+    for (int i=0; i<n; i++) {
+        if ((rec = rec_wptr(recs[i])) == NULL) return rf->error_code;
+        u = urgency_of(rec->urgency);
+        if (wake_list(rec->type,u,GET32(rec->timeout)) >= 0) {
+            for (int lev=0; lev<skip_height(recs[i]); lev++) {
+                rec->wlink[lev] = 0;
+            }
+        }
+        if (rec->type == ACT_PERIODIC)
+            rf->header.pcount[u]--;
+        else
+            rf->header.scount[u]--;
+        if (rec_free(recs[i],nullify) != 0) return rf->error_code;
+    }
+    return 0;
+}
+
+/* Delete the n actions at recs, with the same result as act_delete on
+ * each in turn.  When they are many, they are spliced out of their
+ * lists together, in a single walk of each level of each list that
+ * holds any, rather than each being searched for.  Returns zero, or
+ * an error code, having deleted none if any is not in use. */
+int act_delete_many(RECNO* recs, int n, bool nullify)
+{
+    unsigned char* del = calloc(rf->header.numrec/8+1,1);
+    int rc;
+
+    if (del == NULL) return (rf->error_code = RE_MEMORY);
+    trace_begin("act_delete_many","actions",n);
+    rc = delete_many(recs,n,nullify,del);
+    trace_end("act_delete_many",NULL,0);
+    free(del);
+    return rc;
+}
+
+/* Return the message of action actno, or NULL if it is free */
+static char* live_msg(RECNO actno)
+{
+    DISKREC* rec = rec_ptr(actno);
+
+    if (rec == NULL || rec->type == ACT_FREE) return NULL;
+    return rec_msg(rec);
+}
+
+/* Find the actions whose messages hold text, ignoring case, through the
+ * index kept beside the file.  The index is saved when rebuilt only if
+ * no change is outstanding, as one might yet be rolled back.  Sets
+ * *found to the action numbers, in order, in storage the next search
+ * reuses.  Returns how many, or -1. */
+int act_search(char* text, RECNO** found)
+{
+    int n;
+    bool settled = (rf->dirty.nrec == 0 && rf->heapdirty.n == 0);
+
+    trace_begin("act_search",NULL,0);
+    n = idx_search(&rf->idx,text,rf->header.numrec,live_msg,rf->actfd,
+                   settled,found);
+    if (n < 0) rf->error_code = RE_MEMORY;
+    trace_end("act_search","actions",n);
+    return n;
+}
+
+/* Tails of the lists being built by list_append, for periodic and
+ * standard actions. */
+typedef RECNO LISTTAILS[2][NURGENCY][SKIPLEV];
+
+/* Append record recno, already in place in map, to the end of its
+ * list at every level it occupies.  Building lists from actions in
+ * order this way needs no searching. */
+static void list_append(char* map, REMHDR* hdr, LISTTAILS tails,
+                        RECNO recno)
+{
+    DISKREC* rec = (DISKREC*) (map + rec_offset(recno));
+    bool periodic = (rec->type == ACT_PERIODIC);
+    int u = urgency_of(rec->urgency);
+    RECNO* tail = tails[periodic? 0 : 1][u];
+    int height = (periodic? skip_height(recno) : 1);
+
+    rec->next = 0;
+    rec->prev = PUT64(tail[0]);
+    memset(rec->skip,0,sizeof(rec->skip));
+    for (int lev=0; lev<height; lev++) {
+        if (tail[lev] == 0 && periodic) {
+            hdr->phead[u][lev] = recno;
+        }
+        else if (tail[lev] == 0) {
+            hdr->shead[u] = recno;
+        }
+        else {
+            DISKREC* tailrec = (DISKREC*) (map + rec_offset(tail[lev]));
+
+            *(lev == 0? &tailrec->next : &tailrec->skip[lev-1]) = PUT64(recno);
+        }
+        tail[lev] = recno;
+    }
+    if (!periodic) hdr->stail[u] = recno;
+}
+
+static _Thread_local char* link_map;  /* file being linked by wake_link */
+
+/* Records on wake lists by list, then as on the lists */
+static int wake_cmp(const void* a, const void* b)
+{
+    RECNO i = *(const RECNO*) a, j = *(const RECNO*) b;
+    DISKREC* x = (DISKREC*) (link_map + rec_offset(i));
+    DISKREC* y = (DISKREC*) (link_map + rec_offset(j));
+    int lx = wake_list(x->type,x->urgency,GET32(x->timeout));
+    int ly = wake_list(y->type,y->urgency,GET32(y->timeout));
+
+    if (lx != ly) return (lx < ly? -1 : 1);
+    if (GET64(x->wake) != GET64(y->wake)) {
+        return (GET64(x->wake) < GET64(y->wake)? -1 : 1);
+    }
+    return (i < j? -1 : 1);
+}
+
+/* Build the wake lists of hdr, which must be empty, from the actions
+ * among records 1 to numrec-1, already in place in map. */
+static int wake_link(char* map, REMHDR* hdr, RECNO numrec)
+{
+    RECNO *order, n = 0, tail[2*NURGENCY][SKIPLEV];
+
+    if ((order = malloc((numrec > 1? numrec-1 : 1)*sizeof(RECNO))) == NULL) {
+        return (rf->error_code = RE_MEMORY);
+    }
+    for (RECNO recno=1; recno<numrec; recno++) {
+        DISKREC* rec = (DISKREC*) (map + rec_offset(recno));
+
+        if (wake_list(rec->type,rec->urgency,GET32(rec->timeout)) >= 0) {
+            order[n++] = recno;
+        }
+    }
+    link_map = map;
+    qsort(order,n,sizeof(RECNO),wake_cmp);
+    memset(tail,0,sizeof(tail));
+    for (RECNO i=0; i<n; i++) {
+        DISKREC* rec = (DISKREC*) (map + rec_offset(order[i]));
+        int l = wake_list(rec->type,rec->urgency,GET32(rec->timeout));
+        int height = skip_height(order[i]);
+
+        memset(rec->wlink,0,sizeof(rec->wlink));
+        for (int lev=0; lev<height; lev++) {
+            if (tail[l][lev] == 0) {
+                wake_head(hdr,l)[lev] = order[i];
+            }
+            else {
+                DISKREC* tailrec = (DISKREC*) (map + rec_offset(tail[l][lev]));
+
+                tailrec->wlink[lev] = PUT64(order[i]);
+            }
+            tail[l][lev] = order[i];
+        }
+    }
+    free(order);
+    return 0;
+}
+
+static _Thread_local ACTREC* load_acts;  /* actions being sorted by
+                                           * act_load */
+
+/* Periodic actions by date, then standard actions by urgency, each
+ * otherwise in the order given. */
+static int load_cmp(const void* a, const void* b)
+{
+    int i = *(const int*) a, j = *(const int*) b;
+    ACTREC* x = &load_acts[i];
+    ACTREC* y = &load_acts[j];
+
+    if (x->type != y->type) return (x->type == ACT_PERIODIC? -1 : 1);
+    if (x->type == ACT_PERIODIC && x->time != y->time) {
+        return (x->time < y->time? -1 : 1);
+    }
+    if (x->type != ACT_PERIODIC && x->urgency != y->urgency) {
+        return (x->urgency < y->urgency? -1 : 1);
+    }
+    return (i < j? -1 : 1);
+}
+
+/* Define n actions at once.  Into an empty database they are sorted,
+ * written to consecutive records and linked into their lists in a
+ * single pass; otherwise each is defined in turn.  Returns zero, or
+ * an error code. */
+int act_load(ACTREC* acts, int n)
+{
+    int* order;
+    LISTTAILS tails;
+    size_t heapneed = 0;
+    long long msgoff;
+
+    if (rf->header.numrec != 1) {
+        for (int i=0; i<n; i++) {
+            if (act_define(&acts[i]) < 0) return rf->error_code;
+        }
+        return 0;
+    }
+    if ((order = malloc((n > 0? n : 1)*sizeof(int))) == NULL) {
+        return (rf->error_code = RE_WRITE);
+    }
+    for (int i=0; i<n; i++) order[i] = i;
+    load_acts = acts;
+    qsort(order,n,sizeof(int),load_cmp);
+    for (int i=0; i<n; i++) heapneed += strlen(acts[i].msg)+1;
+    if (rec_reserve(n+1) != 0 || (msgoff = heap_alloc(heapneed)) < 0) {
+        free(order);
+        return rf->error_code;
+    }
+    memset(tails,0,sizeof(tails));
+    for (int recno=1; recno<=n; recno++) {
+        DISKREC* rec = rec_wptr(recno);
+        ACTREC* act = &acts[order[recno-1]];
+        size_t size = strlen(act->msg)+1;
+        int u;
+
+        if (rec == NULL) {
+            free(order);
+            return rf->error_code;
+        }
+        rec_pack(rec,act);
+        memcpy(rf->actmap+rf->header.heapbase+msgoff,act->msg,size);
+        rec->msgoff = PUT64(msgoff);
+        rec->msgsize = PUT32(size);
+        msgoff += (long long) size;
+        idx_mark(&rf->idx,recno);
+        list_append(rf->actmap,&rf->header,tails,recno);
+        u = urgency_of(rec->urgency);
+        if (rec->type == ACT_PERIODIC)
+            rf->header.pcount[u]++;
+        else
+            rf->header.scount[u]++;
+    }
+    rf->header.numrec = n+1;
+    free(order);
+    return wake_link(rf->actmap,&rf->header,rf->header.numrec);
+}
+
+/* Create a file to replace filename, locked and with the mode of the
+ * open file, of size bytes and mapped shared at *map.  Its name is
+ * made in tmpname, which must have room for filename and 7 more
+ * characters.  Returns its file descriptor, or -1. */
+static int replace_create(char* filename, char* tmpname, size_t size,
+                          char** map)
+{
+    struct stat st;
+    int fd;
+
+    sprintf(tmpname,"%s.XXXXXX",filename);
+    if ((fd = mkstemp(tmpname)) < 0) return -1;
+    if (flock(fd,LOCK_EX) != 0 || fstat(rf->actfd,&st) != 0 ||
+        fchmod(fd,st.st_mode & 0777) != 0 ||
+        ftruncate(fd,(off_t) size) != 0 ||
+        (*map = mmap(NULL,size,PROT_READ|PROT_WRITE,MAP_SHARED,
+                     fd,0)) == MAP_FAILED) {
+        close(fd);
+        unlink(tmpname);
+        return -1;
+    }
+    return fd;
+}
+
+/* Unmap the replacement made by replace_create, trim it to size bytes,
+ * sync it and rename it over filename, so the swap is atomic, then sync
+ * the directory so the rename survives a crash.  On failure the
+ * replacement is closed and, if not yet renamed, removed. */
+static int replace_install(char* filename, char* tmpname, int fd,
+                           char* map, size_t mapped, size_t size)
+{
+    int rc = msync(map,mapped,MS_SYNC);
+
+    munmap(map,mapped);
+    if (rc != 0 || (size < mapped && ftruncate(fd,(off_t) size) != 0) ||
+        fsync(fd) != 0 || rename(tmpname,filename) != 0) {
+        close(fd);
+        unlink(tmpname);
+        return -1;
+    }
+    if (rem_sync_dir(filename) != 0) {
+        close(fd);
+        return -1;
+    }
+    return 0;
+}
+
+/* Rewrite the database into a new file holding only live actions:
+ * periodic actions in date order, then standard actions in urgency
+ * order, renumbered from 1 with the free list dropped.  The new file
+ * is renamed over filename, so the swap is atomic, and becomes the
+ * open database. */
+int rem_compact(char* filename)
+{
+    RECNO nlive = 0, *order;
+    int newfd;
+    LISTTAILS tails;
+    char* tmpname;
+    char* newmap;
+    size_t newsize, heapsize = 0;
+    long long msgoff = 0;
+    REMHDR newhdr;
+    ACTYPE types[] = {ACT_PERIODIC, ACT_STANDARD};
+
+    /* settle outstanding changes, so the journal is empty when the
+     * file is replaced */
+    if (rem_checkpoint() != 0) return rf->error_code;
+    order = calloc(rf->header.numrec,sizeof(RECNO));
+    tmpname = malloc(strlen(filename)+8);
+    if (order == NULL || tmpname == NULL) {
+        free(order);
+        free(tmpname);
+        return (rf->error_code = RE_CREATE);
+    }
+    for (int t=0; t<2; t++) {
+        RECNO actno;
+
+        act_iter_init(types[t]);
+        while ((actno = act_iter_next()) != 0 && nlive < rf->header.numrec-1) {
+            order[nlive++] = actno;
+        }
+    }
+
+    for (RECNO i=0; i<nlive; i++) {
+        DISKREC* rec = rec_ptr(order[i]);
+
+        if (rec == NULL || rec_msg(rec) == NULL) {
+            free(order);
+            free(tmpname);
+            return (rf->error_code = RE_READ);
+        }
+        heapsize += GET32(rec->msgsize);
+    }
+    newsize = rec_offset(nlive+1) + heapsize;
+    if ((newfd = replace_create(filename,tmpname,newsize,&newmap)) < 0) {
+        free(order);
+        free(tmpname);
+        return (rf->error_code = RE_CREATE);
+    }
+
+    /* copy the actions in order and relink them */
+    newhdr = rf->header;
+    memset(newhdr.phead,0,sizeof(newhdr.phead));
+    memset(newhdr.whead,0,sizeof(newhdr.whead));
+    memset(newhdr.xhead,0,sizeof(newhdr.xhead));
+    memset(newhdr.shead,0,sizeof(newhdr.shead));
+    memset(newhdr.stail,0,sizeof(newhdr.stail));
+    newhdr.fhead = 0;
+    newhdr.numrec = nlive+1;
+    newhdr.reccap = nlive;
+    newhdr.heapbase = (long long) rec_offset(nlive+1);
+    newhdr.heapsize = (long long) heapsize;
+    newhdr.heapfree = 0;
+    memset(tails,0,sizeof(tails));
+    for (RECNO newno=1; newno<=nlive; newno++) {
+        DISKREC* rec = (DISKREC*) (newmap + rec_offset(newno));
+
+        *rec = *rec_ptr(order[newno-1]);
+        memcpy(newmap+newhdr.heapbase+msgoff,rec_msg(rec),
+               GET32(rec->msgsize));
+        rec->msgoff = PUT64(msgoff);
+        msgoff += GET32(rec->msgsize);
+        list_append(newmap,&newhdr,tails,newno);
+    }
+    free(order);
+    if (wake_link(newmap,&newhdr,newhdr.numrec) != 0) {
+        munmap(newmap,newsize);
+        close(newfd);
+        unlink(tmpname);
+        free(tmpname);
+        return rf->error_code;
+    }
+    hdr_pack((DISKHDR*) newmap,&newhdr);
+
+    if (replace_install(filename,tmpname,newfd,newmap,newsize,newsize) != 0) {
+        free(tmpname);
+        return (rf->error_code = RE_CREATE);
+    }
+    free(tmpname);
+
+    /* carry on with the new file, mapped privately like the old */
+    munmap(rf->actmap,rf->mapsize);
+    close(rf->actfd);
+    rf->actfd = newfd;
+    rf->actmap = mmap(NULL,newsize,PROT_READ|PROT_WRITE,MAP_PRIVATE,
+                      rf->actfd,0);
+    if (rf->actmap == MAP_FAILED) {
+        rf->actmap = NULL;
+        rf->mapsize = 0;
+        return (rf->error_code = RE_MAP);
+    }
+    rf->mapsize = newsize;
+    rf->header = rf->hdr_logged = rf->hdr_disk = newhdr;
+    idx_stale(&rf->idx);  /* the actions are renumbered */
+    return 0;
+}
+
+/* Sync the directory holding filename, so that a file renamed into it
+ * survives a crash */
+int rem_sync_dir(char* filename)
+{
+    char* dir = strdup(filename);
+    int fd, rc;
+
+    if (dir == NULL) return -1;
+    fd = open(dirname(dir),O_RDONLY|O_DIRECTORY);
+    free(dir);
+    if (fd < 0) return -1;
+    rc = fsync(fd);
+    close(fd);
+    return rc;
+}
+
+/* The format of remind 1.4 (rmd4), as written on 64 bit little-endian
+ * hosts: the header in record 0, then records of fixed size holding
+ * their messages, on a single list for each action type. */
+#define MAGIC_V4 "rmd4"
+
+enum {
+    V4MSGSIZ = 80
+};
+
+struct st_v4_hdr {
+    char magic[8];
+    int32_t phead;
+    int32_t shead;
+    int32_t fhead;
+    int32_t numrec;
+    int32_t ucol[URGCOL];
+};
+
+struct st_v4_rec {
+    int32_t type;
+    int32_t next;
+    int32_t urgency;
+    int32_t warning;
+    int64_t time;
+    int32_t repeat_type;
+    int32_t repeat_day;
+    int32_t repeat_nday;
+    int32_t timeout;
+    int64_t next_event;
+    char msg[V4MSGSIZ+1];
+};
+
+/* Return whether the file open on fd is a 1.4 file */
+static bool is_v4(int fd)
+{
+    char magic[8];
+
+    return pread(fd,magic,sizeof(magic),0) == (ssize_t) sizeof(magic) &&
+        strncmp(magic,MAGIC_V4,sizeof(magic)) == 0;
+}
+
+/* Return 1.4 record recno of map, marking it seen, or NULL at the end
+ * of a list or at a record seen already, as a damaged list may hold */
+static struct st_v4_rec* v4_take(char* map, RECNO numrec, RECNO recno,
+                                 unsigned char* seen)
+{
+    if (recno <= 0 || recno >= numrec || (seen[recno/8] & (1 << recno%8)))
+        return NULL;
+    seen[recno/8] |= 1 << recno%8;
+    return (struct st_v4_rec*) (map + recno*sizeof(struct st_v4_rec));
+}
+
+/* The level lev forward link of record recno of map on a periodic
+ * list or, if wake, a wake list; record 0 is the list head, in heads */
+static RECNO map_get(char* map, RECNO* heads, RECNO recno, int lev,
+                     bool wake)
+{
+    DISKREC* rec = (DISKREC*) (map + rec_offset(recno));
+
+    if (recno == 0) return heads[lev];
+    return GET64(wake? rec->wlink[lev] :
+                 lev == 0? rec->next : rec->skip[lev-1]);
+}
+
+static void map_set(char* map, RECNO* heads, RECNO recno, int lev,
+                    bool wake, RECNO link)
+{
+    DISKREC* rec = (DISKREC*) (map + rec_offset(recno));
+
+    if (recno == 0)
+        heads[lev] = link;
+    else
+        *(wake? &rec->wlink[lev] :
+          lev == 0? &rec->next : &rec->skip[lev-1]) = PUT64(link);
+}
+
+/* Whether record x of map comes before record recno: on a periodic
+ * list, where equal times keep the order linked, or on a wake list */
+static bool map_before(char* map, RECNO x, RECNO recno, bool wake)
+{
+    DISKREC* a = (DISKREC*) (map + rec_offset(x));
+    DISKREC* b = (DISKREC*) (map + rec_offset(recno));
+
+    if (!wake) return GET64(a->time) <= GET64(b->time);
+    return (GET64(a->wake) < GET64(b->wake) ||
+            (GET64(a->wake) == GET64(b->wake) && x < recno));
+}
+
+/* Link record recno of map into the periodic list, or if wake the
+ * wake list, with heads heads and whose last record at each level is
+ * in tail.  A record that belongs after the last is appended without
+ * searching; any other is searched for from the head. */
+static void map_insert(char* map, RECNO* heads, RECNO* tail, bool wake,
+                       RECNO recno)
+{
+    RECNO update[SKIPLEV], x = 0, n;
+    int height = skip_height(recno);
+
+    if (tail[0] == 0 || map_before(map,tail[0],recno,wake)) {
+        memcpy(update,tail,sizeof(update));
+    }
+    else {
+        for (int lev=SKIPLEV-1; lev>=0; lev--) {
+            while ((n = map_get(map,heads,x,lev,wake)) != 0 &&
+                   map_before(map,n,recno,wake)) x = n;
+            update[lev] = x;
+        }
+    }
+    for (int lev=0; lev<height; lev++) {
+        n = map_get(map,heads,update[lev],lev,wake);
+        map_set(map,heads,recno,lev,wake,n);
+        map_set(map,heads,update[lev],lev,wake,recno);
+        if (n == 0) tail[lev] = recno;
+    }
+    if (!wake) {
+        DISKREC* rec = (DISKREC*) (map + rec_offset(recno));
+
+        rec->prev = PUT64(update[0]);
+        if ((n = GET64(rec->next)) != 0) {
+            ((DISKREC*) (map + rec_offset(n)))->prev = PUT64(recno);
+        }
+    }
+}
+
+/* Append record recno of map to the free list of hdr, whose last
+ * record is *tail */
+static void free_append(char* map, REMHDR* hdr, RECNO* tail, RECNO recno)
+{
+    if (*tail == 0)
+        hdr->fhead = recno;
+    else
+        ((DISKREC*) (map + rec_offset(*tail)))->next = PUT64(recno);
+    *tail = recno;
+}
+
+/* Convert the 1.4 file open, and locked exclusively, on actfd to the
+ * current format, keeping the action numbers.  The records are
+ * streamed: each is copied once, then linked as the 1.4 lists are
+ * walked.  The 1.4 periodic list is already in date order, so its
+ * actions are appended to the new lists; only one out of place is
+ * searched for.  The new file is written beside the old and renamed
+ * over it, so an interrupted upgrade leaves the 1.4 file as it was.
+ * The caller must then reopen filename. */
+static int upgrade(char* filename)
+{
+    struct stat st;
+    struct st_v4_hdr* oldhdr;
+    struct st_v4_rec* old;
+    unsigned char* seen = NULL;
+    char *oldmap, *newmap, *tmpname = NULL;
+    RECNO numrec, ftail = 0, wtails[2*NURGENCY][SKIPLEV];
+    int newfd;
+    size_t mapped, newsize;
+    REMHDR newhdr;
+    LISTTAILS tails;
+
+    if (fstat(rf->actfd,&st) != 0 || st.st_size < (off_t) sizeof(*oldhdr)) {
+        return (rf->error_code = RE_VERSION);
+    }
+    oldmap = mmap(NULL,(size_t) st.st_size,PROT_READ,MAP_SHARED,rf->actfd,0);
+    if (oldmap == MAP_FAILED) return (rf->error_code = RE_MAP);
+    oldhdr = (struct st_v4_hdr*) oldmap;
+    numrec = GET32(oldhdr->numrec);
+    if (strncmp(oldhdr->magic,MAGIC_V4,sizeof(oldhdr->magic)) != 0) {
+        /* upgraded while we waited for the lock */
+        munmap(oldmap,(size_t) st.st_size);
+        return 0;
+    }
+    if (numrec < 1 ||
+        (off_t) numrec*(off_t) sizeof(struct st_v4_rec) > st.st_size) {
+        munmap(oldmap,(size_t) st.st_size);
+        return (rf->error_code = RE_BADDB);
+    }
+
+    /* room for every message at its longest; trimmed when done */
+    mapped = rec_offset(numrec) + (size_t) (numrec-1)*(V4MSGSIZ+1);
+    if ((seen = calloc(numrec/8+1,1)) == NULL ||
+        (tmpname = malloc(strlen(filename)+8)) == NULL ||
+        (newfd = replace_create(filename,tmpname,mapped,&newmap)) < 0) {
+        free(seen);
+        free(tmpname);
+        munmap(oldmap,(size_t) st.st_size);
+        return (rf->error_code = RE_CREATE);
+    }
+
+    memset(&newhdr,0,sizeof(newhdr));
+    strncpy(newhdr.magic,MAGIC,sizeof(newhdr.magic)-1);
+    for (int i=0; i<URGCOL; i++) newhdr.ucol[i] = GET32(oldhdr->ucol[i]);
+    newhdr.numrec = numrec;
+    newhdr.reccap = numrec-1;
+    newhdr.heapbase = (long long) rec_offset(numrec);
+
+    /* copy each record, with its message to the heap, as free */
+    for (RECNO recno=1; recno<numrec; recno++) {
+        DISKREC* rec = (DISKREC*) (newmap + rec_offset(recno));
+        size_t size;
+
+        old = (struct st_v4_rec*) (oldmap + recno*sizeof(*old));
+        size = strnlen(old->msg,V4MSGSIZ);
+        rec->time = old->time;
+        rec->next_event = old->next_event;
+        rec->warning = old->warning;
+        rec->timeout = old->timeout;
+        rec->repeat_nday = old->repeat_nday;
+        rec->type = ACT_FREE;
+        rec->urgency = (int8_t) GET32(old->urgency);
+        rec->repeat_type = (int8_t) GET32(old->repeat_type);
+        rec->repeat_day = (int8_t) GET32(old->repeat_day);
+        memcpy(newmap+newhdr.heapbase+newhdr.heapsize,old->msg,size);
+        newmap[newhdr.heapbase+newhdr.heapsize+size] = '\0';
+        rec->msgoff = PUT64(newhdr.heapsize);
+        rec->msgsize = PUT32(size+1);
+        newhdr.heapsize += (long long) size+1;
+    }
+
+    /* link the actions into the lists for their urgencies, in the
+     * order of the 1.4 lists */
+    memset(tails,0,sizeof(tails));
+    for (RECNO recno = GET32(oldhdr->phead);
+         (old = v4_take(oldmap,numrec,recno,seen)) != NULL;
+         recno = GET32(old->next)) {
+        DISKREC* rec = (DISKREC*) (newmap + rec_offset(recno));
+        int u = urgency_of(rec->urgency);
+
+        rec->type = ACT_PERIODIC;
+        map_insert(newmap,newhdr.phead[u],tails[0][u],false,recno);
+        newhdr.pcount[u]++;
+    }
+    for (RECNO recno = GET32(oldhdr->shead);
+         (old = v4_take(oldmap,numrec,recno,seen)) != NULL;
+         recno = GET32(old->next)) {
+        DISKREC* rec = (DISKREC*) (newmap + rec_offset(recno));
+
+        rec->type = ACT_STANDARD;
+        list_append(newmap,&newhdr,tails,recno);
+        newhdr.scount[urgency_of(rec->urgency)]++;
+        if (GET32(rec->timeout) != 0) {
+            /* a standard action wakes when it times out */
+            rec->wake = PUT64(GET64(rec->time) +
+                              (GET32(rec->timeout)-1)*86400LL);
+        }
+    }
+
+    /* wake times are worked out when the file is first displayed; till
+     * then every periodic action is on its wake list at time 0, so in
+     * record number order */
+    memset(wtails,0,sizeof(wtails));
+    for (RECNO recno=1; recno<numrec; recno++) {
+        DISKREC* rec = (DISKREC*) (newmap + rec_offset(recno));
+        int l = wake_list(rec->type,rec->urgency,GET32(rec->timeout));
+
+        if (l >= 0) {
+            map_insert(newmap,wake_head(&newhdr,l),wtails[l],true,recno);
+        }
+    }
+
+    /* the rest are free: those on the 1.4 free list first, in order,
+     * then any on no list */
+    for (RECNO recno = GET32(oldhdr->fhead);
+         (old = v4_take(oldmap,numrec,recno,seen)) != NULL;
+         recno = GET32(old->next)) {
+        free_append(newmap,&newhdr,&ftail,recno);
+    }
+    for (RECNO recno=1; recno<numrec; recno++) {
+        if (v4_take(oldmap,numrec,recno,seen) != NULL)
+            free_append(newmap,&newhdr,&ftail,recno);
+    }
+    munmap(oldmap,(size_t) st.st_size);
+    free(seen);
+
+    hdr_pack((DISKHDR*) newmap,&newhdr);
+    newsize = (size_t) (newhdr.heapbase+newhdr.heapsize);
+    if (replace_install(filename,tmpname,newfd,newmap,mapped,newsize) != 0) {
+        free(tmpname);
+        return (rf->error_code = RE_CREATE);
+    }
+    free(tmpname);
+    close(newfd);
     return 0;
 }
 
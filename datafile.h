@@ -4,11 +4,12 @@
 #include <stdbool.h>
 #include <time.h>
 
-#define MAGIC "rmd4"
+#define MAGIC "rmd11"
 
 enum {
-    MSGSIZ = 80,
-    URGCOL = 8
+    URGCOL = 8,
+    NURGENCY = 5,  /* urgencies 0 (background) to 4 */
+    SKIPLEV = 10  /* levels in periodic action skip list */
 };
 
 enum rem_errors {
@@ -21,7 +22,21 @@ enum rem_errors {
     RE_VERSION,
     RE_BADDB,
     RE_ACTIONTYPE,
-    RE_LIST
+    RE_LIST,
+    RE_MAP,
+    RE_JOURNAL,
+    RE_MEMORY
+};
+
+enum sync_policy {
+    SYNC_NONE,   /* journal changes, but never sync */
+    SYNC_BATCH,  /* sync once, when the database is closed */
+    SYNC_FULL    /* sync at every commit */
+};
+
+enum open_mode {
+    OPEN_READ,   /* shared lock; no changes allowed */
+    OPEN_WRITE   /* exclusive lock */
 };
 
 enum act_type {
@@ -38,6 +53,8 @@ enum repeat_type {
     RT_MONTH_WEEK
 };
 
+typedef long long RECNO;  /* record number, which is the action number */
+
 struct st_repeat {
     enum repeat_type type;
     int day;   /* day of week */
@@ -46,16 +63,30 @@ struct st_repeat {
 
 struct st_remfile_hdr {
     char magic[8];  /* remind file identifier */
-    int phead;      /* periodic action list pointer */
-    int shead;      /* standard action list pointer */
-    int fhead;      /* free list pointer */
-    int numrec;     /* number of records in file */
+    RECNO phead[NURGENCY][SKIPLEV]; /* periodic action skip list heads,
+                                     * by urgency */
+    RECNO whead[NURGENCY][SKIPLEV]; /* periodic action wake list heads,
+                                     * by urgency */
+    RECNO xhead[NURGENCY][SKIPLEV]; /* expiry list heads of standard
+                                     * actions that time out, by urgency */
+    RECNO shead[NURGENCY]; /* standard action list pointers, by urgency */
+    RECNO stail[NURGENCY]; /* standard action list tails, by urgency */
+    RECNO pcount[NURGENCY]; /* number of periodic actions, by urgency */
+    RECNO scount[NURGENCY]; /* number of standard actions, by urgency */
+    RECNO fhead;    /* free list pointer */
+    RECNO numrec;   /* number of records in file */
     int ucol[URGCOL];/* urgency colour pairs */
+    RECNO reccap;   /* records the file has room for */
+    long long heapbase;  /* file offset of message heap */
+    long long heapsize;  /* bytes of heap in use */
+    long long heapfree;  /* bytes of heap holding old messages */
+    long long wakebase;  /* latest time wake times were worked out at */
 };
 
 struct st_action_rec {
     enum act_type type;      /* action type */
-    int next;                /* pointer to next action on list */
+    RECNO next;              /* pointer to next action on list */
+    RECNO prev;              /* pointer to previous action on list */
     int urgency;             /* urgency of this action */
     int warning;             /* warning required for this action (periodic
                               * only) */
@@ -64,27 +95,92 @@ struct st_action_rec {
     int timeout;             /* timeout value in days; zero for no timeout */
     time_t next_event;       /* contains time of next periodic event,
                               * if current snoozed */
-    char msg[MSGSIZ+1];      /* the action message */
+    char* msg;               /* the action message */
+    time_t occur;            /* next event, as of when wake was set
+                              * (periodic only) */
+    time_t wake;             /* time from which display must look at
+                              * the action; for a standard action that
+                              * times out, when it expires */
+    RECNO skip[SKIPLEV-1];   /* periodic skip list pointers, levels 1
+                              * and up; next is level 0 */
+};
+
+/* Fields of a set of actions held as parallel arrays, in list order,
+ * so they can be scanned without reading whole records */
+struct st_snapshot {
+    int n;                      /* number of actions */
+    int size;                   /* entries allocated */
+    RECNO* actno;
+    time_t* time;
+    time_t* next_event;
+    int* warning;
+    int* urgency;
+    int* timeout;
+    struct st_repeat* repeat;
+    time_t* occur;
+};
+
+/* Counts of the work done on database files through a handle */
+struct st_rem_stats {
+    long long reads;        /* whole records read */
+    long long read_bytes;   /* and their size, with messages */
+    long long writes;       /* records written */
+    long long write_bytes;
+    long long changed;      /* records changed in each transaction,
+                             * links included */
+    long long pwrites;      /* writes through to the file */
+    long long pwrite_bytes;
+    long long snapped;      /* actions taken into snapshots */
+    long long iterations;   /* calls of act_iter_next */
+    long long hops;         /* list heads they looked at */
+    long long maps;         /* times a file was mapped */
+    long long commits;      /* transactions journalled */
+    long long logged;       /* bytes journalled */
+    long long syncs;        /* files synced */
 };
 
 typedef struct st_remfile_hdr REMHDR;
 typedef struct st_action_rec ACTREC;
 typedef enum act_type ACTYPE;
+typedef struct st_snapshot SNAPSHOT;
+typedef struct st_remfile REMFILE;
+typedef struct st_rem_stats REMSTATS;
 
 /* public function prototypes */
+extern REMFILE* rem_new(void);
+extern REMFILE* rem_use(REMFILE*);
+extern void rem_free(REMFILE*);
 extern int rem_error(void);
-extern ACTREC* act_read(int);
-extern int act_write(int,ACTREC*);
+extern REMSTATS* rem_stats(void);
+extern ACTREC* act_read(RECNO);
+extern int act_write(RECNO,ACTREC*);
 extern int rem_cls(void);
 extern bool rem_create(char*, int[]);
-extern bool rem_open(char*);
+extern bool rem_open(char*, int);
 extern bool act_iter_init(ACTYPE);
-extern int act_iter_next(void);
+extern bool act_iter_urgency(ACTYPE, int, int);
+extern RECNO act_iter_next(void);
+extern RECNO act_count(ACTYPE, int);
+extern int act_snapshot(SNAPSHOT*, ACTYPE, int, int);
+extern void act_snapshot_free(SNAPSHOT*);
+extern int act_due(SNAPSHOT*, int, int, time_t);
+extern int act_expired(SNAPSHOT*, int, int, time_t);
 extern bool rem_set_hilite(int[]);
 extern int* rem_get_hilite(void);
-extern int act_define(ACTREC*);
-extern int act_delete(int, bool);
+extern RECNO act_define(ACTREC*);
+extern int act_delete(RECNO, bool);
+extern int act_delete_many(RECNO*, int, bool);
+extern int act_load(ACTREC*, int);
+extern int act_search(char*, RECNO**);
+extern int rem_compact(char*);
+extern int rem_commit(void);
+extern int rem_checkpoint(void);
+extern void rem_rollback(void);
+extern void rem_set_sync(int);
+extern void rem_set_wakebase(time_t);
+extern bool rem_readonly(void);
 extern REMHDR* rem_header(void);
+extern int rem_sync_dir(char*);
 extern char* str_act_type(int);
 
 #endif
@@ -1,10 +1,308 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 
 #include "date.h"
 
+enum {
+    SECSPERDAY = 86400,
+    ZONE_CHUNK = 366*SECSPERDAY,  /* span of time probed at once */
+    ZONE_STRIDE = 6*SECSPERDAY,   /* less than the shortest DST period */
+    ZONE_REACH = 200,             /* chunks beyond the table probed
+                                   * directly rather than added */
+    MK_STRIDE = 601200,           /* as glibc's mktime, when looking */
+    MK_BOUND = 457243200/2+601200 /* for a time with the DST flag asked */
+};
+
 static time_t fake_time = 0;
 
+static long long floor_div(long long a, long long b)
+{
+    return a/b - (a%b < 0);
+}
+
+/* Days from 1/1/1970 to day d of month m (1 to 12) of year y, in the
+ * proleptic Gregorian calendar */
+static long long days_from_civil(long long y, int m, int d)
+{
+    long long era;
+    unsigned int yoe, doy, doe;
+
+    y -= (m <= 2);
+    era = floor_div(y,400);
+    yoe = (unsigned int) (y - era*400);
+    doy = (153*(m > 2? m-3 : m+9) + 2)/5 + d-1;
+    doe = yoe*365 + yoe/4 - yoe/100 + doy;
+    return era*146097 + (long long) doe - 719468;
+}
+
+/* The year, month (1 to 12) and day of the day z days from 1/1/1970 */
+static void civil_from_days(long long z, long long* y, int* m, int* d)
+{
+    long long era;
+    unsigned int doe, yoe, doy, mp;
+
+    z += 719468;
+    era = floor_div(z,146097);
+    doe = (unsigned int) (z - era*146097);
+    yoe = (doe - doe/1460 + doe/36524 - doe/146096) / 365;
+    doy = doe - (365*yoe + yoe/4 - yoe/100);
+    mp = (5*doy + 2)/153;
+    *d = (int) (doy - (153*mp + 2)/5 + 1);
+    *m = (int) (mp < 10? mp+3 : mp-9);
+    *y = (long long) yoe + era*400 + (*m <= 2);
+}
+
+/* The local time zone, as spans of time over which the UTC offset and
+ * DST flag are constant.  The table is built by probing localtime, a
+ * year at a time as times outside it are looked up, and is kept for
+ * the life of the thread; each thread builds its own, so reports may
+ * run in parallel. */
+struct st_span {
+    time_t start;  /* first second of the span */
+    long off;      /* seconds east of UTC */
+    int isdst;
+    char abbr[8];  /* zone abbreviation */
+};
+
+static _Thread_local struct st_span* spans = NULL;
+static _Thread_local int nspans = 0, spansize = 0;
+static _Thread_local time_t zone_lo, zone_hi;  /* times covered by the table */
+
+static void zone_probe(time_t t, struct st_span* s)
+{
+    struct tm tm;
+
+    memset(s,0,sizeof(*s));
+    s->start = t;
+    if (localtime_r(&t,&tm) == NULL) return;
+    s->off = tm.tm_gmtoff;
+    s->isdst = tm.tm_isdst;
+    if (tm.tm_zone != NULL) {
+        strncpy(s->abbr,tm.tm_zone,sizeof(s->abbr)-1);
+    }
+}
+
+static bool zone_same(struct st_span* a, struct st_span* b)
+{
+    return (a->off == b->off && a->isdst == b->isdst &&
+            strcmp(a->abbr,b->abbr) == 0);
+}
+
+static int zone_append(struct st_span* s)
+{
+    if (nspans > 0 && zone_same(&spans[nspans-1],s)) return 0;
+    if (nspans == spansize) {
+        int size = (spansize == 0? 64 : spansize*2);
+        struct st_span* p = realloc(spans,size*sizeof(*spans));
+
+        if (p == NULL) return -1;
+        spans = p;
+        spansize = size;
+    }
+    spans[nspans++] = *s;
+    return 0;
+}
+
+/* Append the spans of times a to b-1, finding each change of state
+ * by bisection between probes a stride apart */
+static int zone_scan(time_t a, time_t b)
+{
+    struct st_span prev, s;
+    time_t t = a;
+
+    zone_probe(a,&prev);
+    if (zone_append(&prev) != 0) return -1;
+    while (t < b-1) {
+        time_t next = (b-1-t > ZONE_STRIDE? t+ZONE_STRIDE : b-1);
+
+        zone_probe(next,&s);
+        if (zone_same(&s,&prev)) {
+            t = next;
+            continue;
+        }
+        while (next-t > 1) {
+            time_t mid = t + (next-t)/2;
+
+            zone_probe(mid,&s);
+            if (zone_same(&s,&prev))
+                t = mid;
+            else
+                next = mid;
+        }
+        zone_probe(next,&prev);
+        if (zone_append(&prev) != 0) return -1;
+        t = next;
+    }
+    return 0;
+}
+
+/* Extend the table down by a chunk, scanning the new spans into a
+ * table of their own and then appending the old */
+static int zone_extend_down(void)
+{
+    struct st_span* old = spans;
+    int nold = nspans, oldsize = spansize, rc;
+
+    spans = NULL;
+    nspans = spansize = 0;
+    rc = zone_scan(zone_lo-ZONE_CHUNK,zone_lo);
+    for (int i=0; i<nold && rc == 0; i++) {
+        rc = zone_append(&old[i]);
+    }
+    if (rc != 0) {
+        free(spans);
+        spans = old;
+        nspans = nold;
+        spansize = oldsize;
+        return -1;
+    }
+    free(old);
+    zone_lo -= ZONE_CHUNK;
+    return 0;
+}
+
+/* Return the span holding time t */
+static struct st_span* zone_at(time_t t)
+{
+    static _Thread_local struct st_span single;
+    int lo = 0, hi;
+
+    if (nspans == 0) {
+        tzset();
+        zone_lo = zone_hi = (time_t) floor_div(t,ZONE_CHUNK)*ZONE_CHUNK;
+    }
+    if (t < zone_lo - (time_t) ZONE_REACH*ZONE_CHUNK ||
+        t >= zone_hi + (time_t) ZONE_REACH*ZONE_CHUNK) {
+        zone_probe(t,&single);
+        return &single;
+    }
+    while (t >= zone_hi) {
+        if (zone_scan(zone_hi,zone_hi+ZONE_CHUNK) != 0) {
+            zone_probe(t,&single);
+            return &single;
+        }
+        zone_hi += ZONE_CHUNK;
+    }
+    while (t < zone_lo) {
+        if (zone_extend_down() != 0) {
+            zone_probe(t,&single);
+            return &single;
+        }
+    }
+    hi = nspans-1;
+    while (lo < hi) {
+        int mid = hi - (hi-lo)/2;
+
+        if (spans[mid].start <= t)
+            lo = mid;
+        else
+            hi = mid-1;
+    }
+    return &spans[lo];
+}
+
+/* Set tm to the local time at t, as localtime does */
+void date_local(time_t t, struct tm* tm)
+{
+    struct st_span* s = zone_at(t);
+    long long lt = (long long) t + s->off;
+    long long days = floor_div(lt,SECSPERDAY);
+    long long secs = lt - days*SECSPERDAY;
+    long long y;
+    int m, d;
+
+    civil_from_days(days,&y,&m,&d);
+    memset(tm,0,sizeof(*tm));
+    tm->tm_year = (int) (y-1900);
+    tm->tm_mon = m-1;
+    tm->tm_mday = d;
+    tm->tm_hour = (int) (secs/3600);
+    tm->tm_min = (int) (secs/60%60);
+    tm->tm_sec = (int) (secs%60);
+    tm->tm_wday = (int) ((days - floor_div(days,7)*7 + 4) % 7);
+    tm->tm_yday = (int) (days - days_from_civil(y,1,1));
+    tm->tm_isdst = s->isdst;
+    tm->tm_gmtoff = s->off;
+    return;
+}
+
+/* Return the time of the local time in tm, which need not be
+ * normalised, and normalise tm, as mktime does.  A DST flag that
+ * doesn't match the date, and local times that occur twice or not at
+ * all, are resolved as glibc does, starting from the UTC offset in
+ * force at the local time read as UTC rather than from the offset the
+ * previous call found, so the result depends on tm alone. */
+time_t date_mktime(struct tm* tm)
+{
+    long long y = tm->tm_year + 1900LL + floor_div(tm->tm_mon,12);
+    int m = (int) (tm->tm_mon - floor_div(tm->tm_mon,12)*12);
+    int sec = tm->tm_sec, isdst = tm->tm_isdst, dst2 = 0, probes = 6;
+    long long lt, t, t1, t2, dt;
+    struct st_span* s;
+
+    if (sec < 0) sec = 0;
+    if (sec > 59) sec = 59;
+    lt = (days_from_civil(y,m+1,1) + tm->tm_mday-1) * SECSPERDAY +
+        tm->tm_hour*3600LL + tm->tm_min*60LL + sec;
+    t = t1 = t2 = lt - zone_at((time_t) lt)->off;
+
+    /* step towards a time with the local time asked for */
+    for (;;) {
+        s = zone_at((time_t) t);
+        if ((dt = lt - (t + s->off)) == 0) break;
+        if (t == t1 && t != t2 &&
+            (isdst < 0? dst2 <= (s->isdst != 0) :
+             (isdst != 0) != (s->isdst != 0))) {
+            /* oscillating about a gap */
+            goto found;
+        }
+        if (--probes == 0) return (time_t) -1;
+        t1 = t2;
+        t2 = t;
+        t += dt;
+        dst2 = (s->isdst != 0);
+    }
+
+    /* use the offset of the nearest time with the DST flag asked for */
+    if (isdst >= 0 && (isdst == 0) != (s->isdst == 0)) {
+        int dst_difference = (isdst == 0) - (s->isdst == 0);
+
+        for (long long delta = MK_STRIDE; delta < MK_BOUND;
+             delta += MK_STRIDE) {
+            for (int dir = -1; dir <= 1; dir += 2) {
+                struct st_span* o = zone_at((time_t) (t + delta*dir));
+
+                if ((isdst == 0) == (o->isdst == 0)) {
+                    t = lt - o->off;
+                    goto found;
+                }
+            }
+        }
+        t += 3600*dst_difference;
+    }
+
+ found:
+    t += tm->tm_sec - sec;
+    date_local((time_t) t,tm);
+    return (time_t) t;
+}
+
+/* Return the day of month mon of year, counted as in struct tm, of the
+ * nth weekday wday, which lies beyond the month's end if the month has
+ * no nth, and set *ndays to the days in the month.  mon may be out of
+ * range, moving the year. */
+int date_month_wday(int year, int mon, int wday, int n, int* ndays)
+{
+    long long y = year + 1900LL + floor_div(mon,12);
+    int m = (int) (mon - floor_div(mon,12)*12) + 1;
+    long long first = days_from_civil(y,m,1);
+    int wday1 = (int) ((first - floor_div(first,7)*7 + 4) % 7);
+
+    *ndays = (int) (days_from_civil(y+(m == 12),m%12+1,1) - first);
+    return 1 + (wday - wday1 + 7)%7 + (n-1)*7;
+}
+
 time_t date_now(void)
 {
     return (fake_time?fake_time:time((time_t*)NULL));
@@ -20,15 +318,13 @@ void date_set_time(char *s)
 /* return time_t at end of current day */
 time_t date_now_eod(void)
 {
-    struct tm* tm;
-    time_t nowtime;
+    struct tm tm;
 
-    nowtime = date_now();
-    tm = localtime(&nowtime);
-    tm->tm_hour = 23;
-    tm->tm_min = 59;
-    tm->tm_sec = 59;
-    return mktime(tm);
+    date_local(date_now(),&tm);
+    tm.tm_hour = 23;
+    tm.tm_min = 59;
+    tm.tm_sec = 59;
+    return date_mktime(&tm);
 }
 
 /* Parse date in the form dd/mm[/yyyy] If eod is non-zero, returned
@@ -38,72 +334,66 @@ time_t date_now_eod(void)
 time_t date_parse(char *s, int eod)
 {
     int nread, century;
-    struct tm* date;
-    time_t nowtime;
-
-    nowtime = (eod?date_now_eod():date_now());
-    date = localtime(&nowtime);
-    century = date->tm_year%100;
-    nread = sscanf(s,"%d/%d/%d",&(date->tm_mday),&(date->tm_mon),
-                   &(date->tm_year));
+    struct tm date;
+
+    date_local((eod?date_now_eod():date_now()),&date);
+    century = date.tm_year%100;
+    nread = sscanf(s,"%d/%d/%d",&(date.tm_mday),&(date.tm_mon),
+                   &(date.tm_year));
     if (nread == EOF || nread < 2 ) return 0; /* not a date */
     if (nread == 3) {
-        if (date->tm_year < 100 && date->tm_year != 0) {
+        if (date.tm_year < 100 && date.tm_year != 0) {
             /* two digit year specified */
-            date->tm_year += century*100;
+            date.tm_year += century*100;
         }
         else {
-            date->tm_year -= 1900;
+            date.tm_year -= 1900;
         }
     }
-    if ((date->tm_mday < 1 || date->tm_mday > 31) ||
-        (date->tm_mon < 1 || date->tm_mon > 12)) return -1; /* malformed date */
-    date->tm_mon--;
+    if ((date.tm_mday < 1 || date.tm_mday > 31) ||
+        (date.tm_mon < 1 || date.tm_mon > 12)) return -1; /* malformed date */
+    date.tm_mon--;
     /* let mktime figure out if date is dst */
-    date->tm_isdst = -1;
-    return mktime(date);
+    date.tm_isdst = -1;
+    return date_mktime(&date);
 }
 
 /* Convert periodic action time to current year and, if month is
  * non-zero, current month */
 time_t date_make_current(time_t t, int month, time_t base_time)
 {
-    struct tm* date;
-    int cur_year, cur_mon, cur_mday;
+    struct tm base, date;
 
-    date = localtime(&base_time);
-    cur_year = date->tm_year;
-    cur_mon = date->tm_mon;
-    cur_mday = date->tm_mday;
-    date = localtime(&t);
-    date->tm_year = cur_year;
+    date_local(base_time,&base);
+    date_local(t,&date);
+    date.tm_year = base.tm_year;
     if (month) {
-        date->tm_mon = (date->tm_mday>=cur_mday)?cur_mon:cur_mon+1;
+        date.tm_mon = (date.tm_mday>=base.tm_mday)?base.tm_mon:base.tm_mon+1;
         /* new month, different dst? */
-        date->tm_isdst = -1;
+        date.tm_isdst = -1;
     }
     else {
-        time_t event_time = mktime(date);
+        time_t event_time = date_mktime(&date);
         if (difftime(event_time,base_time) < 0) {
             /* event_time in the past; push to next year, to allow for
              * crossing year boundaries */
-            date->tm_year++;
+            date.tm_year++;
         }
     }
-    return mktime(date);
+    return date_mktime(&date);
 }
 
 time_t date_make_days_match(time_t t, int wday)
 {
-    struct tm* st;
+    struct tm st;
     int day_diff;
 
-    st = localtime(&t);
-    day_diff = wday - st->tm_wday;
+    date_local(t,&st);
+    day_diff = wday - st.tm_wday;
     if (day_diff == 0) return t;
     if (day_diff < 0) day_diff += 7;
-    st->tm_mday += day_diff;
-    return mktime(st);
+    st.tm_mday += day_diff;
+    return date_mktime(&st);
 
 }
 
@@ -114,22 +404,25 @@ enum {
 
 char* date_str(time_t t)
 {
-    struct tm* st;
-    static char dstr[DATESTRSIZE];
+    struct tm st;
+    static _Thread_local char dstr[DATESTRSIZE];
 
-    st = localtime(&t);
-    if (strftime(dstr, DATESTRSIZE, "%d/%m/%Y", st) == 0)
+    date_local(t,&st);
+    if (snprintf(dstr, DATESTRSIZE, "%02d/%02d/%d", st.tm_mday,
+                 st.tm_mon+1, st.tm_year+1900) >= DATESTRSIZE)
         return "01/01/1900";
     return dstr;
 }
 
 char* date_full_str(time_t t)
 {
-    struct tm* st;
-    static char dstr[DATEFULLSTRSIZE];
+    struct tm st;
+    static _Thread_local char dstr[DATEFULLSTRSIZE];
 
-    st = localtime(&t);
-    if (strftime(dstr, DATEFULLSTRSIZE, "%d/%m/%YT%R:%S %Z", st) == 0)
+    date_local(t,&st);
+    if (snprintf(dstr, DATEFULLSTRSIZE, "%02d/%02d/%dT%02d:%02d:%02d %s",
+                 st.tm_mday, st.tm_mon+1, st.tm_year+1900, st.tm_hour,
+                 st.tm_min, st.tm_sec, zone_at(t)->abbr) >= DATEFULLSTRSIZE)
         return "01/01/1900T00:00:00 GMT";
     return dstr;
 }
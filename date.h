@@ -18,5 +18,8 @@ extern time_t date_make_current(time_t,int,time_t);
 extern time_t date_make_days_match(time_t,int);
 extern void date_set_time(char*);
 extern time_t date_now_eod(void);
+extern void date_local(time_t, struct tm*);
+extern time_t date_mktime(struct tm*);
+extern int date_month_wday(int,int,int,int,int*);
 
 #endif
@@ -0,0 +1,551 @@
+/* Trigram index of the messages of a database file's actions, so that
+ * text can be searched for without reading every message.  The index
+ * is kept in a file beside the database (remind.db.idx): a header, a
+ * table of the trigrams found, each with the run of actions whose
+ * messages hold it, and the runs themselves.  Actions whose messages
+ * change are appended after them, so keeping the index up to date
+ * costs a small write rather than a rebuild.
+ *
+ * The header is stamped with the device, inode, size and modification
+ * time the database file had when the index last matched it.  A file
+ * changed any other way, or one recovered from its journal, no longer
+ * matches, and the next search rebuilds the index.  The index only
+ * narrows a search, as each action found is checked against its
+ * message, so it may hold actions that no longer match.  Being only a
+ * cache, it is written in the host's byte order. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "index.h"
+
+#define IDX_SUFFIX ".idx"
+#define IDX_MAGIC "rmx1"
+
+enum {
+    NKEYS = 1 << 24,   /* possible trigrams */
+    DELTAMIN = 1024    /* changed actions always tolerated before the
+                        * index is rebuilt */
+};
+
+struct st_idx_hdr {
+    char magic[8];
+    int64_t dev;        /* the database file as indexed */
+    int64_t ino;
+    int64_t size;
+    int64_t mtime;
+    int64_t mtime_ns;
+    int64_t ntri;       /* trigrams in the table */
+    int64_t npost;      /* actions in their runs */
+};
+
+struct st_idx_tri {
+    uint32_t key;       /* three bytes, lower case */
+    uint32_t n;         /* actions holding it */
+    int64_t off;        /* where they start in the runs */
+};
+
+typedef struct st_idx_hdr IDXHDR;
+
+static unsigned char fold(char c)
+{
+    return (unsigned char) (c >= 'A' && c <= 'Z'? c-'A'+'a' : c);
+}
+
+static uint32_t trigram(char* s)
+{
+    return (uint32_t) fold(s[0]) << 16 | (uint32_t) fold(s[1]) << 8 |
+        fold(s[2]);
+}
+
+/* Return whether msg holds text, of length len and in lower case */
+static bool holds(char* msg, char* text, size_t len)
+{
+    if (len == 0) return true;
+    for (; *msg != '\0'; msg++) {
+        size_t i = 0;
+
+        while (i < len && fold(msg[i]) == (unsigned char) text[i]) i++;
+        if (i == len) return true;
+    }
+    return false;
+}
+
+static void stamp(IDXHDR* h, struct stat* st)
+{
+    h->dev = (int64_t) st->st_dev;
+    h->ino = (int64_t) st->st_ino;
+    h->size = (int64_t) st->st_size;
+    h->mtime = (int64_t) st->st_mtim.tv_sec;
+    h->mtime_ns = (int64_t) st->st_mtim.tv_nsec;
+}
+
+static bool stamped(IDXHDR* h, struct stat* st)
+{
+    IDXHDR s;
+
+    stamp(&s,st);
+    return h->dev == s.dev && h->ino == s.ino && h->size == s.size &&
+        h->mtime == s.mtime && h->mtime_ns == s.mtime_ns;
+}
+
+static int write_all(int fd, void* data, size_t size)
+{
+    char* p = data;
+    ssize_t n;
+
+    while (size > 0) {
+        if ((n = write(fd,p,size)) <= 0) return -1;
+        p += n;
+        size -= (size_t) n;
+    }
+    return 0;
+}
+
+/* Set up x, with no index named */
+void idx_init(INDEX* x)
+{
+    memset(x,0,sizeof(*x));
+    x->live = -1;
+    return;
+}
+
+static void idx_unload(INDEX* x)
+{
+    if (x->map != NULL) {
+        munmap(x->map,x->mapsize);
+    }
+    else if (x->loaded) {
+        free(x->tri);
+        free(x->post);
+    }
+    x->map = NULL;
+    x->mapsize = 0;
+    x->tri = NULL;
+    x->post = NULL;
+    x->delta = NULL;
+    x->ntri = x->npost = x->ndelta = 0;
+    x->loaded = false;
+    return;
+}
+
+/* Name the index after the database file, open as st describes; a
+ * file just made, with st NULL, has none yet */
+bool idx_open(INDEX* x, char* dbname, struct stat* st)
+{
+    idx_close(x);
+    if ((x->name = malloc(strlen(dbname)+sizeof(IDX_SUFFIX))) == NULL) {
+        return false;
+    }
+    sprintf(x->name,"%s%s",dbname,IDX_SUFFIX);
+    if (st != NULL) x->dbst = *st;
+    x->live = (st == NULL? 0 : -1);
+    return true;
+}
+
+/* Note that the message of action actno has changed, or the action
+ * come into use */
+void idx_mark(INDEX* x, RECNO actno)
+{
+    if (x->live == 0 && !x->loaded) return;
+    if (x->nmark == x->marksize) {
+        int size = (x->marksize == 0? 256 : x->marksize*2);
+        RECNO* marks = realloc(x->marks,size*sizeof(*marks));
+
+        if (marks == NULL) {
+            /* the index can no longer be trusted */
+            idx_unload(x);
+            x->nmark = 0;
+            x->live = 0;
+            return;
+        }
+        x->marks = marks;
+        x->marksize = size;
+    }
+    x->marks[x->nmark++] = actno;
+    return;
+}
+
+/* Map the index file, if it matches the database */
+static int idx_load(INDEX* x)
+{
+    struct stat st;
+    IDXHDR* h;
+    size_t runs;
+    int fd;
+
+    if (x->name == NULL || (fd = open(x->name,O_RDONLY)) < 0) return -1;
+    if (fstat(fd,&st) != 0 || st.st_size < (off_t) sizeof(IDXHDR)) {
+        close(fd);
+        return -1;
+    }
+    x->mapsize = (size_t) st.st_size;
+    x->map = mmap(NULL,x->mapsize,PROT_READ,MAP_PRIVATE,fd,0);
+    close(fd);
+    if (x->map == MAP_FAILED) {
+        x->map = NULL;
+        return -1;
+    }
+    h = (IDXHDR*) x->map;
+    if (memcmp(h->magic,IDX_MAGIC,sizeof(IDX_MAGIC)) != 0 ||
+        !stamped(h,&x->dbst) || h->ntri < 0 || h->npost < 0 ||
+        (uint64_t) h->ntri > x->mapsize/sizeof(struct st_idx_tri) ||
+        (uint64_t) h->npost > x->mapsize/sizeof(RECNO) ||
+        (runs = sizeof(IDXHDR)+h->ntri*sizeof(struct st_idx_tri)) +
+        h->npost*sizeof(RECNO) > x->mapsize) {
+        idx_unload(x);
+        return -1;
+    }
+    x->tri = (struct st_idx_tri*) (x->map+sizeof(IDXHDR));
+    x->ntri = h->ntri;
+    x->post = (RECNO*) (x->map+runs);
+    x->npost = h->npost;
+    for (int64_t i=0; i<x->ntri; i++) {
+        if (x->tri[i].off < 0 || x->tri[i].off+x->tri[i].n > x->npost ||
+            (i > 0 && x->tri[i].key <= x->tri[i-1].key)) {
+            idx_unload(x);
+            return -1;
+        }
+    }
+    x->delta = x->post+x->npost;
+    x->ndelta = (int64_t) ((x->mapsize-runs)/sizeof(RECNO)) - x->npost;
+    x->loaded = true;
+    return 0;
+}
+
+/* Build the index in memory from the messages of actions 1 to nrec-1.
+ * The actions holding each trigram are counted, the runs laid out,
+ * and the actions filled in on a second pass, so they come in order
+ * without sorting. */
+static int idx_build(INDEX* x, RECNO nrec, IDXMSG msgfn)
+{
+    uint32_t* fill = calloc(NKEYS,sizeof(uint32_t));
+    int64_t ntri = 0, npost = 0, n;
+    char* msg;
+
+    if (fill == NULL) return -1;
+    for (RECNO actno=1; actno<nrec; actno++) {
+        if ((msg = msgfn(actno)) == NULL) continue;
+        for (; msg[0] != '\0' && msg[1] != '\0' && msg[2] != '\0'; msg++) {
+            fill[trigram(msg)]++;
+        }
+    }
+    for (uint32_t key=0; key<NKEYS; key++) {
+        if (fill[key] != 0) ntri++;
+        npost += fill[key];
+    }
+    x->tri = malloc((ntri > 0? ntri : 1)*sizeof(*x->tri));
+    x->post = malloc((npost > 0? npost : 1)*sizeof(*x->post));
+    if (x->tri == NULL || x->post == NULL) {
+        free(x->tri);
+        free(x->post);
+        free(fill);
+        return -1;
+    }
+    x->ntri = 0;
+    npost = 0;
+    for (uint32_t key=0; key<NKEYS; key++) {
+        if (fill[key] == 0) continue;
+        x->tri[x->ntri].key = key;
+        x->tri[x->ntri].n = 0;
+        x->tri[x->ntri++].off = npost;
+        npost += fill[key];
+        fill[key] = (uint32_t) x->ntri;  /* now the entry, plus one */
+    }
+    for (RECNO actno=1; actno<nrec; actno++) {
+        if ((msg = msgfn(actno)) == NULL) continue;
+        for (; msg[0] != '\0' && msg[1] != '\0' && msg[2] != '\0'; msg++) {
+            struct st_idx_tri* t = &x->tri[fill[trigram(msg)]-1];
+
+            /* a trigram repeated in a message is held once */
+            if (t->n > 0 && x->post[t->off+t->n-1] == actno) continue;
+            x->post[t->off+t->n++] = actno;
+        }
+    }
+    free(fill);
+
+    /* close the gaps repeats left */
+    x->npost = 0;
+    for (int64_t i=0; i<x->ntri; i++) {
+        n = x->tri[i].n;
+        memmove(x->post+x->npost,x->post+x->tri[i].off,n*sizeof(*x->post));
+        x->tri[i].off = x->npost;
+        x->npost += n;
+    }
+    x->delta = NULL;
+    x->ndelta = 0;
+    x->loaded = true;
+    return 0;
+}
+
+/* Write the index built to a new file, stamped with st, sync it and
+ * rename it over the old one, syncing the directory after */
+static int idx_write(INDEX* x, struct stat* st)
+{
+    IDXHDR h;
+    char* tmpname = malloc(strlen(x->name)+8);
+    int fd = -1;
+
+    if (tmpname == NULL) return -1;
+    sprintf(tmpname,"%s.XXXXXX",x->name);
+    memset(&h,0,sizeof(h));
+    memcpy(h.magic,IDX_MAGIC,sizeof(IDX_MAGIC));
+    stamp(&h,st);
+    h.ntri = x->ntri;
+    h.npost = x->npost;
+    if ((fd = mkstemp(tmpname)) < 0 ||
+        fchmod(fd,st->st_mode & 0666) != 0 ||
+        write_all(fd,&h,sizeof(h)) != 0 ||
+        write_all(fd,x->tri,x->ntri*sizeof(*x->tri)) != 0 ||
+        write_all(fd,x->post,x->npost*sizeof(*x->post)) != 0 ||
+        fsync(fd) != 0) {
+        if (fd >= 0) {
+            close(fd);
+            unlink(tmpname);
+        }
+        free(tmpname);
+        return -1;
+    }
+    if (close(fd) != 0 || rename(tmpname,x->name) != 0) {
+        unlink(tmpname);
+        free(tmpname);
+        return -1;
+    }
+    free(tmpname);
+    return rem_sync_dir(x->name);
+}
+
+/* Rebuild the index from the messages as they stand, and write it to
+ * its file if save is set, as it may be only when they are all in the
+ * database file open on dbfd */
+static int idx_rebuild(INDEX* x, RECNO nrec, IDXMSG msgfn, int dbfd,
+                       bool save)
+{
+    struct stat st;
+
+    idx_unload(x);
+    x->live = 0;
+    if (idx_build(x,nrec,msgfn) != 0) return -1;
+    x->nmark = 0;
+    if (save && x->name != NULL && fstat(dbfd,&st) == 0 &&
+        idx_write(x,&st) == 0) {
+        x->dbst = st;
+        x->live = 1;
+    }
+    return 0;
+}
+
+/* Bring the index file up to date with the database file open on dbfd,
+ * once changes have been written to it: append the actions marked and
+ * stamp it afresh.  An index that does not match is left for the next
+ * search to rebuild. */
+void idx_flush(INDEX* x, int dbfd)
+{
+    struct stat st;
+    IDXHDR h;
+    off_t end;
+    int fd;
+    size_t size = x->nmark*sizeof(*x->marks);
+
+    if (x->name == NULL || x->live == 0 || fstat(dbfd,&st) != 0) return;
+    stamp(&h,&st);
+    if (x->nmark == 0 && stamped(&h,&x->dbst)) return;
+    if ((fd = open(x->name,O_RDWR)) < 0) {
+        x->live = 0;
+        return;
+    }
+    if (pread(fd,&h,sizeof(h),0) != (ssize_t) sizeof(h) ||
+        memcmp(h.magic,IDX_MAGIC,sizeof(IDX_MAGIC)) != 0 ||
+        !stamped(&h,&x->dbst) || (end = lseek(fd,0,SEEK_END)) < 0 ||
+        (size > 0 &&
+         pwrite(fd,x->marks,size,end) != (ssize_t) size)) {
+        x->live = 0;
+    }
+    else {
+        stamp(&h,&st);
+        x->live = (pwrite(fd,&h,sizeof(h),0) == (ssize_t) sizeof(h));
+    }
+    close(fd);
+    /* the marks are in the file now, or the file no use */
+    idx_unload(x);
+    x->nmark = 0;
+    x->dbst = st;
+    return;
+}
+
+/* The database file has been replaced or made anew: forget the index
+ * and remove its file */
+void idx_stale(INDEX* x)
+{
+    idx_unload(x);
+    x->nmark = 0;
+    x->live = 0;
+    if (x->name != NULL) unlink(x->name);
+    return;
+}
+
+static int post_cmp(const void* a, const void* b)
+{
+    RECNO x = *(const RECNO*) a;
+    RECNO y = *(const RECNO*) b;
+
+    return (x < y? -1 : (x > y));
+}
+
+/* Return the actions holding trigram key, setting *n to how many */
+static RECNO* idx_lookup(INDEX* x, uint32_t key, int64_t* n)
+{
+    int64_t lo = 0, hi = x->ntri;
+
+    while (lo < hi) {
+        int64_t mid = lo + (hi-lo)/2;
+
+        if (x->tri[mid].key < key) lo = mid+1;
+        else hi = mid;
+    }
+    if (lo == x->ntri || x->tri[lo].key != key) {
+        *n = 0;
+        return NULL;
+    }
+    *n = x->tri[lo].n;
+    return x->post+x->tri[lo].off;
+}
+
+static bool has_post(RECNO* post, int64_t n, RECNO actno)
+{
+    int64_t lo = 0, hi = n;
+
+    while (lo < hi) {
+        int64_t mid = lo + (hi-lo)/2;
+
+        if (post[mid] < actno) lo = mid+1;
+        else hi = mid;
+    }
+    return lo < n && post[lo] == actno;
+}
+
+static int found_reserve(INDEX* x, int64_t need)
+{
+    RECNO* found;
+
+    if (need <= x->foundsize) return 0;
+    if (need > INT32_MAX || (found = realloc(x->found,
+                                             need*sizeof(RECNO))) == NULL) {
+        return -1;
+    }
+    x->found = found;
+    x->foundsize = (int) need;
+    return 0;
+}
+
+/* Gather in x->found the actions the index says may hold text, of
+ * length len and in lower case: those holding all its trigrams and
+ * those changed since.  Returns how many, in order, or -1. */
+static int idx_candidates(INDEX* x, char* text, size_t len)
+{
+    RECNO* best = NULL;
+    int64_t nbest = 0, n, ncand = 0;
+
+    for (size_t i=0; i+3<=len; i++) {
+        RECNO* post = idx_lookup(x,trigram(text+i),&n);
+
+        if (best == NULL || n < nbest) {
+            best = post;
+            nbest = n;
+        }
+        if (n == 0) break;
+    }
+    if (found_reserve(x,nbest+x->ndelta+x->nmark+1) != 0) return -1;
+    for (int64_t j=0; j<nbest; j++) {
+        bool all = true;
+
+        for (size_t i=0; all && i+3<=len; i++) {
+            RECNO* post = idx_lookup(x,trigram(text+i),&n);
+
+            if (post != best) all = has_post(post,n,best[j]);
+        }
+        if (all) x->found[ncand++] = best[j];
+    }
+    for (int64_t j=0; j<x->ndelta; j++) x->found[ncand++] = x->delta[j];
+    for (int j=0; j<x->nmark; j++) x->found[ncand++] = x->marks[j];
+    if (ncand > nbest) qsort(x->found,ncand,sizeof(RECNO),post_cmp);
+    return (int) ncand;
+}
+
+/* Find the actions, among 1 to nrec-1, whose messages as msgfn gives
+ * them hold text, ignoring case.  An index that does not match the
+ * database file open on dbfd, or has had many changes appended, is
+ * rebuilt, and saved if save is set.  Text shorter than a trigram is
+ * looked for in every message.  Sets *found to the actions, in order,
+ * in storage the next search reuses, and returns how many, or -1. */
+int idx_search(INDEX* x, char* text, RECNO nrec, IDXMSG msgfn, int dbfd,
+               bool save, RECNO** found)
+{
+    size_t len = strlen(text);
+    char* lower = malloc(len+1);
+    int ncand, nfound = 0;
+    RECNO prev = 0;
+    char* msg;
+
+    if (lower == NULL) return -1;
+    for (size_t i=0; i<=len; i++) lower[i] = (char) fold(text[i]);
+    if (len < 3) {
+        if (found_reserve(x,nrec) != 0) {
+            free(lower);
+            return -1;
+        }
+        for (ncand=0; ncand<nrec-1; ncand++) x->found[ncand] = ncand+1;
+    }
+    else {
+        if (!x->loaded) {
+            x->live = (x->live != 0 && idx_load(x) == 0);
+        }
+        if ((!x->loaded ||
+             x->ndelta+x->nmark > DELTAMIN + (int64_t) nrec/8) &&
+            idx_rebuild(x,nrec,msgfn,dbfd,save) != 0) {
+            free(lower);
+            return -1;
+        }
+        if ((ncand = idx_candidates(x,lower,len)) < 0) {
+            free(lower);
+            return -1;
+        }
+    }
+    for (int i=0; i<ncand; i++) {
+        RECNO actno = x->found[i];
+
+        if (actno == prev || actno < 1 || actno >= nrec) continue;
+        prev = actno;
+        if ((msg = msgfn(actno)) != NULL && holds(msg,lower,len)) {
+            x->found[nfound++] = actno;
+        }
+    }
+    free(lower);
+    *found = x->found;
+    return nfound;
+}
+
+/* Forget the index of the file closed */
+void idx_close(INDEX* x)
+{
+    idx_unload(x);
+    free(x->name);
+    x->name = NULL;
+    x->nmark = 0;
+    x->live = -1;
+    return;
+}
+
+void idx_free(INDEX* x)
+{
+    idx_close(x);
+    free(x->marks);
+    free(x->found);
+    idx_init(x);
+    return;
+}
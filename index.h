@@ -0,0 +1,47 @@
+#ifndef INDEX_H
+#define INDEX_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "datafile.h"
+
+/* The trigram index of a database file's messages, kept in a file
+ * beside it, and the index as loaded for searching */
+struct st_index {
+    char* name;               /* the index file */
+    struct stat dbst;         /* database file as the index matches it */
+    int live;                 /* 1 if the file indexes the database, 0 if
+                               * it does not, -1 if not yet looked at */
+    RECNO* marks;             /* actions whose messages changed since */
+    int nmark, marksize;
+    bool loaded;              /* the tables below hold the index */
+    char* map;                /* mapping of the file they come from, if
+                               * not built here */
+    size_t mapsize;
+    struct st_idx_tri* tri;   /* trigrams, in order */
+    int64_t ntri;
+    RECNO* post;              /* actions holding each, in order */
+    int64_t npost;
+    RECNO* delta;             /* actions changed since, from the file */
+    int64_t ndelta;
+    RECNO* found;             /* actions found by the last search */
+    int foundsize;
+};
+
+typedef struct st_index INDEX;
+
+/* Return the message of an action, or NULL if it is free */
+typedef char* (*IDXMSG)(RECNO);
+
+extern void idx_init(INDEX*);
+extern bool idx_open(INDEX*, char*, struct stat*);
+extern void idx_mark(INDEX*, RECNO);
+extern void idx_flush(INDEX*, int);
+extern void idx_stale(INDEX*);
+extern int idx_search(INDEX*, char*, RECNO, IDXMSG, int, bool, RECNO**);
+extern void idx_close(INDEX*);
+extern void idx_free(INDEX*);
+
+#endif
@@ -0,0 +1,240 @@
+/* Write-ahead journal for the database file.  Changes are logged as
+ * transactions of (offset, data) frames closed by a commit frame, and
+ * only written to the database file once the transaction holding them
+ * is in the journal.  After a crash, committed transactions are
+ * replayed into the file; a torn transaction at the end is ignored. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "journal.h"
+
+#define JNL_SUFFIX ".wal"
+
+enum {
+    JNL_COMMIT = -1  /* frame offset marking the end of a transaction */
+};
+
+struct st_jnl_frame {
+    long long offset;   /* file offset of data, or JNL_COMMIT */
+    unsigned int size;  /* bytes of data following; for a commit, the
+                         * number of frames in the transaction */
+    unsigned int sum;   /* checksum of data; for a commit, of the
+                         * transaction's frame checksums */
+};
+
+typedef struct st_jnl_frame JNLFRAME;
+
+/* FNV-1a */
+static unsigned int checksum(unsigned int sum, void* data, size_t size)
+{
+    unsigned char* p = data;
+
+    while (size-- > 0) {
+        sum ^= *p++;
+        sum *= 16777619u;
+    }
+    return sum;
+}
+
+static int tx_add(JOURNAL* j, void* data, size_t size)
+{
+    if (j->txlen+size > j->txsize) {
+        size_t newsize = (j->txsize == 0? 4096 : j->txsize);
+        char* newbuf;
+
+        while (newsize < j->txlen+size) newsize *= 2;
+        if ((newbuf = realloc(j->txbuf,newsize)) == NULL) return -1;
+        j->txbuf = newbuf;
+        j->txsize = newsize;
+    }
+    memcpy(j->txbuf+j->txlen,data,size);
+    j->txlen += size;
+    return 0;
+}
+
+/* Set up j, with no journal named */
+void jnl_init(JOURNAL* j)
+{
+    memset(j,0,sizeof(*j));
+    j->fd = -1;
+    return;
+}
+
+/* Name the journal after the database file it protects */
+bool jnl_open(JOURNAL* j, char* dbname)
+{
+    jnl_close(j);
+    if ((j->name = malloc(strlen(dbname)+sizeof(JNL_SUFFIX))) == NULL) {
+        return false;
+    }
+    sprintf(j->name,"%s%s",dbname,JNL_SUFFIX);
+    return true;
+}
+
+/* Add size bytes of data, destined for offset, to the transaction */
+int jnl_append(JOURNAL* j, off_t offset, void* data, size_t size)
+{
+    JNLFRAME frame;
+
+    frame.offset = offset;
+    frame.size = (unsigned int) size;
+    frame.sum = checksum(2166136261u,data,size);
+    j->txsum = checksum(j->txsum == 0? 2166136261u : j->txsum,&frame.sum,
+                     sizeof(frame.sum));
+    j->txframes++;
+    if (tx_add(j,&frame,sizeof(frame)) != 0 || tx_add(j,data,size) != 0) {
+        return -1;
+    }
+    return 0;
+}
+
+/* Close the transaction and write it to the journal in one write */
+int jnl_commit(JOURNAL* j)
+{
+    JNLFRAME frame;
+    size_t done = 0;
+    ssize_t n;
+
+    if (j->txframes == 0) return 0;
+    frame.offset = JNL_COMMIT;
+    frame.size = j->txframes;
+    frame.sum = j->txsum;
+    if (tx_add(j,&frame,sizeof(frame)) != 0) return -1;
+    if (j->fd < 0 &&
+        (j->fd = open(j->name,O_WRONLY|O_CREAT|O_APPEND,0666)) < 0) {
+        return -1;
+    }
+    while (done < j->txlen) {
+        if ((n = write(j->fd,j->txbuf+done,j->txlen-done)) <= 0) return -1;
+        done += (size_t) n;
+    }
+    j->txlen = 0;
+    j->txframes = 0;
+    j->txsum = 0;
+    j->unsynced = true;
+    return 0;
+}
+
+/* Force committed transactions to disk */
+int jnl_sync(JOURNAL* j)
+{
+    if (j->fd < 0 || !j->unsynced) return 0;
+    if (fsync(j->fd) != 0) return -1;
+    j->unsynced = false;
+    return 0;
+}
+
+/* Apply every complete transaction in the journal to the file open
+ * on dbfd.  Returns the number of transactions applied, or -1 on
+ * error. */
+int jnl_replay(JOURNAL* j, int dbfd)
+{
+    int fd, ntx = 0;
+    struct stat st;
+    char *buf, *p, *end, *tx;
+
+    if ((fd = open(j->name,O_RDONLY)) < 0) return 0;  /* no journal */
+    if (fstat(fd,&st) != 0) {
+        close(fd);
+        return -1;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    if ((buf = malloc((size_t) st.st_size)) == NULL ||
+        read(fd,buf,(size_t) st.st_size) != st.st_size) {
+        free(buf);
+        close(fd);
+        return -1;
+    }
+    close(fd);
+
+    end = buf + st.st_size;
+    for (p = tx = buf; p+sizeof(JNLFRAME) <= end; ) {
+        JNLFRAME frame;
+        unsigned int nframes = 0, sum = 0;
+
+        /* check the transaction is complete and intact */
+        for (;;) {
+            if (p+sizeof(frame) > end) goto torn;
+            memcpy(&frame,p,sizeof(frame));
+            p += sizeof(frame);
+            if (frame.offset == JNL_COMMIT) break;
+            if (frame.size > (size_t) (end-p) ||
+                checksum(2166136261u,p,frame.size) != frame.sum) goto torn;
+            sum = checksum(sum == 0? 2166136261u : sum,&frame.sum,
+                           sizeof(frame.sum));
+            nframes++;
+            p += frame.size;
+        }
+        if (frame.size != nframes || frame.sum != sum) goto torn;
+
+        /* write it to the database file */
+        while (tx < p) {
+            memcpy(&frame,tx,sizeof(frame));
+            tx += sizeof(frame);
+            if (frame.offset == JNL_COMMIT) break;
+            if (pwrite(dbfd,tx,frame.size,(off_t) frame.offset) !=
+                (ssize_t) frame.size) {
+                free(buf);
+                return -1;
+            }
+            tx += frame.size;
+        }
+        ntx++;
+    }
+torn:
+    free(buf);
+    return ntx;
+}
+
+/* Return true if there is a journal, left by an interrupted update,
+ * to be replayed */
+bool jnl_pending(JOURNAL* j)
+{
+    struct stat st;
+
+    return (j->name != NULL && stat(j->name,&st) == 0 && st.st_size > 0);
+}
+
+/* Discard the journal once its contents are safely in the file */
+int jnl_clear(JOURNAL* j)
+{
+    int rc = 0;
+
+    if (j->fd >= 0) {
+        close(j->fd);
+        j->fd = -1;
+    }
+    j->unsynced = false;
+    j->txlen = 0;
+    j->txframes = 0;
+    j->txsum = 0;
+    if (j->name != NULL && unlink(j->name) != 0 && access(j->name,F_OK) == 0) {
+        rc = -1;
+    }
+    return rc;
+}
+
+void jnl_close(JOURNAL* j)
+{
+    if (j->fd >= 0) close(j->fd);
+    j->fd = -1;
+    free(j->name);
+    j->name = NULL;
+}
+
+/* Close j and free the transaction buffer */
+void jnl_free(JOURNAL* j)
+{
+    jnl_close(j);
+    free(j->txbuf);
+    jnl_init(j);
+    return;
+}
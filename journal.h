@@ -0,0 +1,31 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <sys/types.h>
+
+/* A database file's journal, and the transaction being built */
+struct st_journal {
+    char* name;
+    int fd;
+    bool unsynced;
+    char* txbuf;
+    size_t txlen, txsize;
+    unsigned int txframes, txsum;
+};
+
+typedef struct st_journal JOURNAL;
+
+extern void jnl_init(JOURNAL*);
+extern bool jnl_open(JOURNAL*, char*);
+extern int jnl_append(JOURNAL*, off_t, void*, size_t);
+extern int jnl_commit(JOURNAL*);
+extern int jnl_sync(JOURNAL*);
+extern int jnl_replay(JOURNAL*, int);
+extern bool jnl_pending(JOURNAL*);
+extern int jnl_clear(JOURNAL*);
+extern void jnl_close(JOURNAL*);
+extern void jnl_free(JOURNAL*);
+
+#endif
@@ -0,0 +1,128 @@
+/* Output for programs to read.  A record is a line of fields, either
+ * tab separated, in the order written, or as a JSON object of named
+ * fields (JSON Lines).  Reports are also written through a large
+ * buffer, so a long listing costs few writes. */
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "output.h"
+
+enum {
+    OUTBUFSIZE = 65536
+};
+
+/* Set format from its name, returning false if there is none such */
+bool out_parse_format(char* name, enum out_format* format)
+{
+    if (strcmp(name,"text") == 0)
+        *format = OUT_TEXT;
+    else if (strcmp(name,"tsv") == 0)
+        *format = OUT_TSV;
+    else if (strcmp(name,"json") == 0)
+        *format = OUT_JSON;
+    else
+        return false;
+    return true;
+}
+
+/* Buffer f fully, in a large buffer, unless it is a terminal, which is
+ * best left line buffered */
+void out_buffer(FILE* f)
+{
+    static char buf[OUTBUFSIZE];
+
+    if (!isatty(fileno(f))) setvbuf(f,buf,_IOFBF,sizeof(buf));
+    return;
+}
+
+/* Write string s as a field value.  Tab separated, tabs and line
+ * breaks within it become spaces; in JSON it is quoted and escaped. */
+void out_quote(FILE* f, enum out_format format, char* s)
+{
+    if (format != OUT_JSON) {
+        for (; *s != '\0'; s++) {
+            putc((*s == '\t' || *s == '\n' || *s == '\r')? ' ' : *s,f);
+        }
+        return;
+    }
+    putc('"',f);
+    for (; *s != '\0'; s++) {
+        unsigned char c = (unsigned char) *s;
+
+        switch (c) {
+        case '"':
+        case '\\':
+            putc('\\',f);
+            putc(c,f);
+            break;
+        case '\n':
+            fputs("\\n",f);
+            break;
+        case '\t':
+            fputs("\\t",f);
+            break;
+        default:
+            if (c < 0x20)
+                fprintf(f,"\\u%04x",c);
+            else
+                putc(c,f);
+        }
+    }
+    putc('"',f);
+    return;
+}
+
+void out_begin(OUTREC* rec, FILE* f, enum out_format format)
+{
+    rec->out = f;
+    rec->format = format;
+    rec->nfields = 0;
+    if (format == OUT_JSON) putc('{',f);
+    return;
+}
+
+/* Start a field: its separator and, in JSON, its name */
+static void out_field(OUTREC* rec, char* name)
+{
+    if (rec->nfields++ > 0) putc(rec->format == OUT_JSON? ',' : '\t',rec->out);
+    if (rec->format == OUT_JSON) {
+        out_quote(rec->out,OUT_JSON,name);
+        putc(':',rec->out);
+    }
+    return;
+}
+
+void out_int(OUTREC* rec, char* name, long long v)
+{
+    out_field(rec,name);
+    fprintf(rec->out,"%lld",v);
+    return;
+}
+
+/* Write n integers as one field: comma separated, or a JSON array */
+void out_ints(OUTREC* rec, char* name, long long v[], int n)
+{
+    out_field(rec,name);
+    if (rec->format == OUT_JSON) putc('[',rec->out);
+    for (int i=0; i<n; i++) {
+        fprintf(rec->out,"%s%lld",(i == 0? "" : ","),v[i]);
+    }
+    if (rec->format == OUT_JSON) putc(']',rec->out);
+    return;
+}
+
+void out_str(OUTREC* rec, char* name, char* s)
+{
+    out_field(rec,name);
+    out_quote(rec->out,rec->format,s);
+    return;
+}
+
+void out_end(OUTREC* rec)
+{
+    if (rec->format == OUT_JSON) putc('}',rec->out);
+    putc('\n',rec->out);
+    return;
+}
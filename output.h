@@ -0,0 +1,31 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+enum out_format {
+    OUT_TEXT,  /* for reading; each command lays out its own lines */
+    OUT_TSV,   /* tab separated fields */
+    OUT_JSON   /* a JSON object per line */
+};
+
+/* A record being written, of named fields */
+struct st_outrec {
+    FILE* out;
+    enum out_format format;
+    int nfields;  /* fields written so far */
+};
+
+typedef struct st_outrec OUTREC;
+
+extern bool out_parse_format(char*, enum out_format*);
+extern void out_buffer(FILE*);
+extern void out_quote(FILE*, enum out_format, char*);
+extern void out_begin(OUTREC*, FILE*, enum out_format);
+extern void out_int(OUTREC*, char*, long long);
+extern void out_ints(OUTREC*, char*, long long[], int);
+extern void out_str(OUTREC*, char*, char*);
+extern void out_end(OUTREC*);
+
+#endif
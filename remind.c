@@ -4,10 +4,11 @@
     remind - a reminder program
 
     SYNOPSIS
-    remind  [-a] [-c colour_pairs] [-d date] [-D n[,n] ...] [-e]
-    [-f filename] [-h] [-i] [-l] [-L] [-m n[,n] ...] [-p]
-    [-P pointer] [-q] [-r repeat] [-s] [-t timeout]
-    [-u urgency] [-v] [-w warning] [-X n[,n] ...] [-z]
+    remind  [-a] [-A [date,]date] [-b] [-C] [-c colour_pairs] [-d date]
+    [-D n[,n] ...] [-e] [-E] [-f filename] [-F] [-g text] [-h] [-I file]
+    [-i] [-l] [-L] [-m n[,n] ...] [-o format] [-p] [-P pointer] [-q]
+    [-r repeat] [-s] [-S] [-t timeout] [-R] [-u urgency] [-v] [-w warning]
+    [-X n[,n] ...] [-z]
     [message]
 
     See remind(1) man page for more.
@@ -15,58 +16,89 @@
 
 #include <stdlib.h>
 #include <stdarg.h>
+#include <setjmp.h>
 #include <stdio.h>
 #include <stdbool.h>
 #include <string.h>
+#include <ctype.h>
+#include <limits.h>
 #include <sys/stat.h>
 #include <math.h>
+#include <pthread.h>
 
+#include "daemon.h"
 #include "datafile.h"
 #include "date.h"
+#include "output.h"
+#include "stats.h"
+#include "trace.h"
 
 #define REMIND_ENV "REMIND_FILE"
 #define REMIND_FILE "remind.db"
+#define SYNC_ENV "REMIND_SYNC"
+#define TIME_ENV "REMIND_TIME"
+#define TRACE_ENV "REMIND_TRACE"
 
 enum {
     ABORT = 0,
     CONTINUE = 1,
     SECSPERDAY = 86400,
-    ERRMSGSIZE = 132
+    ERRMSGSIZE = 132,
+    MAXWORDS = 64,
+    MAXFILES = 32
 };
 
 enum cmd_type {
+    CMD_AGENDA,
+    CMD_BATCH,
+    CMD_COMPACT,
+    CMD_DAEMON,
     CMD_DEFINE,
     CMD_DELETE,
     CMD_DISPLAY,
     CMD_DUMP,
     CMD_EXPORT,
+    CMD_IMPORT,
     CMD_INIT,
     CMD_LIST,
     CMD_LIST_HEADER,
     CMD_MODIFY,
     CMD_MOD_POINTER,
+    CMD_SEARCH,
+    CMD_SWEEP,
     CMD_ZZZ
 };
 
 /* Structure for action number list */
 struct st_nlist {
-    int n;
+    RECNO n;
+    RECNO last;  /* end of the range n-last, or 0 for n alone */
     struct st_nlist *next;
 };
 
 /* command line parameters */
 struct st_params {
-    char* filename;
+    char* filename;  /* first of files */
+    char* files[MAXFILES];  /* database files, from -f or REMIND_FILE */
+    int nfiles;
     enum cmd_type cmd;
     int set_type;
     int ucol[URGCOL];
     bool colour_set;
+    bool file_set;
     int urgency;
     bool quiet;
     char* hilite;
-    int pointer;
+    RECNO pointer;
     bool version;
     struct st_nlist* actlist;
+    char* import;
+    char* search;  /* text to find in messages */
+    time_t from;  /* agenda range */
+    time_t to;
+    enum out_format format;
+    bool stats;   /* summarise the work done */
+    bool filter;  /* -D deletes only the actions meeting conditions */
     bool done;
 };
 
@@ -76,17 +108,30 @@ typedef struct st_params PARAMS;
 char* error_msg[] = {
     "unused",
     "unable to open database file: %s",
-    "record [%03d]: bad seek",
-    "record [%03d]: bad read",
-    "record [%03d]: bad write",
-    "action [%03d] does not exist",
+    "record [%03lld]: bad seek",
+    "record [%03lld]: bad read",
+    "record [%03lld]: bad write",
+    "action [%03lld] does not exist",
     "unable to create database file: %s",
     "database file does not match current version",
     "that's no database file: %s",
-    "action [%03d] is on free list",
-    "action [%03d] can't be found on its list"
+    "action [%03lld] is on free list",
+    "action [%03lld] can't be found on its list",
+    "record [%03lld]: unable to map database file",
+    "unable to recover journal for database file: %s",
+    "insufficient memory for record [%03lld]"
 };
 
+/* line of input being processed, for error messages */
+int input_line = 0;
+
+/* if set, where an aborting error returns to instead of exiting; each
+ * thread has its own */
+_Thread_local jmp_buf* abort_jmp = NULL;
+
+/* set by any error, so a batch can tell which of its lines failed */
+_Thread_local bool cmd_failed = false;
+
 /* utility functions and procedures */
 
 void error(int abort, char *fmt, ...)
@@ -97,8 +142,15 @@ void error(int abort, char *fmt, ...)
     va_start(ap,fmt);
     vsnprintf(errmsg,ERRMSGSIZE,fmt,ap);
     va_end(ap);
-    fprintf(stderr,"remind: %s\n",errmsg);
-    if (abort == ABORT) exit(EXIT_FAILURE);
+    if (input_line > 0)
+        fprintf(stderr,"remind: line %d: %s\n",input_line,errmsg);
+    else
+        fprintf(stderr,"remind: %s\n",errmsg);
+    cmd_failed = true;
+    if (abort == ABORT) {
+        if (abort_jmp != NULL) longjmp(*abort_jmp,1);
+        exit(EXIT_FAILURE);
+    }
     return;
 }
 
@@ -110,13 +162,14 @@ bool exists(char* filename)
     return (stat(filename,&statbuf) == 0);
 }
 
-/* confirm file initialisation */
-void ask(char* filename)
+/* confirm file initialisation, reading the answer from answer */
+void ask(char* filename, FILE* answer)
 {
-    char c;
+    int c;
 
     printf("remind: initialise %s.  are you sure (y/n)? ",filename);
-    c = getchar();
+    fflush(stdout);
+    c = getc(answer);
     if (c != 'Y' && c != 'y') {
         error(ABORT,"initialisation aborted");
     }
@@ -135,46 +188,132 @@ char *strdq(char* s)
 }
 
 /* Return string to starting high-lighting, or empty string if
- * hilite_off is empty.  Colour codes are standard ANSI. */
+ * hilite_off is empty.  Colour codes are standard ANSI.  The strings
+ * for each urgency are built once for the database file's colours. */
 char* hilite_on(int u, char* hilite_off)
 {
-    static char hl[32];
-
-    hl[0] = '\0';
-    if (strlen(hilite_off) != 0 && u >= 0 && u < URGCOL) {
-        int* ucol = rem_get_hilite();
-        snprintf(hl, sizeof(hl)-1, "\033[%d;%dm",ucol[u*2-2],ucol[u*2-1]);
+    static _Thread_local char hl[URGCOL/2+1][32];
+    static _Thread_local int built[URGCOL];  /* colours hl is for */
+    static _Thread_local bool valid = false;
+    int* ucol;
+
+    if (*hilite_off == '\0' || u < 1 || u > URGCOL/2) return "";
+    ucol = rem_get_hilite();
+    if (!valid || memcmp(built,ucol,sizeof(built)) != 0) {
+        for (int v=1; v<=URGCOL/2; v++) {
+            snprintf(hl[v],sizeof(hl[v]),"\033[%d;%dm",ucol[v*2-2],
+                     ucol[v*2-1]);
+        }
+        memcpy(built,ucol,sizeof(built));
+        valid = true;
     }
-    return hl;
+    return hl[u];
 }
 
-/* Build action number list from comma separated string */
+void free_int_list(struct st_nlist* np);
+
+/* Build action number list, in order, from comma separated string.
+ * An entry n-m is a range, and n- runs to the last action.  Returns
+ * NULL if the string is not such a list. */
 struct st_nlist *parse_int_list(char* s)
 {
-    struct st_nlist *np,*head;
+    struct st_nlist *np,*head,**tail;
 
     head = NULL;
+    tail = &head;
     while (s) {
         np = (struct st_nlist *) calloc(1,sizeof(struct st_nlist));
         if (np == NULL) {
             error(ABORT,"insufficient memory for list");
         }
-        np->n = atoi(s);
-        np->next = head;
-        head = np;
-        s = strchr(s,',');
-        if (s != NULL) s++;
+        *tail = np;
+        tail = &np->next;
+        if (!isdigit((unsigned char) *s)) break;
+        np->n = strtoll(s,&s,10);
+        if (*s == '-') {
+            s++;
+            np->last = (isdigit((unsigned char) *s)?
+                        strtoll(s,&s,10) : LLONG_MAX);
+            if (np->last < np->n) break;
+        }
+        if (*s == '\0') return head;
+        if (*s++ != ',') break;
+    }
+    free_int_list(head);
+    return NULL;
+}
+
+/* Report an end of range np that names no action, an open end
+ * aside */
+void check_range(struct st_nlist* np, RECNO numrec)
+{
+    if (np->n < 1 || np->n >= numrec)
+        error(CONTINUE,error_msg[RE_RECNO],np->n);
+    else if (np->last != LLONG_MAX && np->last >= numrec)
+        error(CONTINUE,error_msg[RE_RECNO],np->last);
+    return;
+}
+
+/* Replace each range in list by the actions in use within it, so the
+ * list holds only action numbers */
+void expand_ranges(struct st_nlist* list)
+{
+    RECNO numrec = rem_header()->numrec;
+    struct st_nlist **link, *np;
+    ACTREC* action;
+
+    for (link = &list; (np = *link) != NULL; ) {
+        RECNO first = np->n;
+        RECNO last = (np->last < numrec? np->last : numrec-1);
+
+        if (np->last == 0) {
+            link = &np->next;
+            continue;
+        }
+        check_range(np,numrec);
+        /* unlink the range, and put the actions in its place */
+        *link = np->next;
+        for (RECNO actno=(first > 0? first : 1); actno<=last; actno++) {
+            if ((action = act_read(actno)) == NULL) {
+                free(np);
+                error(ABORT,error_msg[rem_error()],actno);
+            }
+            if (action->type == ACT_FREE) continue;
+            if (np == NULL &&
+                (np = calloc(1,sizeof(struct st_nlist))) == NULL) {
+                error(ABORT,"insufficient memory for list");
+            }
+            np->n = actno;
+            np->last = 0;
+            np->next = *link;
+            *link = np;
+            link = &np->next;
+            np = NULL;
+        }
+        free(np);
+    }
+    return;
+}
+
+void free_int_list(struct st_nlist* np)
+{
+    struct st_nlist* next;
+
+    while (np != NULL) {
+        next = np->next;
+        free(np);
+        np = next;
     }
-    return head;
+    return;
 }
 
 /* return repeat parameter string */
 char* repeat_str(struct st_repeat repeat)
 {
-    static char repstr[MSGSIZ+1];
+    static _Thread_local char repstr[32];
     char* rtype = "ymwn";
 
-    snprintf(repstr,MSGSIZ,"%c%d,%d",rtype[repeat.type],
+    snprintf(repstr,sizeof(repstr),"%c%d,%d",rtype[repeat.type],
              repeat.day, repeat.nday);
     return repstr;
 }
@@ -207,17 +346,70 @@ bool parse_repeat(char* rstr, enum repeat_type* type, int* day, int* nday)
     return true;
 }
 
+/* Return the start of the day of time t */
+time_t day_start(time_t t)
+{
+    struct tm tm;
+
+    date_local(t,&tm);
+    tm.tm_hour = tm.tm_min = tm.tm_sec = 0;
+    tm.tm_isdst = -1;
+    return date_mktime(&tm);
+}
+
+/* Parse a date range in the form [date,]date, from the start of the
+ * first date, or of today, to the end of the second */
+bool parse_range(char* s, time_t* from, time_t* to)
+{
+    char* comma = strchr(s,',');
+
+    *from = day_start(date_now());
+    if (comma != NULL) {
+        /* date_parse stops at the comma */
+        if ((*from = date_parse(s,TIME_EOD)) <= 0) return false;
+        *from = day_start(*from);
+        s = comma+1;
+    }
+    if ((*to = date_parse(s,TIME_EOD)) <= 0) return false;
+    return difftime(*to,*from) >= 0;
+}
+
+/* Add filename to the database files of params */
+void add_file(PARAMS* params, char* filename)
+{
+    if (params->nfiles == MAXFILES) error(ABORT,"too many database files");
+    params->files[params->nfiles++] = filename;
+    params->filename = params->files[0];
+    return;
+}
+
 /* main functions */
 
 bool parse_cmd_args(int argc, char *argv[], PARAMS* params, ACTREC* newact)
 {
+    static char* msg = NULL;  /* message, grown to fit */
+    static size_t msgsize = 0;
+    static char* envfiles = NULL;  /* REMIND_FILE, split at its colons */
+    static int nenv = 0;
+    size_t msglen = 0;
     int nargs;
     bool first_word = true;
     char *s;
-    char *switcharg = "dwuDmxtfcPXr"; /* switches that have arguments */
+    char *switcharg = "AdwuDmxtfcgIoPXr"; /* switches that have arguments */
 
     /* set effective time? */
-    if ((s = getenv("REMIND_TIME"))) date_set_time(s);
+    if ((s = getenv(TIME_ENV))) date_set_time(s);
+    /* set journal sync policy? */
+    if ((s = getenv(SYNC_ENV))) {
+        if (strcmp(s,"none") == 0)
+            rem_set_sync(SYNC_NONE);
+        else if (strcmp(s,"batch") == 0)
+            rem_set_sync(SYNC_BATCH);
+        else if (strcmp(s,"full") == 0)
+            rem_set_sync(SYNC_FULL);
+        else
+            error(ABORT,"bad %s value: %s",SYNC_ENV,s);
+    }
 
     /* set defaults */
     params->cmd = CMD_DISPLAY;
@@ -225,12 +417,28 @@ bool parse_cmd_args(int argc, char *argv[], PARAMS* params, ACTREC* newact)
     params->version = false;
     params->urgency = -1;
     params->colour_set = false;
+    params->file_set = false;
     params->set_type = ACT_PERIODIC|ACT_STANDARD;
     params->hilite = "";
     params->actlist = NULL;
-    params->filename = getenv(REMIND_ENV);
+    params->import = NULL;
+    params->search = NULL;
+    params->format = OUT_TEXT;
+    params->stats = false;
+    params->filter = false;
     params->done = false;
-    if (params->filename == NULL) params->filename = REMIND_FILE;
+    if (envfiles == NULL && (s = getenv(REMIND_ENV)) != NULL) {
+        if ((envfiles = strdup(s)) == NULL)
+            error(ABORT,"insufficient memory for %s",REMIND_ENV);
+        for (nenv=1, s=envfiles; (s = strchr(s,':')) != NULL; nenv++)
+            *s++ = '\0';
+    }
+    params->nfiles = 0;
+    s = envfiles;
+    for (int i=0; i<nenv; i++, s += strlen(s)+1) {
+        if (*s != '\0') add_file(params,s);
+    }
+    if (params->nfiles == 0) add_file(params,REMIND_FILE);
     for (int i=0;i<URGCOL;i++) params->ucol[i] = ((i%2==0)?37:40);
 
     newact->type = ACT_STANDARD;
@@ -238,7 +446,7 @@ bool parse_cmd_args(int argc, char *argv[], PARAMS* params, ACTREC* newact)
     newact->timeout = -1;
     newact->urgency = -1;
     newact->warning = -1;
-    newact->msg[0] = '\0';
+    newact->msg = "";
     newact->repeat.type = EOF;
     newact->repeat.day = 0;
     newact->repeat.nday = 0;
@@ -253,6 +461,15 @@ bool parse_cmd_args(int argc, char *argv[], PARAMS* params, ACTREC* newact)
             case 'a':
                 params->set_type = ACT_PERIODIC|ACT_STANDARD;
                 break;
+            case 'A':
+                if (!parse_range(*++argv,&(params->from),&(params->to)))
+                    error(ABORT,"bad date range");
+                params->cmd = CMD_AGENDA;
+                --argc;
+                break;
+            case 'b':
+                params->cmd = CMD_BATCH;
+                break;
             case 'c':
                 for (int i=0;i<URGCOL;i+=2) {
                     nargs = sscanf(*++argv,"%d,%d",&(params->ucol[i]),
@@ -263,6 +480,9 @@ bool parse_cmd_args(int argc, char *argv[], PARAMS* params, ACTREC* newact)
                 }
                 params->colour_set = true;
                 break;
+            case 'C':
+                params->cmd = CMD_COMPACT;
+                break;
             case 'd':
                 if ((newact->time = date_parse(*++argv,TIME_EOD)) <= 0) {
                     error(ABORT,"bad date format");
@@ -280,8 +500,23 @@ bool parse_cmd_args(int argc, char *argv[], PARAMS* params, ACTREC* newact)
             case 'e':
                 params->cmd = CMD_EXPORT;
                 break;
+            case 'E':
+                params->cmd = CMD_SWEEP;
+                break;
             case 'f':
-                params->filename = *++argv;
+                /* -f replaces REMIND_FILE; repeated, it adds files */
+                if (!params->file_set) params->nfiles = 0;
+                add_file(params,*++argv);
+                params->file_set = true;
+                --argc;
+                break;
+            case 'F':
+                params->filter = true;
+                break;
+            case 'g':
+                /* with -D -F, picks the actions to delete */
+                params->search = *++argv;
+                if (params->cmd != CMD_DELETE) params->cmd = CMD_SEARCH;
                 --argc;
                 break;
             case 'h':
@@ -291,12 +526,22 @@ bool parse_cmd_args(int argc, char *argv[], PARAMS* params, ACTREC* newact)
             case 'i':
                 params->cmd = CMD_INIT;
                 break;
+            case 'I':
+                params->import = *++argv;
+                params->cmd = CMD_IMPORT;
+                --argc;
+                break;
             case 'l':
                 params->cmd = CMD_LIST;
                 break;
             case 'L':
                 params->cmd = CMD_LIST_HEADER;
                 break;
+            case 'o':
+                if (!out_parse_format(*++argv,&(params->format)))
+                    error(ABORT,"bad output format");
+                --argc;
+                break;
             case 'm':
                 params->actlist = parse_int_list(*++argv);
                 if (!params->actlist) error(ABORT,"bad message list");
@@ -309,13 +554,16 @@ bool parse_cmd_args(int argc, char *argv[], PARAMS* params, ACTREC* newact)
                 params->set_type = ACT_PERIODIC;
                 break;
             case 'P':
-                params->pointer = atoi(*++argv);
+                params->pointer = strtoll(*++argv,NULL,10);
                 params->cmd = CMD_MOD_POINTER;
                 --argc;
                 break;
             case 'q':
                 params->quiet = true;
                 break;
+            case 'R':
+                params->cmd = CMD_DAEMON;
+                break;
             case 'r':
                 if (!parse_repeat(*++argv,&(newact->repeat.type),
                                   &(newact->repeat.day),
@@ -328,6 +576,9 @@ bool parse_cmd_args(int argc, char *argv[], PARAMS* params, ACTREC* newact)
                 newact->type = ACT_STANDARD;
                 params->set_type = ACT_STANDARD;
                 break;
+            case 'S':
+                params->stats = true;
+                break;
             case 't':
                 newact->timeout = atoi(*++argv);
                 if (newact->timeout < 0) error(ABORT,"bad timeout value");
@@ -335,7 +586,7 @@ bool parse_cmd_args(int argc, char *argv[], PARAMS* params, ACTREC* newact)
                 break;
             case 'u':
                 params->urgency = atoi(*++argv);
-                if (params->urgency < 0 || params->urgency > 4) {
+                if (params->urgency < 0 || params->urgency >= NURGENCY) {
                     error(ABORT,"bad urgency value");
                 }
                 newact->urgency = params->urgency;
@@ -381,21 +632,28 @@ bool parse_cmd_args(int argc, char *argv[], PARAMS* params, ACTREC* newact)
             }
             first_word = false;
         }
-        strncat(newact->msg,s,MSGSIZ-strlen(newact->msg));
-        if (strlen(newact->msg) == MSGSIZ) {
-            error(ABORT,"message too long");
-            return false;
+        if (msglen+strlen(s)+2 > msgsize) {
+            msgsize = 2*(msglen+strlen(s)+2);
+            if ((msg = realloc(msg,msgsize)) == NULL)
+                error(ABORT,"insufficient memory for message");
         }
-        strncat(newact->msg," ",MSGSIZ-strlen(newact->msg));
+        msglen += sprintf(msg+msglen,"%s ",s);
+    }
+    if (msglen > 0) {
+        msg[msglen-1] = '\0';
+        newact->msg = msg;
     }
-    *(newact->msg+strlen(newact->msg)-1) = '\0';
     /* presence of a message means define an action, unless
      * something other than DISPLAY requested */
     if (strlen(newact->msg) != 0 && params->cmd == CMD_DISPLAY) {
         params->cmd = CMD_DEFINE;
     }
-    /* use defaults for values unset */
-    if (params->cmd != CMD_MODIFY) {
+    if (params->filter && params->cmd != CMD_DELETE)
+        error(ABORT,"-F applies only to -D");
+    if (params->cmd == CMD_DELETE && params->search && !params->filter)
+        error(ABORT,"-g with -D requires -F");
+    /* use defaults for values unset; -D -F takes -d as a condition */
+    if (params->cmd != CMD_MODIFY && params->cmd != CMD_DELETE) {
         if (newact->timeout < 0) newact->timeout = 0;
         if (newact->urgency < 0 )newact->urgency = 4;
         if (newact->warning < 0 ) newact->warning = 7;
@@ -405,171 +663,770 @@ bool parse_cmd_args(int argc, char *argv[], PARAMS* params, ACTREC* newact)
     return true;
 }
 
-/* return struct tm* to next event date of action where repeat is Mth
- * occurrence of Nth weekday. */
-struct tm* mw_ev_time(time_t* now_time, struct st_repeat repeat, int month)
+/* Set ev, holding a year and time of day, to the date in month of the
+ * Mth occurrence of the Nth weekday of repeat, leaving date_mktime to
+ * resolve DST, as ev's DST flag asks, once the date is final.  Returns
+ * false if the month has no Mth, when ev is left past the month's end
+ * or, if last is set, moved back to the last such weekday in it. */
+bool mw_ev_time(struct tm* ev, struct st_repeat repeat, int month,
+                bool last)
 {
-    struct tm* ev_tm;
-    time_t fd_time;
-
-    ev_tm = localtime(now_time);
-    ev_tm->tm_mday = 1;
-    ev_tm->tm_mon = month;
-    fd_time = mktime(ev_tm);
-    ev_tm = localtime(&fd_time);
-    /* calculate mday of event */
-    ev_tm->tm_mday = (repeat.day - ev_tm->tm_wday) +
-        ((repeat.nday-1)*7) + 1 +
-        ((repeat.day < ev_tm->tm_wday)?7:0);
-    fd_time = mktime(ev_tm);
-    return ev_tm;
+    int ndays;
+
+    ev->tm_mday = date_month_wday(ev->tm_year,month,repeat.day,
+                                  repeat.nday,&ndays);
+    ev->tm_mon = month;
+    if (ev->tm_mday <= ndays) return true;
+    if (last) ev->tm_mday -= (ev->tm_mday-ndays+6)/7*7;
+    return false;
 }
 
 
-time_t make_active_time(ACTREC* action, time_t base_time)
+/* return time of next event, from base_time, of action at action_time
+ * repeating every nday weeks: a whole number of periods of whole days
+ * on, or the action time itself if that is still to come */
+static inline time_t week_active_time(time_t action_time, int nday,
+                                      time_t base_time)
+{
+    long long delta = (long long) base_time - action_time;
+    long long period = (nday==0?1:nday) * 7LL;
+    long long days = (delta + SECSPERDAY-1) / SECSPERDAY;
+
+    if (delta < 0) return action_time;
+    return base_time + (time_t) (period - days%period) * SECSPERDAY;
+}
+
+/* return time of next event, from base_time, of action at action_time
+ * repeating as repeat */
+time_t make_active_time(time_t action_time, struct st_repeat repeat,
+                        time_t base_time)
 {
-    double delta;
-    int now_mon, period, now_mday;
-    struct tm* ev_tm;
+    struct tm now_tm, ev_tm;
 
     time_t event_time;
 
-    switch (action->repeat.type) {
+    trace_begin("make_active_time","repeat",repeat.type);
+    stats.evaluations++;
+    switch (repeat.type) {
     case RT_YEAR:
-        event_time = date_make_current(action->time,YEAR_ONLY, base_time);
+        event_time = date_make_current(action_time,YEAR_ONLY, base_time);
         break;
     case RT_MONTH:
-        event_time = date_make_current(action->time,YEAR_AND_MONTH, base_time);
+        event_time = date_make_current(action_time,YEAR_AND_MONTH, base_time);
         break;
     case RT_WEEK:
-        delta = difftime(base_time,action->time);
-        if (delta < 0) {
-            /* action time is in the future; just return it */
-            event_time = action->time;
-        }
-        else {
-            /* compute next event time */
-            period = (action->repeat.nday==0?1:action->repeat.nday) * 7 *
-                SECSPERDAY;
-            delta = ceil(delta / SECSPERDAY) * SECSPERDAY;
-            event_time = base_time + period - ((int) delta)%period;
-        }
+        event_time = week_active_time(action_time,repeat.nday,base_time);
         break;
     case RT_MONTH_WEEK:
-        ev_tm = localtime(&base_time);
-        now_mon = ev_tm->tm_mon;
-        now_mday = ev_tm->tm_mday;
-        ev_tm = mw_ev_time(&base_time,action->repeat,now_mon);
-        if (ev_tm->tm_mon > now_mon) {
-            /* calculated event day next month, look for last wday
-             * in current month */
-            while (ev_tm->tm_mon > now_mon) {
-                ev_tm->tm_mday -= 7;
-                event_time = mktime(ev_tm);
-            }
-        }
-        else if (ev_tm->tm_mday < now_mday) {
+        date_local(base_time,&now_tm);
+        /* keeping the DST flag of now, so the event is a whole number
+         * of days away; with no Mth this month, the last such weekday */
+        ev_tm = now_tm;
+        if (mw_ev_time(&ev_tm,repeat,now_tm.tm_mon,true) &&
+            ev_tm.tm_mday < now_tm.tm_mday) {
             /* current day is later than this month's occurrence;
              * check next month */
-            ev_tm = mw_ev_time(&base_time,action->repeat,now_mon+1);
+            mw_ev_time(&ev_tm,repeat,now_tm.tm_mon+1,false);
         }
-        event_time = mktime(ev_tm);
+        event_time = date_mktime(&ev_tm);
         break;
     default:
-        error(ABORT,"invalid repeat type found: %d",action->repeat.type);
+        error(ABORT,"invalid repeat type found: %d",repeat.type);
     }
+    trace_end("make_active_time",NULL,0);
     return event_time;
 }
 
+/* Work out the next event, from base_time, of each of the n actions
+ * sel[k] of the parallel arrays time, repeat and warning, into
+ * event_time, and set due for those within their warning.  Weekly
+ * repeats are gathered and worked out together in whole days, in a
+ * pass of their own. */
+void make_active_times(int n, int sel[], time_t time[],
+                       struct st_repeat repeat[], int warning[],
+                       time_t base_time, time_t event_time[],
+                       unsigned char due[])
+{
+    trace_begin("make_active_times","actions",n);
+    for (int k=0; k<n; k++) {
+        int i = sel[k];
+
+        if (repeat[i].type != RT_WEEK)
+            event_time[i] = make_active_time(time[i],repeat[i],base_time);
+    }
+    for (int k=0; k<n; k++) {
+        int i = sel[k];
+
+        if (repeat[i].type == RT_WEEK) {
+            event_time[i] = week_active_time(time[i],repeat[i].nday,
+                                             base_time);
+            stats.evaluations++;
+        }
+    }
+    for (int k=0; k<n; k++) {
+        int i = sel[k];
+        long long delta = (long long) event_time[i] - base_time;
+
+        due[i] = (delta >= 0 && delta <= (warning[i]+1LL)*SECSPERDAY);
+    }
+    trace_end("make_active_times",NULL,0);
+    return;
+}
+
+/* Work out, as of now, the next event of periodic action act and its
+ * wake time: when display must next look at it, as the warning for
+ * that event starts, its snooze ends or it times out.  The warning is
+ * taken to start two days early, as for some repeats the event moves
+ * with the time of day, and clock changes shift it by an hour.  An Mth
+ * weekday found in next month may be up to two weeks late, if that
+ * month turns out to have no Mth weekday.  A standard action that
+ * times out wakes when it does. */
+void set_wake(ACTREC* act, time_t now)
+{
+    time_t expiry = act->time + (time_t) (act->timeout-1)*SECSPERDAY;
+    int early = (act->repeat.type == RT_MONTH_WEEK? 17 : 3);
+
+    if (act->type != ACT_PERIODIC) {
+        act->occur = 0;
+        act->wake = (act->timeout != 0? expiry : 0);
+        return;
+    }
+    act->occur = make_active_time(act->time,act->repeat,now);
+    if (act->next_event != 0)
+        act->wake = act->next_event - (time_t) (act->warning+1)*SECSPERDAY;
+    else
+        act->wake = act->occur - (time_t) (act->warning+early)*SECSPERDAY;
+    if (act->timeout != 0 && expiry < act->wake) act->wake = expiry;
+    rem_set_wakebase(now);
+    return;
+}
+
 void define_action(ACTREC* newact, int quiet)
 {
-    int newrecno;
+    RECNO newrecno;
 
     if (newact->repeat.type == RT_WEEK)
         newact->time =  date_make_days_match(newact->time,newact->repeat.day);
+    set_wake(newact,date_now());
 
     if ((newrecno = act_define(newact)) < 0)
         error(ABORT,error_msg[rem_error()],-newrecno);
-    if (!quiet) printf("remind: action [%03d] defined\n",newrecno);
+    if (!quiet) printf("remind: action [%03lld] defined\n",newrecno);
+    return;
+}
+
+/* What display does with each action it reads */
+enum row_state {
+    ROW_QUIET,    /* nothing */
+    ROW_EXPIRED,  /* timed out, so deleted */
+    ROW_RESET,    /* snooze over, so reset; not yet due */
+    ROW_DUE,      /* reported */
+    ROW_RESET_DUE /* snooze reset, and reported */
+};
+
+/* Per action working arrays for display, parallel to the snapshot */
+struct st_rows {
+    int size;
+    unsigned char* state;
+    time_t* event_time;  /* next event, if worked out */
+    unsigned char* due;
+    int* sel;
+};
+
+/* Parts of a report, in the order reports are merged */
+enum report_part {
+    PART_HEAD,            /* list header, or export's initialisation */
+    PART_PERIODIC,
+    PART_PERIODIC_COUNT,  /* background periodic actions */
+    PART_STANDARD,
+    PART_STANDARD_COUNT   /* background standard actions */
+};
+
+/* Start of a line of a report, with its key for merging */
+struct st_line {
+    long off;
+    enum report_part part;
+    time_t day;           /* start of the day reported on, or 0 */
+    int urgency;
+};
+
+/* Where display, list and export write their report.  Reporting on
+ * several database files at once, each file's report is written to
+ * memory by a thread of its own, and its lines keyed for merging. */
+struct st_report {
+    FILE* out;
+    enum out_format format;
+    bool keyed;              /* record each line's key? */
+    struct st_line* lines;
+    int nlines, size;
+    char* text;              /* report written to memory */
+    size_t len;
+    SNAPSHOT snap;           /* display's working storage */
+    struct st_rows rows;
+};
+
+typedef struct st_report REPORT;
+
+/* report written straight to stdout */
+REPORT console;
+
+/* Note the start of a line of report r, keyed by part, by the day of
+ * time when and by urgency */
+void report_line(REPORT* r, enum report_part part, time_t when,
+                 int urgency)
+{
+    struct st_line* line;
+
+    if (!r->keyed) return;
+    if (r->nlines == r->size) {
+        r->size = (r->size == 0? 64 : 2*r->size);
+        if ((r->lines = realloc(r->lines,r->size*sizeof(*r->lines))) == NULL)
+            error(ABORT,"insufficient memory for report");
+    }
+    line = &r->lines[r->nlines++];
+    line->off = ftell(r->out);
+    line->part = part;
+    line->day = (when == 0? 0 : day_start(when));
+    line->urgency = urgency;
+    return;
+}
+
+/* Free the storage of report r */
+void report_free(REPORT* r)
+{
+    free(r->lines);
+    free(r->text);
+    act_snapshot_free(&r->snap);
+    free(r->rows.state);
+    free(r->rows.event_time);
+    free(r->rows.due);
+    free(r->rows.sel);
+    return;
+}
+
+/* Take a snapshot of the actions display reports on at time now: of
+ * periodic actions, only those whose wake time has come; of standard
+ * actions, if expired is set, only those that have expired */
+void display_snapshot(SNAPSHOT* snap, ACTYPE type, int urgency, time_t now,
+                      bool expired)
+{
+    int rc, lo = urgency, hi = urgency;
+
+    if (urgency < 0) {
+        lo = 1;
+        hi = NURGENCY-1;
+    }
+    if (type == ACT_PERIODIC)
+        rc = act_due(snap,lo,hi,now);
+    else if (expired)
+        rc = act_expired(snap,lo,hi,now);
+    else
+        rc = act_snapshot(snap,type,lo,hi);
+    if (rc != 0) error(ABORT,error_msg[rem_error()],(RECNO) 0);
     return;
 }
 
-void display(ACTYPE type, int urgency, bool quiet, char* hilite)
+/* Take a snapshot of the background actions of type that may have
+ * timed out at now.  The default report doesn't show them, but times
+ * them out as it does the others. */
+void background_snapshot(SNAPSHOT* snap, ACTYPE type, time_t now)
 {
-    int nhidden = 0, actno;
+    if ((type == ACT_PERIODIC? act_due(snap,0,0,now) :
+         act_expired(snap,0,0,now)) != 0)
+        error(ABORT,error_msg[rem_error()],(RECNO) 0);
+    return;
+}
+
+/* Return true if snapshot action i has timed out at now */
+bool timed_out(SNAPSHOT* snap, int i, time_t now)
+{
+    return (snap->timeout[i] != 0 &&
+            difftime(now,snap->time[i]) > (snap->timeout[i]-1) * SECSPERDAY);
+}
+
+/* Return true if snapshot action i is snoozed and due to be reset */
+bool snooze_over(SNAPSHOT* snap, int i, time_t now)
+{
+    return (snap->next_event[i] != 0 &&
+            difftime(snap->next_event[i],now) <=
+            (snap->warning[i]+1) * SECSPERDAY);
+}
+
+/* Return true if the wake time of snapshot action i was set for an
+ * event now past, and should be set again */
+bool wake_stale(SNAPSHOT* snap, struct st_rows* rows, int i, time_t now)
+{
+    return (rows->state[i] != ROW_EXPIRED && snap->next_event[i] == 0 &&
+            difftime(now,snap->occur[i]) > SECSPERDAY &&
+            difftime(rows->event_time[i],snap->occur[i]) > SECSPERDAY);
+}
+
+/* Decide what display does with each action in the snapshot at time
+ * now.  The decisions are made in passes over the snapshot's arrays;
+ * no record is read. */
+void display_decide(SNAPSHOT* snap, struct st_rows* rows, ACTYPE type,
+                    time_t now)
+{
+    unsigned char* state;
+    int n = snap->n, nsel = 0;
+
+    if (n > rows->size) {
+        if ((rows->state = realloc(rows->state,n)) == NULL ||
+            (rows->event_time = realloc(rows->event_time,
+                                        n*sizeof(time_t))) == NULL ||
+            (rows->due = realloc(rows->due,n)) == NULL ||
+            (rows->sel = realloc(rows->sel,n*sizeof(int))) == NULL)
+            error(ABORT,"insufficient memory for display");
+        rows->size = n;
+    }
+    state = rows->state;
+
+    for (int i=0; i<n; i++) {
+        state[i] = (timed_out(snap,i,now)? ROW_EXPIRED : ROW_QUIET);
+    }
+    switch (type) {
+    case ACT_STANDARD:
+        for (int i=0; i<n; i++) {
+            if (state[i] == ROW_QUIET &&
+                difftime(now,snap->time[i]) > -SECSPERDAY) state[i] = ROW_DUE;
+        }
+        break;
+    case ACT_PERIODIC:
+        for (int i=0; i<n; i++) {
+            if (state[i] == ROW_QUIET && snooze_over(snap,i,now))
+                state[i] = ROW_RESET;
+        }
+        for (int i=0; i<n; i++) {
+            if (state[i] != ROW_EXPIRED &&
+                (state[i] != ROW_QUIET || snap->next_event[i] == 0))
+                rows->sel[nsel++] = i;
+        }
+        make_active_times(nsel,rows->sel,snap->time,snap->repeat,
+                          snap->warning,now,rows->event_time,rows->due);
+        for (int k=0; k<nsel; k++) {
+            int i = rows->sel[k];
+
+            if (rows->due[i])
+                state[i] = (state[i] == ROW_RESET? ROW_RESET_DUE : ROW_DUE);
+        }
+        break;
+    default:
+        error(ABORT,"bad action type: %d",type);
+    }
+    return;
+}
+
+/* Return true if display would change any of the actions it reads,
+ * by deleting those timed out, resetting snoozes or setting stale wake
+ * times again.  A standard action changes only as it times out, so
+ * just those on the expiry lists are looked at. */
+bool display_changes(REPORT* r, ACTYPE type, int urgency)
+{
+    SNAPSHOT* snap = &r->snap;
+    struct st_rows* rows = &r->rows;
+    time_t now = date_now();
+
+    display_snapshot(snap,type,urgency,now,true);
+    display_decide(snap,rows,type,now);
+    for (int i=0; i<snap->n; i++) {
+        if (rows->state[i] == ROW_EXPIRED || rows->state[i] == ROW_RESET ||
+            rows->state[i] == ROW_RESET_DUE ||
+            (type == ACT_PERIODIC && wake_stale(snap,rows,i,now)))
+            return true;
+    }
+    if (urgency < 0) {
+        background_snapshot(snap,type,now);
+        for (int i=0; i<snap->n; i++) {
+            if (timed_out(snap,i,now)) return true;
+        }
+    }
+    return false;
+}
+
+void display(REPORT* r, ACTYPE type, int urgency, bool quiet, char* hilite)
+{
+    SNAPSHOT* snap = &r->snap;
+    struct st_rows* rows = &r->rows;
+    RECNO nhidden = 0, actno;
     ACTREC* action;
-    time_t event_time;
-    double delta;
+    time_t now = date_now(), event_time;
     int delta_days;
 
-    act_iter_init(type);
-    actno = act_iter_next();
-    while (actno != 0) {
-        action = act_read(actno);
-        if (action->timeout != 0 &&
-            difftime(date_now(),action->time) >
-            (action->timeout-1) * SECSPERDAY) {
+    /* only the lists for the urgencies wanted are read; background
+     * actions are just counted, once those timed out are deleted */
+    stats_phase(PH_EVALUATE);
+    if (urgency < 0) {
+        background_snapshot(snap,type,now);
+        for (int i=0; i<snap->n; i++) {
+            if (!timed_out(snap,i,now)) continue;
+            if (act_delete(snap->actno[i],true) != 0)
+                error(ABORT,error_msg[rem_error()],snap->actno[i]);
+            stats.deletions++;
+        }
+        nhidden = act_count(type,0);
+    }
+    display_snapshot(snap,type,urgency,now,false);
+    display_decide(snap,rows,type,now);
+    stats_phase(PH_OUTPUT);
+    trace_begin("display output","actions",snap->n);
+
+    /* act on the decisions, reading only the records changed or
+     * reported */
+    for (int i=0; i<snap->n; i++) {
+        bool stale = (type == ACT_PERIODIC && !rem_readonly() &&
+                      wake_stale(snap,rows,i,now));
+
+        actno = snap->actno[i];
+        switch (rows->state[i]) {
+        case ROW_QUIET:
+            if (!stale) continue;
+            break;
+        case ROW_EXPIRED:
             if (act_delete(actno, true) != 0)
                 error(ABORT,error_msg[rem_error()], actno);
+            stats.deletions++;
+            continue;
+        default:
+            break;
         }
-        else if (urgency < 0 && action->urgency == 0) {
-            nhidden++;
+        if ((action = act_read(actno)) == NULL)
+            error(ABORT,error_msg[rem_error()], actno);
+        if (rows->state[i] == ROW_RESET ||
+            rows->state[i] == ROW_RESET_DUE || stale) {
+            /* Snoozed event reset, or wake time set again */
+            action->next_event = 0;
+            set_wake(action,now);
+            if (act_write(actno, action) != 0) {
+                error(ABORT,"unable to update action: %lld", actno);
+            }
+            if (rows->state[i] == ROW_RESET || rows->state[i] == ROW_QUIET)
+                continue;
+        }
+        if (type == ACT_STANDARD) {
+            if (action->urgency == 0) action->urgency = 4;
+            event_time = action->time;
         }
         else {
-            switch (type) {
-            case ACT_STANDARD:
-                if ((urgency < 0 ||
-                     (urgency >= 0 && urgency == action->urgency)) &&
-                    difftime(date_now(),action->time) > -SECSPERDAY) {
-                    if (action->urgency == 0) action->urgency = 4;
-                    printf("%s[%03d] %s%s\n",
-                           hilite_on(action->urgency,hilite), actno,
-                           action->msg,hilite);
-                }
-                break;
-            case ACT_PERIODIC:
-                event_time = make_active_time(action, date_now());
-                delta = difftime(event_time,date_now());
-                /* Snoozed event reset? */
-                if (action->next_event) {
-                    double ndelta = difftime(action->next_event, date_now());
-                    if (ndelta <= (action->warning+1)*SECSPERDAY) {
-                        action->next_event = 0;
-                        if (act_write(actno, action) != 0) {
-                            error(ABORT,"unable to update action: %d", actno);
-                        }
-                    }
-                }
-                if (delta >= 0 && delta <= (action->warning+1)*SECSPERDAY &&
-                    !action->next_event &&
-                    (urgency < 0 ||
-                     (urgency >= 0 && urgency == action->urgency))) {
-                    delta_days = floor(delta/SECSPERDAY);
-                    printf("%s[%03d] [%s]",
-                           hilite_on(action->urgency, hilite),
-                           actno, date_str(event_time));
-                    if (delta_days == 1)
-                        printf(" (tomorrow) ");
-                    else if (delta_days == 0)
-                        printf(" (today) ");
-                    else
-                        printf(" (%2d days) ",delta_days);
-                    printf("%s%s\n",action->msg,hilite);
-                }
-                break;
-            default:
-                error(ABORT,"bad action type: %d",type);
-            }
+            event_time = rows->event_time[i];
+        }
+        delta_days = floor(difftime(event_time,now)/SECSPERDAY);
+        report_line(r,(type == ACT_STANDARD? PART_STANDARD : PART_PERIODIC),
+                    event_time,action->urgency);
+        if (r->format != OUT_TEXT) {
+            OUTREC rec;
+
+            out_begin(&rec,r->out,r->format);
+            out_int(&rec,"action",actno);
+            out_int(&rec,"type",type);
+            out_int(&rec,"urgency",action->urgency);
+            out_str(&rec,"date",date_str(event_time));
+            out_int(&rec,"days",delta_days);
+            out_str(&rec,"message",action->msg);
+            out_end(&rec);
+        }
+        else if (type == ACT_STANDARD) {
+            fprintf(r->out,"%s[%03lld] %s%s\n",
+                    hilite_on(action->urgency,hilite), actno,
+                    action->msg,hilite);
+        }
+        else {
+            fprintf(r->out,"%s[%03lld] [%s]",
+                    hilite_on(action->urgency, hilite),
+                    actno, date_str(event_time));
+            if (delta_days == 1)
+                fprintf(r->out," (tomorrow) ");
+            else if (delta_days == 0)
+                fprintf(r->out," (today) ");
+            else
+                fprintf(r->out," (%2d days) ",delta_days);
+            fprintf(r->out,"%s%s\n",action->msg,hilite);
         }
-        actno = act_iter_next();
     }
-    if (urgency < 0 && nhidden > 0 && !quiet) {
+    trace_end("display output",NULL,0);
+    if (urgency < 0 && nhidden > 0 && !quiet && r->format == OUT_TEXT) {
         char *typestr = (type==ACT_STANDARD?"standard":"periodic");
+
+        report_line(r,(type==ACT_STANDARD? PART_STANDARD_COUNT :
+                       PART_PERIODIC_COUNT),0,0);
         if (nhidden == 1)
-            printf(">>>>> There is one background %s action\n",typestr);
+            fprintf(r->out,">>>>> There is one background %s action\n",
+                    typestr);
         else
-            printf(">>>>> There are %d background %s actions\n",nhidden,
-                   typestr);
+            fprintf(r->out,">>>>> There are %lld background %s actions\n",
+                    nhidden,typestr);
+    }
+    return;
+}
+
+/* An action's occurrences, stepped through in turn by the agenda */
+struct st_occur {
+    time_t time;      /* this occurrence */
+    ACTYPE type;
+    SNAPSHOT* snap;   /* snapshot holding the action */
+    int i;            /* action's index in snap */
+    int n;            /* periodic occurrences on from the first */
+    struct tm first;  /* local time of the first periodic occurrence */
+};
+
+/* Return the time of periodic occurrence o->n, working from the first
+ * occurrence, so that a short month doesn't move those after it */
+time_t occur_time(struct st_occur* o)
+{
+    struct st_repeat repeat = o->snap->repeat[o->i];
+    struct tm tm = o->first;
+
+    tm.tm_isdst = -1;
+    switch (repeat.type) {
+    case RT_YEAR:
+        tm.tm_year += o->n;
+        break;
+    case RT_MONTH:
+        tm.tm_mon += o->n;
+        break;
+    case RT_WEEK:
+        tm.tm_mday += o->n * 7 * (repeat.nday==0?1:repeat.nday);
+        break;
+    case RT_MONTH_WEEK:
+        /* no Mth weekday this month; take the last */
+        mw_ev_time(&tm,repeat,tm.tm_mon+o->n,true);
+        break;
+    default:
+        error(ABORT,"invalid repeat type found: %d",repeat.type);
+    }
+    return date_mktime(&tm);
+}
+
+/* Set o to action i of snap, at its time if a standard action.  The
+ * occurrences of a periodic action are counted from from's year or
+ * month, or, for a weekly repeat, from the action's time, starting a
+ * period or so before from. */
+void occur_init(struct st_occur* o, SNAPSHOT* snap, int i, ACTYPE type,
+                time_t from)
+{
+    struct tm start;
+    int nday;
+
+    o->type = type;
+    o->snap = snap;
+    o->i = i;
+    o->n = 0;
+    if (type == ACT_STANDARD) {
+        o->time = snap->time[i];
+        return;
+    }
+    date_local(snap->time[i],&o->first);
+    date_local(from,&start);
+    switch (snap->repeat[i].type) {
+    case RT_YEAR:
+        o->first.tm_year = start.tm_year;
+        break;
+    case RT_MONTH:
+    case RT_MONTH_WEEK:
+        o->first.tm_year = start.tm_year;
+        o->first.tm_mon = start.tm_mon;
+        break;
+    case RT_WEEK:
+        nday = (snap->repeat[i].nday==0?1:snap->repeat[i].nday);
+        /* a day short, for the hour a clock change takes */
+        if (difftime(from,snap->time[i]) > SECSPERDAY)
+            o->n = (int) (difftime(from,snap->time[i])/SECSPERDAY - 1) /
+                (7*nday);
+        break;
+    default:
+        break;
+    }
+    o->time = occur_time(o);
+    return;
+}
+
+/* Move o on to its first occurrence from from, and after the end of
+ * any snooze.  Returns false if it has none up to to, or none before
+ * it times out. */
+bool occur_seek(struct st_occur* o, time_t from, time_t to)
+{
+    SNAPSHOT* snap = o->snap;
+    int i = o->i;
+    time_t expiry = snap->time[i] + (time_t) (snap->timeout[i]-1)*SECSPERDAY;
+
+    if (o->type == ACT_PERIODIC) {
+        if (snap->next_event[i] != 0 &&
+            difftime(day_start(snap->next_event[i]),from) > 0)
+            from = day_start(snap->next_event[i]);
+        while (difftime(o->time,from) < 0) {
+            o->n++;
+            o->time = occur_time(o);
+        }
+    }
+    return (difftime(o->time,from) >= 0 && difftime(o->time,to) <= 0 &&
+            (snap->timeout[i] == 0 || difftime(o->time,expiry) <= 0));
+}
+
+/* The next occurrence of an action, as kept in the agenda's heap */
+struct st_next {
+    time_t time;
+    RECNO actno;
+    int occur;  /* index of the action's st_occur */
+};
+
+/* Order occurrences by time, then action number */
+static inline bool next_before(struct st_next* a, struct st_next* b)
+{
+    return (a->time < b->time || (a->time == b->time && a->actno < b->actno));
+}
+
+/* Move entry k of the n in heap down to its place */
+void next_sift(struct st_next* heap, int n, int k)
+{
+    struct st_next e = heap[k];
+
+    for (;;) {
+        int c = 2*k+1;
+
+        if (c >= n) break;
+        if (c+1 < n && next_before(&heap[c+1],&heap[c])) c++;
+        if (!next_before(&heap[c],&e)) break;
+        heap[k] = heap[c];
+        k = c;
+    }
+    heap[k] = e;
+    return;
+}
+
+/* List the occurrences, from time from to time to, of the actions of
+ * set_type and urgency, in time order.  Each action's occurrences are
+ * stepped through in turn, with the next of each kept in a heap, so
+ * the database is read once whatever the range. */
+void agenda(REPORT* r, int set_type, int urgency, time_t from, time_t to,
+            char* hilite)
+{
+    static SNAPSHOT snap[2];
+    static struct st_occur* occur = NULL;
+    static struct st_next* heap = NULL;
+    static int size = 0;
+    ACTYPE types[2] = {ACT_PERIODIC, ACT_STANDARD};
+    int n = 0, lo = urgency, hi = urgency, u;
+    ACTREC* action;
+
+    if (urgency < 0) {
+        lo = 1;
+        hi = NURGENCY-1;
+    }
+    for (int t=0; t<2; t++) {
+        snap[t].n = 0;
+        if ((set_type & types[t]) &&
+            act_snapshot(&snap[t],types[t],lo,hi) != 0)
+            error(ABORT,error_msg[rem_error()],(RECNO) 0);
+    }
+    if (snap[0].n + snap[1].n > size) {
+        size = snap[0].n + snap[1].n;
+        if ((occur = realloc(occur,size*sizeof(*occur))) == NULL ||
+            (heap = realloc(heap,size*sizeof(*heap))) == NULL)
+            error(ABORT,"insufficient memory for agenda");
+    }
+    for (int t=0; t<2; t++) {
+        for (int i=0; i<snap[t].n; i++) {
+            occur_init(&occur[n],&snap[t],i,types[t],from);
+            if (!occur_seek(&occur[n],from,to)) continue;
+            heap[n].time = occur[n].time;
+            heap[n].actno = snap[t].actno[i];
+            heap[n].occur = n;
+            n++;
+        }
+    }
+    for (int k=n/2-1; k>=0; k--) next_sift(heap,n,k);
+
+    while (n > 0) {
+        struct st_occur* o = &occur[heap[0].occur];
+        time_t t = o->time;
+
+        if ((action = act_read(heap[0].actno)) == NULL)
+            error(ABORT,error_msg[rem_error()],heap[0].actno);
+        u = action->urgency;
+        if (o->type == ACT_STANDARD && u == 0) u = 4;
+        if (r->format != OUT_TEXT) {
+            OUTREC rec;
+
+            out_begin(&rec,r->out,r->format);
+            out_int(&rec,"action",heap[0].actno);
+            out_int(&rec,"type",o->type);
+            out_int(&rec,"urgency",u);
+            out_str(&rec,"date",date_str(t));
+            out_str(&rec,"message",action->msg);
+            out_end(&rec);
+        }
+        else {
+            fprintf(r->out,"%s[%03lld] [%s] %s%s\n",hilite_on(u,hilite),
+                    heap[0].actno,date_str(t),action->msg,hilite);
+        }
+        if (o->type == ACT_STANDARD) {
+            heap[0] = heap[--n];
+        }
+        else {
+            o->n++;
+            o->time = occur_time(o);
+            if (occur_seek(o,t+1,to))
+                heap[0].time = o->time;
+            else
+                heap[0] = heap[--n];
+        }
+        next_sift(heap,n,0);
+    }
+    return;
+}
+
+/* Delete the actions of urgency, or of all urgencies, that have timed
+ * out.  They are found from the wake and expiry lists, so only those
+ * due to be looked at are read, and deleted in one transaction. */
+void sweep(int urgency, bool quiet)
+{
+    SNAPSHOT snap;
+    int lo = urgency, hi = urgency, n = 0;
+    time_t now = date_now();
+
+    if (urgency < 0) {
+        lo = 0;
+        hi = NURGENCY-1;
+    }
+    memset(&snap,0,sizeof(snap));
+    for (int pass=0; pass<2; pass++) {
+        if ((pass == 0? act_due(&snap,lo,hi,now) :
+             act_expired(&snap,lo,hi,now)) != 0)
+            error(ABORT,error_msg[rem_error()],(RECNO) 0);
+        for (int i=0; i<snap.n; i++) {
+            if (!timed_out(&snap,i,now)) continue;
+            if (act_delete(snap.actno[i],true) != 0)
+                error(ABORT,error_msg[rem_error()],snap.actno[i]);
+            n++;
+        }
+    }
+    act_snapshot_free(&snap);
+    if (!quiet) {
+        if (n == 1)
+            printf("remind: one timed out action deleted\n");
+        else
+            printf("remind: %d timed out actions deleted\n",n);
+    }
+    return;
+}
+
+/* rewrite the database without its free records, reporting the
+ * space recovered */
+void compact(char* filename, bool quiet)
+{
+    struct stat before, after;
+    RECNO nbefore = rem_header()->numrec-1;
+
+    if (stat(filename,&before) != 0)
+        error(ABORT,error_msg[RE_OPEN],filename);
+    if (rem_compact(filename) != 0)
+        error(ABORT,error_msg[rem_error()],filename);
+    if (stat(filename,&after) != 0)
+        error(ABORT,error_msg[RE_OPEN],filename);
+    if (!quiet) {
+        printf("remind: %lld records compacted to %lld, %ld bytes "
+               "reclaimed\n",
+               nbefore, rem_header()->numrec-1,
+               (long) (before.st_size-after.st_size));
     }
     return;
 }
@@ -577,7 +1434,7 @@ void display(ACTYPE type, int urgency, bool quiet, char* hilite)
 void create_file(char* filename, int ucol[], int quiet)
 {
     if (!quiet && exists(filename)) {
-        ask(filename);
+        ask(filename,stdin);
     }
     if (!rem_create(filename,ucol)) {
         error(ABORT, error_msg[rem_error()], filename);
@@ -585,67 +1442,257 @@ void create_file(char* filename, int ucol[], int quiet)
     return;
 }
 
-void dump_action(int actno)
+void dump_action(REPORT* r, RECNO actno)
 {
     ACTREC* action;
+    OUTREC rec;
 
-    if ((action = act_read(actno)) != NULL) {
-        printf("--Action: %d--\n",actno);
-        printf("Type:    %s\n",str_act_type(action->type));
-        printf("Next:    %d\n",action->next);
-        printf("Urgency: %d\n",action->urgency);
-        printf("Warning: %d\n",action->warning);
-        printf("Date:    %s\n",date_str(action->time));
-        printf("Repeat:  %s\n",repeat_str(action->repeat));
-        printf("Timeout: %d\n",action->timeout);
-        printf("NextEvt: %s\n",date_full_str(action->next_event));
-        printf("Msg:     \"%s\"\n",action->msg);
+    if ((action = act_read(actno)) == NULL) {
+        error(CONTINUE, error_msg[rem_error()], actno);
+    }
+    else if (r->format != OUT_TEXT) {
+        out_begin(&rec,r->out,r->format);
+        out_int(&rec,"action",actno);
+        out_int(&rec,"type",action->type);
+        out_int(&rec,"next",action->next);
+        out_int(&rec,"prev",action->prev);
+        out_int(&rec,"urgency",action->urgency);
+        out_int(&rec,"warning",action->warning);
+        out_str(&rec,"date",date_str(action->time));
+        out_str(&rec,"repeat",repeat_str(action->repeat));
+        out_int(&rec,"timeout",action->timeout);
+        out_str(&rec,"next_event",date_full_str(action->next_event));
+        out_str(&rec,"message",action->msg);
+        out_end(&rec);
     }
     else {
-        error(CONTINUE, error_msg[rem_error()], actno);
+        fprintf(r->out,"--Action: %lld--\n",actno);
+        fprintf(r->out,"Type:    %s\n",str_act_type(action->type));
+        fprintf(r->out,"Next:    %lld\n",action->next);
+        fprintf(r->out,"Prev:    %lld\n",action->prev);
+        fprintf(r->out,"Urgency: %d\n",action->urgency);
+        fprintf(r->out,"Warning: %d\n",action->warning);
+        fprintf(r->out,"Date:    %s\n",date_str(action->time));
+        fprintf(r->out,"Repeat:  %s\n",repeat_str(action->repeat));
+        fprintf(r->out,"Timeout: %d\n",action->timeout);
+        fprintf(r->out,"NextEvt: %s\n",date_full_str(action->next_event));
+        fprintf(r->out,"Msg:     \"%s\"\n",action->msg);
     }
     return;
 }
 
-void delete_action(int actno, bool nullify)
+/* Delete action actno, returning whether it was deleted */
+bool delete_action(RECNO actno, bool nullify)
 {
-    if ((act_delete(actno, nullify) != 0))
+    if ((act_delete(actno, nullify) != 0)) {
         error(CONTINUE, error_msg[rem_error()], actno);
+        return false;
+    }
+    return true;
+}
+
+int actno_cmp(const void* a, const void* b)
+{
+    RECNO x = *(const RECNO*) a, y = *(const RECNO*) b;
+
+    return (x < y? -1 : (x > y));
+}
+
+/* Delete the actions of list, each of which must be in use, and
+ * those in use within its ranges, in the order given.  With filter,
+ * only those meeting the conditions are deleted: of set_type and of
+ * urgency, unless it is negative, dated before, unless it is zero, and
+ * whose messages hold text, unless it is NULL.  These are found from
+ * snapshots and the message index.  The actions are deleted together. */
+void delete_actions(struct st_nlist* list, bool filter, int set_type,
+                    int urgency, time_t before, char* text, bool nullify)
+{
+    RECNO numrec = rem_header()->numrec, *found;
+    int n = 0, nfound;
+    unsigned char* want = calloc(numrec/8+1,1);
+    unsigned char* holds = NULL;
+    RECNO* recs = malloc(numrec*sizeof(RECNO));
+    struct st_nlist* np;
+    ACTREC* action;
+    SNAPSHOT snap;
+
+    if (want == NULL || recs == NULL)
+        error(ABORT,"insufficient memory for list");
+    for (np = list; np != NULL; np = np->next) {
+        if (np->last != 0) {
+            check_range(np,numrec);
+            for (RECNO actno=(np->n > 0? np->n : 1);
+                 actno<=np->last && actno<numrec; actno++) {
+                if (want[actno/8] & (1 << actno%8)) continue;
+                /* snapshots hold only the actions in use */
+                if (!filter) {
+                    if ((action = act_read(actno)) == NULL)
+                        error(ABORT,error_msg[rem_error()],actno);
+                    if (action->type == ACT_FREE) continue;
+                    recs[n++] = actno;
+                }
+                want[actno/8] |= 1 << actno%8;
+            }
+        }
+        else if (np->n < 1 || np->n >= numrec) {
+            error(CONTINUE,error_msg[RE_RECNO],np->n);
+        }
+        else if ((action = act_read(np->n)) == NULL) {
+            error(CONTINUE,error_msg[rem_error()],np->n);
+        }
+        else if (action->type == ACT_FREE ||
+                 (want[np->n/8] & (1 << np->n%8))) {
+            error(CONTINUE,error_msg[RE_ACTIONTYPE],np->n);
+        }
+        else {
+            want[np->n/8] |= 1 << np->n%8;
+            if (!filter) recs[n++] = np->n;
+        }
+    }
+    if (filter) {
+        if (text != NULL) {
+            if ((nfound = act_search(text,&found)) < 0 ||
+                (holds = calloc(numrec/8+1,1)) == NULL)
+                error(ABORT,"insufficient memory for list");
+            for (int i=0; i<nfound; i++)
+                holds[found[i]/8] |= 1 << found[i]%8;
+        }
+        memset(&snap,0,sizeof(snap));
+        for (int type=ACT_PERIODIC; type<=ACT_STANDARD; type++) {
+            if (!(type & set_type)) continue;
+            if (act_snapshot(&snap,type,(urgency < 0? 0 : urgency),
+                             (urgency < 0? NURGENCY-1 : urgency)) != 0)
+                error(ABORT,error_msg[rem_error()],(RECNO) 0);
+            for (int i=0; i<snap.n; i++) {
+                RECNO actno = snap.actno[i];
+
+                if ((want[actno/8] & (1 << actno%8)) &&
+                    (before == 0 || snap.time[i] < before) &&
+                    (holds == NULL || (holds[actno/8] & (1 << actno%8))))
+                    recs[n++] = actno;
+            }
+        }
+        act_snapshot_free(&snap);
+        qsort(recs,n,sizeof(RECNO),actno_cmp);
+    }
+    if (n > 0 && act_delete_many(recs,n,nullify) != 0)
+        error(ABORT,error_msg[rem_error()],(RECNO) 0);
+    free(want);
+    free(holds);
+    free(recs);
+    return;
+}
+
+/* Write action actno as a record of the fields -l lists; tab
+ * separated, -I reads it back */
+void list_record(REPORT* r, RECNO actno, ACTREC* action)
+{
+    OUTREC rec;
+
+    out_begin(&rec,r->out,r->format);
+    out_int(&rec,"action",actno);
+    out_int(&rec,"type",action->type);
+    out_int(&rec,"urgency",action->urgency);
+    out_int(&rec,"warning",action->warning);
+    out_str(&rec,"date",date_str(action->time));
+    out_int(&rec,"timeout",action->timeout);
+    out_str(&rec,"repeat",repeat_str(action->repeat));
+    out_str(&rec,"message",action->msg);
+    out_end(&rec);
     return;
 }
 
-void list_actions(enum cmd_type option, int set_type)
+void list_actions(REPORT* r, enum cmd_type option, int set_type)
 {
     REMHDR* header;
     ACTREC* action;
 
+    stats_phase(PH_OUTPUT);
     header = rem_header();
-    if (option == CMD_LIST_HEADER) {
-        printf("P: %d  S: %d  F: %d  Num: %d [",header->phead, header->shead,
-               header->fhead,header->numrec);
+    if (option == CMD_LIST_HEADER && r->format != OUT_TEXT) {
+        OUTREC rec;
+        long long phead[NURGENCY], ucol[URGCOL];
+
+        for (int u=0; u<NURGENCY; u++) phead[u] = header->phead[u][0];
+        for (int i=0; i<URGCOL; i++) ucol[i] = header->ucol[i];
+        report_line(r,PART_HEAD,0,0);
+        if (r->format == OUT_TSV) putc('#',r->out);  /* -I skips it */
+        out_begin(&rec,r->out,r->format);
+        out_ints(&rec,"periodic",phead,NURGENCY);
+        out_ints(&rec,"standard",header->shead,NURGENCY);
+        out_int(&rec,"free",header->fhead);
+        out_int(&rec,"records",header->numrec);
+        out_ints(&rec,"colours",ucol,URGCOL);
+        out_end(&rec);
+    }
+    else if (option == CMD_LIST_HEADER) {
+        report_line(r,PART_HEAD,0,0);
+        fprintf(r->out,"P:");
+        for (int u=0; u<NURGENCY; u++)
+            fprintf(r->out,"%c%lld",(u==0?' ':','),
+                    header->phead[u][0]);
+        fprintf(r->out,"  S:");
+        for (int u=0; u<NURGENCY; u++)
+            fprintf(r->out,"%c%lld",(u==0?' ':','),header->shead[u]);
+        fprintf(r->out,"  F: %lld  Num: %lld [",header->fhead,
+                header->numrec);
         for (int i=0; i<URGCOL; i+=2) {
-            printf("%d,%d%s",header->ucol[i], header->ucol[i+1],
-                   (i==URGCOL-2?"":" "));
+            fprintf(r->out,"%d,%d%s",header->ucol[i], header->ucol[i+1],
+                    (i==URGCOL-2?"":" "));
         }
-        printf("]\n");
+        fprintf(r->out,"]\n");
     }
-    for (int actno=1; actno < header->numrec; actno++) {
+    for (RECNO actno=1; actno < header->numrec; actno++) {
         if ((action = act_read(actno)) == NULL)
             error(ABORT, error_msg[rem_error()], actno);
         if ((option == CMD_LIST_HEADER && action->type == ACT_FREE) ||
             (action->type & set_type)) {
-            printf("[%03d] %1d %1d %2d %s %2d %s \"%s\"\n",
-                   actno, action->type,
-                   action->urgency, action->warning, date_str(action->time),
-                   action->timeout, repeat_str(action->repeat), action->msg);
+            report_line(r,(action->type == ACT_PERIODIC? PART_PERIODIC :
+                           PART_STANDARD),action->time,action->urgency);
+            if (r->format != OUT_TEXT) {
+                list_record(r,actno,action);
+                continue;
+            }
+            fprintf(r->out,"[%03lld] %1d %1d %2d %s %2d %s \"%s\"\n",
+                    actno, action->type,
+                    action->urgency, action->warning, date_str(action->time),
+                    action->timeout, repeat_str(action->repeat), action->msg);
         }
     }
 }
 
-void modify_action(int actno,ACTREC* newact)
+/* Write the actions of set_type, and of urgency unless it is
+ * negative, whose messages hold text, ignoring case: as a list of
+ * their numbers that -D, -m and -X take, or listed as -l lists them
+ * for -o */
+void search(REPORT* r, char* text, int set_type, int urgency)
 {
     ACTREC* action;
-    char *p, buf[MSGSIZ+1];
+    RECNO* found;
+    int n, nout = 0;
+
+    if ((n = act_search(text,&found)) < 0)
+        error(ABORT,error_msg[rem_error()],(RECNO) 0);
+    stats_phase(PH_OUTPUT);
+    for (int i=0; i<n; i++) {
+        if ((action = act_read(found[i])) == NULL)
+            error(ABORT,error_msg[rem_error()],found[i]);
+        if (!(action->type & set_type) ||
+            (urgency >= 0 && action->urgency != urgency)) continue;
+        if (r->format != OUT_TEXT)
+            list_record(r,found[i],action);
+        else
+            fprintf(r->out,"%s%lld",(nout == 0? "" : ","),found[i]);
+        nout++;
+    }
+    if (r->format == OUT_TEXT && nout > 0) putc('\n',r->out);
+    return;
+}
+
+void modify_action(RECNO actno,ACTREC* newact)
+{
+    ACTREC* action;
+    char *p, *msg;
     ACTREC save;
 
     action = act_read(actno);
@@ -666,35 +1713,42 @@ void modify_action(int actno,ACTREC* newact)
     if (newact->time > 0) save.time = newact->time;
     if (newact->repeat.type != EOF) save.repeat = newact->repeat;
 
-    if (strlen(newact->msg) != 0) {
-        p = strchr(newact->msg,'&');
-        if (p != NULL) {
-            *p++ = '\0';
-            buf[0]='\0';
-            strncat(buf,newact->msg,MSGSIZ);
-            strncat(buf,action->msg,MSGSIZ-strlen(buf));
-            strncat(buf,p,MSGSIZ-strlen(buf));
-            strncpy(newact->msg,buf,MSGSIZ);
-        }
-        strncpy(save.msg,newact->msg,MSGSIZ);
-    }
+    /* '&' in the new message stands for the old one */
+    p = strchr(newact->msg,'&');
+    msg = malloc(strlen(newact->msg)+strlen(action->msg)+1);
+    if (msg == NULL) error(ABORT,"insufficient memory for message");
+    if (strlen(newact->msg) == 0)
+        strcpy(msg,action->msg);
+    else if (p == NULL)
+        strcpy(msg,newact->msg);
+    else
+        sprintf(msg,"%.*s%s%s",(int) (p-newact->msg),newact->msg,
+                action->msg,p+1);
+    save.msg = msg;
     /* force action time to match day of week of WEEK repeat */
     if (save.repeat.type == RT_WEEK)
         save.time = date_make_days_match(save.time,save.repeat.day);
 
-    if ((newact->urgency >= 0 && save.type == ACT_STANDARD) ||
-        (newact->time > 0 && save.type == ACT_PERIODIC)) {
-        /* need to re-insert action into list; potential sequence change */
-        delete_action(actno, false);
+    /* re-insert the action, moving it to the end of its list, when an
+     * urgency or date is given, and whenever its date moves, as by -r,
+     * as periodic lists are ordered by date */
+    if (newact->urgency >= 0 || (save.type == ACT_PERIODIC &&
+        (newact->time > 0 || save.time != action->time))) {
+        if (!delete_action(actno, false)) {
+            free(msg);
+            error(ABORT,"unable to modify action: %lld", actno);
+        }
         define_action(&save,true);
     }
     else {
+        set_wake(&save,date_now());
         if (act_write(actno,&save) != 0)
             error(CONTINUE, error_msg[rem_error()], actno);
     }
+    free(msg);
 }
 
-void modify_action_pointer(int actno, int pointer)
+void modify_action_pointer(RECNO actno, RECNO pointer)
 {
     ACTREC* action;
 
@@ -708,28 +1762,31 @@ enum {
     DAYMONSTRLEN = 5
 };
 
-void export(char* filename)
+void export(REPORT* r, char* filename)
 {
     ACTREC* action;
     REMHDR* header;
-    int actno;
+    RECNO actno;
     char daymon[DAYMONSTRLEN+1];
 
+    stats_phase(PH_OUTPUT);
     if ((header = rem_header()) == NULL) error(ABORT,error_msg[rem_error()]);
 
-    printf("remind -iq -f %s -c ",filename);
+    report_line(r,PART_HEAD,0,0);
+    fprintf(r->out,"remind -iq -f %s -c ",filename);
     for (int i=0;i<URGCOL;i+=2)
-        printf("%d,%d ",header->ucol[i],header->ucol[i+1]);
-    printf("\n");
+        fprintf(r->out,"%d,%d ",header->ucol[i],header->ucol[i+1]);
+    fprintf(r->out,"\n");
 
     if (!act_iter_init(ACT_STANDARD)) error(ABORT,"action interator failed");
     actno = act_iter_next();
     while (actno) {
         if ((action = act_read(actno)) == NULL)
             error(ABORT,error_msg[rem_error()],actno);
-        printf("remind -fuwtqsd %s %d %d %d %s \"%s\"\n", filename,
-               action->urgency, action->warning, action->timeout,
-               date_str(action->time), action->msg);
+        report_line(r,PART_STANDARD,action->time,action->urgency);
+        fprintf(r->out,"remind -fuwtqsd %s %d %d %d %s \"%s\"\n", filename,
+                action->urgency, action->warning, action->timeout,
+                date_str(action->time), action->msg);
         actno = act_iter_next();
     }
 
@@ -740,81 +1797,261 @@ void export(char* filename)
             error(ABORT,error_msg[rem_error()],actno);
         strncpy(daymon, date_str(action->time), DAYMONSTRLEN);
         daymon[DAYMONSTRLEN] = '\0';
-        printf("remind -fruwtdq %s %s %d %d %d %s \"%s\"\n", filename,
-               repeat_str(action->repeat),  action->urgency, action->warning,
-               action->timeout, daymon, action->msg);
+        report_line(r,PART_PERIODIC,action->time,action->urgency);
+        fprintf(r->out,"remind -fruwtdq %s %s %d %d %d %s \"%s\"\n",
+                filename, repeat_str(action->repeat),  action->urgency,
+                action->warning, action->timeout, daymon, action->msg);
         actno = act_iter_next();
     }
 }
 
-void set_next_event_time(int actno)
+/* Split line into words at white space.  A word starting with a
+ * double quote runs to the closing quote; the quotes are removed. */
+int split_words(char* line, char* words[], int maxwords)
+{
+    int nwords = 0;
+    char* p = line;
+
+    for (;;) {
+        while (*p == ' ' || *p == '\t' || *p == '\n') p++;
+        if (*p == '\0') break;
+        if (nwords == maxwords) error(ABORT,"too many words");
+        if (*p == '"') {
+            words[nwords++] = ++p;
+            if ((p = strchr(p,'"')) == NULL) error(ABORT,"missing quote");
+        }
+        else {
+            words[nwords++] = p;
+            p += strcspn(p," \t\n");
+        }
+        if (*p == '\0') break;
+        *p++ = '\0';
+    }
+    return nwords;
+}
+
+/* Parse an action from tab separated fields: type, urgency, warning,
+ * date, timeout, repeat and message, optionally preceded by an
+ * action number, which is ignored. */
+void parse_tsv(char* line, ACTREC* act)
+{
+    char* field[8];
+    int nfields = 0;
+    char* s;
+
+    line[strcspn(line,"\n")] = '\0';
+    while (nfields < 8 && (s = strsep(&line,"\t")) != NULL) {
+        field[nfields++] = s;
+    }
+    if (line != NULL || nfields < 7) error(ABORT,"bad number of fields");
+    if (nfields == 8) memmove(field,field+1,7*sizeof(char*));
+
+    memset(act,0,sizeof(ACTREC));
+    act->type = atoi(field[0]);
+    if (act->type != ACT_PERIODIC && act->type != ACT_STANDARD)
+        error(ABORT,"bad action type");
+    act->urgency = atoi(field[1]);
+    if (act->urgency < 0 || act->urgency >= NURGENCY)
+        error(ABORT,"bad urgency value");
+    act->warning = atoi(field[2]);
+    if (act->warning < 0) error(ABORT,"bad warning value");
+    if ((act->time = date_parse(field[3],TIME_EOD)) <= 0)
+        error(ABORT,"bad date format");
+    act->timeout = atoi(field[4]);
+    if (act->timeout < 0) error(ABORT,"bad timeout value");
+    if (!parse_repeat(field[5],&(act->repeat.type),&(act->repeat.day),
+                      &(act->repeat.nday)))
+        error(ABORT,"bad repeat option");
+    act->msg = field[6];
+    return;
+}
+
+/* Rebuild the database from action definitions, either remind
+ * commands as written by export or tab separated fields, loading
+ * them in a single pass. */
+void import(PARAMS* params)
+{
+    FILE* in;
+    char* line = NULL;
+    size_t linesize = 0;
+    ACTREC* acts = NULL;
+    int nacts = 0, size = 0, ucol[URGCOL], tsv = -1;
+
+    if (strcmp(params->import,"-") == 0)
+        in = stdin;
+    else if ((in = fopen(params->import,"r")) == NULL)
+        error(ABORT,"unable to open import file: %s",params->import);
+    memcpy(ucol,params->ucol,sizeof(ucol));
+    /* confirm before the input is read; from stdin, the answer must
+     * come from the terminal */
+    if (!params->quiet && exists(params->filename)) {
+        FILE* tty = stdin;
+
+        if (in == stdin && (tty = fopen("/dev/tty","r")) == NULL)
+            error(ABORT,"unable to confirm initialisation of %s, use -q",
+                  params->filename);
+        ask(params->filename,tty);
+        if (tty != stdin) fclose(tty);
+    }
+
+    while (getline(&line,&linesize,in) != -1) {
+        char* words[MAXWORDS];
+        char* cmd;
+        int nwords;
+        PARAMS lineparams;
+
+        input_line++;
+        if (line[strspn(line," \t\n")] == '\0' || line[0] == '#') continue;
+        if (nacts == size) {
+            size = (size == 0? 1024 : size*2);
+            if ((acts = realloc(acts,size*sizeof(ACTREC))) == NULL)
+                error(ABORT,"insufficient memory for import");
+        }
+        /* the first line sets the format: tab separated records start
+         * with a number, commands with the command name */
+        if (tsv < 0) tsv = isdigit((unsigned char) line[strspn(line," ")]);
+        if (tsv) {
+            parse_tsv(line,&acts[nacts]);
+        }
+        else {
+            nwords = split_words(line,words,MAXWORDS);
+            cmd = strrchr(words[0],'/');
+            if (strcmp(cmd == NULL? words[0] : cmd+1,"remind") != 0)
+                error(ABORT,"not a remind command");
+            parse_cmd_args(nwords,words,&lineparams,&acts[nacts]);
+            if (lineparams.cmd == CMD_INIT) {
+                if (lineparams.colour_set && !params->colour_set)
+                    memcpy(ucol,lineparams.ucol,sizeof(ucol));
+                continue;
+            }
+            if (lineparams.cmd != CMD_DEFINE)
+                error(ABORT,"not an action definition");
+        }
+        if (acts[nacts].repeat.type == RT_WEEK)
+            acts[nacts].time = date_make_days_match(acts[nacts].time,
+                                                    acts[nacts].repeat.day);
+        /* the message lies in a buffer the next line reuses */
+        if ((acts[nacts].msg = strdup(acts[nacts].msg)) == NULL)
+            error(ABORT,"insufficient memory for import");
+        nacts++;
+    }
+    input_line = 0;
+    free(line);
+    if (in != stdin) fclose(in);
+
+    create_file(params->filename,ucol,true);
+    for (int i=0; i<nacts; i++) set_wake(&acts[i],date_now());
+    if (act_load(acts,nacts) != 0)
+        error(ABORT,error_msg[rem_error()],(RECNO) 0);
+    for (int i=0; i<nacts; i++) free(acts[i].msg);
+    free(acts);
+    if (!params->quiet) printf("remind: %d actions imported\n",nacts);
+    return;
+}
+
+void set_next_event_time(RECNO actno)
 {
     ACTREC* action;
     time_t event_time, next_event_time;
 
     action = act_read(actno);
-    event_time = make_active_time(action, date_now());
-    next_event_time = make_active_time(action, event_time + SECSPERDAY);
+    event_time = make_active_time(action->time, action->repeat, date_now());
+    next_event_time = make_active_time(action->time, action->repeat,
+                                       event_time + SECSPERDAY);
     action->next_event = next_event_time;
+    set_wake(action,date_now());
     if (act_write(actno, action) != 0) {
-        error(ABORT,"unable to update action: %d", actno);
+        error(ABORT,"unable to update action: %lld", actno);
     }
     return;
 }
 
-bool perform_cmd(PARAMS* params, ACTREC* newact)
+/* Run a reporting command, writing the report to r */
+void report(PARAMS* params, char* filename, REPORT* r)
 {
     struct st_nlist* actno;
-    int errno;
 
-    if (params->cmd != CMD_INIT && !rem_open(params->filename))
-        error(ABORT,error_msg[rem_error()],params->filename);
-    if (params->colour_set) rem_set_hilite(params->ucol);
+    r->format = params->format;
+    stats_phase(PH_EVALUATE);
+    trace_begin("report","command",params->cmd);
+    switch (params->cmd) {
+    case CMD_AGENDA:
+        agenda(r,params->set_type,params->urgency,params->from,params->to,
+               params->hilite);
+        break;
+    case CMD_DISPLAY:
+        if (params->set_type & ACT_PERIODIC) {
+            display(r, ACT_PERIODIC, params->urgency, params->quiet,
+                    params->hilite);
+        }
+        if (params->set_type & ACT_STANDARD) {
+            display(r, ACT_STANDARD, params->urgency, params->quiet,
+                    params->hilite);
+        }
+        break;
+    case CMD_DUMP:
+        stats_phase(PH_OUTPUT);
+        expand_ranges(params->actlist);
+        for (actno = params->actlist; actno != NULL; actno = actno->next)
+            dump_action(r,actno->n);
+        break;
+    case CMD_EXPORT:
+        export(r,filename);
+        break;
+    case CMD_LIST:
+    case CMD_LIST_HEADER:
+        list_actions(r,params->cmd,params->set_type);
+        break;
+    case CMD_SEARCH:
+        search(r,params->search,params->set_type,params->urgency);
+        break;
+    default:
+        error(ABORT,"internal command error: %d",params->cmd);
+    }
+    trace_end("report",NULL,0);
+    return;
+}
+
+void run_cmd(PARAMS* params, ACTREC* newact)
+{
+    struct st_nlist* actno;
 
     if (params->version) {
         printf("remind %s\n",GIT_VERSION);
     }
 
+    stats_phase(PH_EVALUATE);
+    trace_begin("command","command",params->cmd);
     switch (params->cmd) {
+    case CMD_COMPACT:
+        compact(params->filename,params->quiet);
+        break;
     case CMD_DEFINE:
         define_action(newact,params->quiet);
         break;
     case CMD_DELETE:
-        actno = params->actlist;
-        while (actno != NULL) {
-            delete_action(actno->n, params->quiet);
-            actno = actno->next;
-        }
+        delete_actions(params->actlist,params->filter,params->set_type,
+                       params->urgency,newact->time,params->search,
+                       params->quiet);
         break;
+    case CMD_AGENDA:
     case CMD_DISPLAY:
-        if (params->set_type & ACT_PERIODIC) {
-            display(ACT_PERIODIC, params->urgency, params->quiet,
-                    params->hilite);
-        }
-        if (params->set_type & ACT_STANDARD) {
-            display(ACT_STANDARD, params->urgency, params->quiet,
-                    params->hilite);
-        }
-        break;
     case CMD_DUMP:
-        actno = params->actlist;
-        while (actno != NULL) {
-            dump_action(actno->n);
-            actno = actno->next;
-        }
-        break;
     case CMD_EXPORT:
-        export(params->filename);
+    case CMD_LIST:
+    case CMD_LIST_HEADER:
+    case CMD_SEARCH:
+        report(params,params->filename,&console);
+        break;
+    case CMD_IMPORT:
+        import(params);
         break;
     case CMD_INIT:
         create_file(params->filename, params->ucol,
                     params->quiet);
         break;
-    case CMD_LIST:
-    case CMD_LIST_HEADER:
-        list_actions(params->cmd,params->set_type);
-        break;
     case CMD_MODIFY:
+        expand_ranges(params->actlist);
         actno = params->actlist;
         while (actno != NULL) {
             modify_action(actno->n,newact);
@@ -822,13 +2059,18 @@ bool perform_cmd(PARAMS* params, ACTREC* newact)
         }
         break;
     case CMD_MOD_POINTER:
+        expand_ranges(params->actlist);
         actno = params->actlist;
         while (actno != NULL) {
             modify_action_pointer(actno->n,params->pointer);
             actno = actno->next;
         }
         break;
+    case CMD_SWEEP:
+        sweep(params->urgency,params->quiet);
+        break;
     case CMD_ZZZ:
+        expand_ranges(params->actlist);
         actno = params->actlist;
         while (actno != NULL) {
             set_next_event_time(actno->n);
@@ -838,19 +2080,414 @@ bool perform_cmd(PARAMS* params, ACTREC* newact)
     default:
         error(ABORT,"internal command error: %d",params->cmd);
     }
+    trace_end("command",NULL,0);
+    return;
+}
+
+/* Run commands from stdin, one per line, against the open database.
+ * A line takes the same options as the command line, optionally
+ * preceded by the command name.
+ * Each line's changes are committed as it completes, and made durable
+ * together when the database is closed.  A line that reports any error
+ * fails: its changes are rolled back and the rest carry on.  Returns
+ * false if any failed. */
+bool batch(PARAMS* params)
+{
+    /* static, as they must survive a longjmp from error() */
+    static PARAMS lineparams;
+    static ACTREC lineact;
+    char* line = NULL;
+    size_t linesize = 0;
+    jmp_buf env;
+    int ncmds = 0, nfailed = 0;
+
+    while (getline(&line,&linesize,stdin) != -1) {
+        char* words[MAXWORDS+1];
+        char** argv = words;
+        char* cmd;
+        int nwords;
+
+        input_line++;
+        if (line[strspn(line," \t\n")] == '\0' || line[0] == '#') continue;
+        ncmds++;
+        if (setjmp(env) != 0) {
+            abort_jmp = NULL;
+            rem_rollback();
+            nfailed++;
+            continue;
+        }
+        abort_jmp = &env;
+        cmd_failed = false;
+        free_int_list(lineparams.actlist);
+        lineparams.actlist = NULL;
+
+        words[0] = "remind";
+        nwords = split_words(line,words+1,MAXWORDS);
+        cmd = (nwords > 0? strrchr(words[1],'/') : NULL);
+        if (nwords > 0 &&
+            strcmp(cmd == NULL? words[1] : cmd+1,"remind") == 0) {
+            argv++;
+            nwords--;
+        }
+        parse_cmd_args(nwords+1,argv,&lineparams,&lineact);
+        if (lineparams.file_set && (lineparams.nfiles > 1 ||
+            strcmp(lineparams.filename,params->filename) != 0))
+            error(ABORT,"database file can't be changed in a batch");
+        switch (lineparams.cmd) {
+        case CMD_BATCH:
+        case CMD_COMPACT:
+        case CMD_IMPORT:
+        case CMD_INIT:
+            error(ABORT,"command not allowed in a batch");
+        default:
+            break;
+        }
+        if (lineparams.colour_set) rem_set_hilite(lineparams.ucol);
+        run_cmd(&lineparams,&lineact);
+        if (!cmd_failed && rem_commit() != 0)
+            error(CONTINUE,error_msg[rem_error()],(RECNO) 0);
+        abort_jmp = NULL;
+        if (cmd_failed) {
+            rem_rollback();
+            nfailed++;
+            continue;
+        }
+        if (!params->quiet) printf("remind: line %d: ok\n",input_line);
+    }
+    free_int_list(lineparams.actlist);
+    lineparams.actlist = NULL;
+    input_line = 0;
+    free(line);
+    if (!params->quiet)
+        printf("remind: %d commands, %d failed\n",ncmds,nfailed);
+    return (nfailed == 0);
+}
+
+/* Return true if the command only reads the database, so it can be
+ * opened under a shared lock */
+bool read_only(PARAMS* params)
+{
+    if (params->colour_set) return false;
+    switch (params->cmd) {
+    case CMD_AGENDA:
+    case CMD_DISPLAY:
+    case CMD_DUMP:
+    case CMD_EXPORT:
+    case CMD_LIST:
+    case CMD_LIST_HEADER:
+    case CMD_SEARCH:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* If the work is being summarised or traced, flush what is left of the
+ * output, so that it counts as output, and go on to time closing the
+ * file */
+void flush_report(void)
+{
+    if (!stats.on && trace_file == NULL) return;
+    stats_phase(PH_OUTPUT);
+    trace_begin("flush",NULL,0);
+    fflush(stdout);
+    trace_end("flush",NULL,0);
+    stats_phase(PH_CLOSE);
+    return;
+}
+
+/* database file served by the daemon */
+char* served_file = NULL;
+
+/* Run a request forwarded to the daemon.  argv holds the client's
+ * arguments, with its REMIND_TIME setting, or an empty string, in
+ * place of the command name.  The changes are made durable before the
+ * client is answered; those of a request that fails are discarded. */
+int serve_request(int argc, char* argv[])
+{
+    /* static, as they must survive a longjmp from error() */
+    static PARAMS params;
+    static ACTREC newact;
+    jmp_buf env;
+
+    if (setjmp(env) != 0) {
+        abort_jmp = NULL;
+        rem_rollback();
+        return EXIT_FAILURE;
+    }
+    abort_jmp = &env;
+    free_int_list(params.actlist);
+    params.actlist = NULL;
+
+    date_set_time("");
+    if (argv[0][0] != '\0') date_set_time(argv[0]);
+    parse_cmd_args(argc,argv,&params,&newact);
+    params.filename = served_file;
+    switch (params.cmd) {
+    case CMD_DAEMON:
+        error(ABORT,"daemon already running for %s",served_file);
+    case CMD_BATCH:
+    case CMD_IMPORT:
+    case CMD_INIT:
+        error(ABORT,"command not allowed while the daemon is running");
+    default:
+        break;
+    }
+    if (params.stats) stats_start(PH_EVALUATE);
+    if (params.colour_set) rem_set_hilite(params.ucol);
+    run_cmd(&params,&newact);
+    flush_report();
+    if (rem_checkpoint() != 0) error(ABORT,error_msg[rem_error()],(RECNO) 0);
+    if (stats.on) stats_report(stderr,served_file);
+    abort_jmp = NULL;
+    return EXIT_SUCCESS;
+}
+
+/* Serve requests for the open database file until interrupted */
+void serve(char* filename)
+{
+    served_file = filename;
+    /* each request brings the client's time */
+    unsetenv(TIME_ENV);
+    switch (dmn_serve(filename,serve_request)) {
+    case 0:
+        break;
+    case DMN_SOCKET:
+        error(ABORT,"unable to create daemon socket for %s",filename);
+    default:
+        error(ABORT,"daemon failed for %s",filename);
+    }
+    return;
+}
+
+/* Pass the command to the daemon for the database file, if there is
+ * one.  Returns the command's exit status, or -1 if there is no
+ * daemon. */
+int forward(PARAMS* params, int argc, char* argv[])
+{
+    char* time_env = getenv(TIME_ENV);
+    char* cmd_name = argv[0];
+    int status;
+
+    argv[0] = (time_env == NULL? "" : time_env);
+    status = dmn_forward(params->filename,argc,argv);
+    argv[0] = cmd_name;
+    return status;
+}
+
+/* Open database file filename for the command.  display writes only
+ * when actions time out or snoozes end, so it starts as a reader and
+ * reopens as a writer if need be. */
+void open_file(PARAMS* params, char* filename, REPORT* r)
+{
+    int mode = (read_only(params)? OPEN_READ : OPEN_WRITE);
+
+    if (!rem_open(filename,mode))
+        error(ABORT,error_msg[rem_error()],filename);
+    if (params->cmd == CMD_DISPLAY && mode == OPEN_READ &&
+        (((params->set_type & ACT_PERIODIC) &&
+          display_changes(r,ACT_PERIODIC,params->urgency)) ||
+         ((params->set_type & ACT_STANDARD) &&
+          display_changes(r,ACT_STANDARD,params->urgency)))) {
+        if (rem_cls() == EOF || !rem_open(filename,OPEN_WRITE))
+            error(ABORT,error_msg[rem_error()],filename);
+    }
+    return;
+}
+
+/* One of several database files reported on at once */
+struct st_job {
+    PARAMS* params;
+    char* filename;
+    REMFILE* file;
+    REPORT report;
+    pthread_t thread;
+    bool ok;
+};
+
+/* Report on a database file in a thread of its own, into memory.  An
+ * error ends this file's report only. */
+void* report_worker(void* arg)
+{
+    struct st_job* job = arg;
+    REPORT* r = &job->report;
+    jmp_buf env;
+
+    if (setjmp(env) != 0) {
+        abort_jmp = NULL;
+        if (job->file != NULL) {
+            rem_rollback();
+            rem_cls();
+        }
+    }
+    else {
+        abort_jmp = &env;
+        if ((r->out = open_memstream(&r->text,&r->len)) == NULL ||
+            (job->file = rem_new()) == NULL)
+            error(ABORT,"insufficient memory for report on %s",
+                  job->filename);
+        rem_use(job->file);
+        /* the daemon holds the file, and can't key its report for
+         * merging */
+        if (dmn_running(job->filename))
+            error(ABORT,"%s is served by a daemon, report on it alone",
+                  job->filename);
+        if (job->params->stats) stats_start(PH_OPEN);
+        open_file(job->params,job->filename,r);
+        report(job->params,job->filename,r);
+        stats_phase(PH_CLOSE);
+        if (rem_cls() == EOF)
+            error(ABORT,"close failed: %s",job->filename);
+        if (stats.on) stats_report(stderr,job->filename);
+        abort_jmp = NULL;
+        job->ok = true;
+    }
+    if (r->out != NULL) fclose(r->out);
+    if (job->file != NULL) rem_free(job->file);
+    return NULL;
+}
+
+/* A line of one of the reports being merged */
+struct st_merge {
+    struct st_line* line;
+    int job;  /* file reported on */
+    int k;    /* line's place in its report */
+};
+
+int merge_cmp(const void* a, const void* b)
+{
+    const struct st_merge* x = a;
+    const struct st_merge* y = b;
+
+    if (x->line->part != y->line->part)
+        return (x->line->part < y->line->part? -1 : 1);
+    if (x->line->day != y->line->day)
+        return (x->line->day < y->line->day? -1 : 1);
+    if (x->line->urgency != y->line->urgency)
+        return (x->line->urgency < y->line->urgency? -1 : 1);
+    if (x->job != y->job) return (x->job < y->job? -1 : 1);
+    return (x->k < y->k? -1 : (x->k > y->k));
+}
+
+/* Run display, list or export on several database files at once, each
+ * read in a thread of its own, and merge the reports into one ordered
+ * by part, date and urgency, each line tagged with its file.  Export
+ * names the file in each line already, so its lines are not tagged.
+ * Returns false if any file's report failed, leaving it out. */
+bool report_files(PARAMS* params)
+{
+    struct st_job* jobs;
+    struct st_merge* merge;
+    int n = params->nfiles, nlines = 0;
+    bool ok = true;
+
+    switch (params->cmd) {
+    case CMD_DISPLAY:
+    case CMD_EXPORT:
+    case CMD_LIST:
+    case CMD_LIST_HEADER:
+        if (!params->colour_set) break;
+        /* fall through */
+    default:
+        error(ABORT,"only one database file may be given for this command");
+    }
+    if (params->version) printf("remind %s\n",GIT_VERSION);
+    if ((jobs = calloc(n,sizeof(*jobs))) == NULL)
+        error(ABORT,"insufficient memory for report");
+    for (int j=0; j<n; j++) {
+        jobs[j].params = params;
+        jobs[j].filename = params->files[j];
+        jobs[j].report.keyed = true;
+        if (pthread_create(&jobs[j].thread,NULL,report_worker,&jobs[j]) != 0)
+            error(ABORT,"unable to start report on %s",jobs[j].filename);
+    }
+    for (int j=0; j<n; j++) {
+        pthread_join(jobs[j].thread,NULL);
+        if (jobs[j].ok) nlines += jobs[j].report.nlines;
+        else ok = false;
+    }
+
+    if ((merge = malloc((nlines+1)*sizeof(*merge))) == NULL)
+        error(ABORT,"insufficient memory for report");
+    nlines = 0;
+    for (int j=0; j<n; j++) {
+        for (int k=0; jobs[j].ok && k<jobs[j].report.nlines; k++) {
+            merge[nlines].line = &jobs[j].report.lines[k];
+            merge[nlines].job = j;
+            merge[nlines++].k = k;
+        }
+    }
+    qsort(merge,nlines,sizeof(*merge),merge_cmp);
+    for (int m=0; m<nlines; m++) {
+        REPORT* r = &jobs[merge[m].job].report;
+        long start = merge[m].line->off;
+        long end = (merge[m].k+1 < r->nlines? r->lines[merge[m].k+1].off :
+                    (long) r->len);
+
+        if (params->cmd == CMD_EXPORT) {
+            /* the lines name their file */
+        }
+        else if (r->format == OUT_JSON && r->text[start] == '{') {
+            fputs("{\"file\":",stdout);
+            out_quote(stdout,OUT_JSON,jobs[merge[m].job].filename);
+            putc(',',stdout);
+            start++;
+        }
+        else if (r->format == OUT_TSV) {
+            out_quote(stdout,OUT_TSV,jobs[merge[m].job].filename);
+            putc('\t',stdout);
+        }
+        else {
+            printf("%s: ",jobs[merge[m].job].filename);
+        }
+        fwrite(r->text+start,1,end-start,stdout);
+    }
+
+    free(merge);
+    for (int j=0; j<n; j++) report_free(&jobs[j].report);
+    free(jobs);
+    return ok;
+}
+
+bool perform_cmd(PARAMS* params, ACTREC* newact)
+{
+    bool ok = true;
+    int errno;
+
+    if (params->stats) stats_start(PH_OPEN);
+    if (params->cmd != CMD_INIT && params->cmd != CMD_IMPORT)
+        open_file(params,params->filename,&console);
+    if (params->colour_set) rem_set_hilite(params->ucol);
+
+    if (params->cmd == CMD_BATCH)
+        ok = batch(params);
+    else if (params->cmd == CMD_DAEMON)
+        serve(params->filename);
+    else
+        run_cmd(params,newact);
+    flush_report();
     if (rem_cls() == EOF) error(ABORT,"close failed: %s",params->filename);
-    if ((errno = rem_error()) != 0) error(ABORT,error_msg[errno],0);
-    return true;
+    if ((errno = rem_error()) != 0) error(ABORT,error_msg[errno],(RECNO) 0);
+    if (stats.on) stats_report(stderr,params->filename);
+    return ok;
 }
 
+
 int main(int argc,char *argv[])
 {
     ACTREC newact;
     PARAMS params;
-
-    if (parse_cmd_args(argc, argv, &params, &newact) &&
-        perform_cmd(&params, &newact)) {
-        return EXIT_SUCCESS;
+    int status;
+
+    console.out = stdout;
+    out_buffer(stdout);
+    if (!trace_open(getenv(TRACE_ENV)))
+        error(CONTINUE,"unable to open trace file: %s",getenv(TRACE_ENV));
+    if (parse_cmd_args(argc, argv, &params, &newact)) {
+        if (params.nfiles > 1)
+            return (report_files(&params)? EXIT_SUCCESS : EXIT_FAILURE);
+        if ((status = forward(&params, argc, argv)) >= 0) return status;
+        if (perform_cmd(&params, &newact)) return EXIT_SUCCESS;
     }
     return EXIT_FAILURE;
 }
@@ -0,0 +1,86 @@
+/* Counts and timings of the work a command does, summarised by -S.
+ * When -S is not given, only the counters are kept: the clock is not
+ * read. */
+
+#include <stdio.h>
+#include <time.h>
+
+#include "stats.h"
+
+_Thread_local STATS stats;
+
+/* Start counting, for the calling thread's handle, and timing phase */
+void stats_start(enum stats_phase phase)
+{
+    stats = (STATS) {.on = true, .phase = PH_NONE,
+                     .base = *rem_stats()};
+    stats_phase(phase);
+    return;
+}
+
+/* Add the time since the last mark to the phase being timed, and go on
+ * to phase */
+void stats_phase(enum stats_phase phase)
+{
+    struct timespec now;
+
+    if (!stats.on) return;
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    if (stats.phase != PH_NONE) {
+        stats.secs[stats.phase] += (double) (now.tv_sec-stats.mark.tv_sec) +
+            (double) (now.tv_nsec-stats.mark.tv_nsec)/1e9;
+    }
+    stats.mark = now;
+    stats.phase = phase;
+    return;
+}
+
+/* Write the summary for database file filename to f, in one piece, as
+ * threads may be writing theirs too */
+void stats_report(FILE* f, char* filename)
+{
+    REMSTATS* rs = rem_stats();
+    REMSTATS d = *rs;
+    REMSTATS* b = &stats.base;
+
+    stats_phase(PH_NONE);
+    d.reads -= b->reads;
+    d.read_bytes -= b->read_bytes;
+    d.writes -= b->writes;
+    d.write_bytes -= b->write_bytes;
+    d.changed -= b->changed;
+    d.pwrites -= b->pwrites;
+    d.pwrite_bytes -= b->pwrite_bytes;
+    d.snapped -= b->snapped;
+    d.iterations -= b->iterations;
+    d.hops -= b->hops;
+    d.maps -= b->maps;
+    d.commits -= b->commits;
+    d.logged -= b->logged;
+    d.syncs -= b->syncs;
+    fprintf(f,"remind: statistics for %s\n"
+            "  seconds: open %.6f, evaluate %.6f, output %.6f, "
+            "close %.6f\n"
+            "  records read: %lld (%lld bytes)\n"
+            "  records written: %lld (%lld bytes)\n"
+            "  records changed: %lld\n"
+            "  actions in snapshots: %lld\n"
+            "  list steps: %lld, %.2f heads each\n"
+            "  next events worked out: %lld\n"
+            "  timed out actions deleted: %lld\n"
+            "  file mappings: %lld\n"
+            "  file writes: %lld (%lld bytes)\n"
+            "  commits: %lld (%lld bytes journalled)\n"
+            "  syncs: %lld\n",
+            filename,
+            stats.secs[PH_OPEN],stats.secs[PH_EVALUATE],
+            stats.secs[PH_OUTPUT],stats.secs[PH_CLOSE],
+            d.reads,d.read_bytes,d.writes,d.write_bytes,d.changed,
+            d.snapped,
+            d.iterations,(d.iterations == 0? 0.0 :
+                          (double) d.hops/(double) d.iterations),
+            stats.evaluations,stats.deletions,d.maps,
+            d.pwrites,d.pwrite_bytes,d.commits,d.logged,d.syncs);
+    stats.on = false;
+    return;
+}
@@ -0,0 +1,39 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "datafile.h"
+
+enum stats_phase {
+    PH_NONE = -1,  /* not timing */
+    PH_OPEN,
+    PH_EVALUATE,
+    PH_OUTPUT,
+    PH_CLOSE,
+    NPHASES
+};
+
+/* What a command did, for the -S summary.  Each thread keeps its own;
+ * the datafile's counts come from its handle. */
+struct st_stats {
+    bool on;
+    enum stats_phase phase;   /* phase being timed */
+    struct timespec mark;     /* when it started */
+    double secs[NPHASES];
+    long long evaluations;    /* next events worked out */
+    long long deletions;      /* timed out actions deleted by display */
+    REMSTATS base;            /* handle's counts when started */
+};
+
+typedef struct st_stats STATS;
+
+extern _Thread_local STATS stats;
+
+extern void stats_start(enum stats_phase);
+extern void stats_phase(enum stats_phase);
+extern void stats_report(FILE*, char*);
+
+#endif
@@ -0,0 +1,142 @@
+/* Time the datafile primitives against a database file, as made by
+ * gendb.sh.  Each line of output holds the number of records in the
+ * file, the primitive, the number of operations timed and the seconds
+ * they took, separated by tabs.  The file is changed: actions are
+ * defined, rewritten and deleted again, so give it a copy. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../datafile.h"
+
+static RECNO records;
+static struct timespec started;
+
+static void start(void)
+{
+    clock_gettime(CLOCK_MONOTONIC,&started);
+}
+
+static void stop(char* name, int ops)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    printf("%lld\t%s\t%d\t%.6f\n",records,name,ops,
+           (double) (now.tv_sec-started.tv_sec) +
+           (double) (now.tv_nsec-started.tv_nsec)/1e9);
+}
+
+static void fail(char* what)
+{
+    fprintf(stderr,"bench: %s failed: error %d\n",what,rem_error());
+    exit(EXIT_FAILURE);
+}
+
+int main(int argc, char* argv[])
+{
+    char* filename;
+    int nops = 1000, n;
+    RECNO actno, *defined;
+    time_t now = time(NULL);
+    SNAPSHOT snap;
+    ACTREC act;
+    int opt;
+
+    while ((opt = getopt(argc,argv,"n:")) != -1) {
+        if (opt != 'n' || (nops = atoi(optarg)) <= 0) {
+            fprintf(stderr,"usage: bench [-n ops] file\n");
+            return EXIT_FAILURE;
+        }
+    }
+    if (optind != argc-1) {
+        fprintf(stderr,"usage: bench [-n ops] file\n");
+        return EXIT_FAILURE;
+    }
+    filename = argv[optind];
+    if ((defined = malloc(nops*sizeof(RECNO))) == NULL) fail("malloc");
+    memset(&snap,0,sizeof(snap));
+    rem_set_sync(SYNC_NONE);
+
+    start();
+    if (!rem_open(filename,OPEN_READ)) fail("rem_open");
+    records = rem_header()->numrec-1;
+    stop("rem_open",1);
+
+    start();
+    if (act_snapshot(&snap,ACT_PERIODIC,0,NURGENCY-1) != 0)
+        fail("act_snapshot");
+    stop("act_snapshot periodic",snap.n);
+    start();
+    if (act_snapshot(&snap,ACT_STANDARD,0,NURGENCY-1) != 0)
+        fail("act_snapshot");
+    stop("act_snapshot standard",snap.n);
+    start();
+    if (act_due(&snap,0,NURGENCY-1,now) != 0) fail("act_due");
+    stop("act_due",snap.n);
+    start();
+    if (act_expired(&snap,0,NURGENCY-1,now) != 0) fail("act_expired");
+    stop("act_expired",snap.n);
+
+    n = 0;
+    start();
+    act_iter_init(ACT_PERIODIC);
+    while ((actno = act_iter_next()) != 0) {
+        if (act_read(actno) == NULL) fail("act_read");
+        n++;
+    }
+    stop("act_iter_next+act_read",n);
+
+    srand(1);
+    start();
+    for (int i=0; i<nops && records > 0; i++) {
+        if (act_read(rand()%records+1) == NULL) fail("act_read");
+    }
+    stop("act_read random",(records > 0? nops : 0));
+    if (rem_cls() != 0) fail("rem_cls");
+
+    if (!rem_open(filename,OPEN_WRITE)) fail("rem_open");
+    memset(&act,0,sizeof(act));
+    act.msg = "Benchmark action";
+    act.warning = 7;
+    start();
+    for (int i=0; i<nops; i++) {
+        act.type = (i%2 == 0? ACT_PERIODIC : ACT_STANDARD);
+        act.urgency = i%NURGENCY;
+        act.time = now + (time_t) (rand()%365)*86400;
+        act.timeout = (i%4 == 1? 3 : 0);
+        act.wake = (act.type == ACT_STANDARD? act.time : 0);
+        if ((defined[i] = act_define(&act)) < 0) fail("act_define");
+    }
+    stop("act_define",nops);
+    start();
+    if (rem_commit() != 0) fail("rem_commit");
+    stop("rem_commit",1);
+
+    start();
+    for (int i=0; i<nops; i++) {
+        ACTREC* a;
+
+        if ((a = act_read(defined[i])) == NULL) fail("act_read");
+        a->wake += 86400;
+        if (act_write(defined[i],a) != 0) fail("act_write");
+    }
+    stop("act_write",nops);
+
+    start();
+    for (int i=0; i<nops; i++) {
+        if (act_delete(defined[i],true) != 0) fail("act_delete");
+    }
+    stop("act_delete",nops);
+
+    start();
+    if (rem_cls() != 0) fail("rem_cls");
+    stop("rem_cls",1);
+
+    act_snapshot_free(&snap);
+    free(defined);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,69 @@
+#!/bin/sh
+# Benchmark remind against synthetic databases of growing size.  For
+# each size in $BENCH_SIZES a database is generated by gendb.sh, each
+# command is timed, and test/bench times the datafile primitives.
+# Results are tab separated: records, what was timed, the number of
+# operations and the seconds taken, after a comment line naming the
+# build, so the output of two builds can be compared line by line.
+
+REMIND=${REMIND:-./remind}
+BENCH_SIZES=${BENCH_SIZES:-"1000 100000 1000000"}
+dir=${TMPDIR:-/tmp}/remind-bench$$
+db=$dir/bench.db
+
+export REMIND_TIME=01/06/2026
+export REMIND_SYNC=none
+unset REMIND_FILE
+
+now()
+{
+    date +%s.%N
+}
+
+# print the seconds from $1 to $2
+elapsed()
+{
+    awk -v from=$1 -v to=$2 'BEGIN { printf "%.6f", to-from }'
+}
+
+# time a remind command over the database
+run()
+{
+    name=$1
+    shift
+    t0=$(now)
+    $REMIND -f $db "$@" >/dev/null 2>&1
+    t1=$(now)
+    printf "%d\t%s\t1\t%s\n" $size "$name" $(elapsed $t0 $t1)
+}
+
+trap 'rm -rf $dir' EXIT
+mkdir -p $dir || exit 1
+echo "# $($REMIND -v)"
+printf "# records\tname\tops\tseconds\n"
+for size in $BENCH_SIZES; do
+    rm -f $db $db.wal $db.idx
+    t0=$(now)
+    REMIND=$REMIND sh test/gendb.sh -p $((size*7/10)) -s $((size-size*7/10)) \
+        -F 10 $db || exit 1
+    t1=$(now)
+    printf "%d\tgenerate\t1\t%s\n" $size $(elapsed $t0 $t1)
+
+    run display
+    run "display -u 1" -u 1
+    run "list -l" -l
+    run "list -o tsv -l" -o tsv -l
+    run "header -L" -L
+    run "export -e" -e
+    run "agenda -A" -A 01/06/2026,01/07/2026
+    run "search -g, indexing" -g "action 12345"
+    run "search -g" -g "action 12345"
+    run define -u 2 -r m -d 15/06/2026 Benchmark periodic
+    run "define standard" -t 3 Benchmark standard
+    run "delete -D" -D 1
+    run "delete -D range" -D 2-$((size/10))
+    run "sweep -E" -E
+    cp $db $dir/prim.db
+    test/bench -n 1000 $dir/prim.db || exit 1
+    run "compact -C" -C
+done
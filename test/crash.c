@@ -0,0 +1,37 @@
+/* Define a standard action in a database file and commit it to the
+ * journal, then exit as if the process had crashed before the change
+ * reached the file.  The next open of the file must recover it. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../datafile.h"
+
+int main(int argc, char* argv[])
+{
+    ACTREC act;
+
+    if (argc != 3) {
+        fprintf(stderr,"usage: crash file message\n");
+        return EXIT_FAILURE;
+    }
+    rem_set_sync(SYNC_BATCH);
+    if (!rem_open(argv[1],OPEN_WRITE)) {
+        fprintf(stderr,"crash: rem_open failed: error %d\n",rem_error());
+        return EXIT_FAILURE;
+    }
+    memset(&act,0,sizeof(act));
+    act.type = ACT_STANDARD;
+    act.urgency = 4;
+    act.warning = 7;
+    act.time = 1893456000;  /* 01/01/2030 */
+    act.msg = argv[2];
+    if (act_define(&act) < 0 || rem_commit() != 0) {
+        fprintf(stderr,"crash: commit failed: error %d\n",rem_error());
+        return EXIT_FAILURE;
+    }
+    _exit(EXIT_SUCCESS);
+}
@@ -0,0 +1,190 @@
+/* Check date_local and date_mktime against localtime and mktime in
+ * the time zone of TZ, at random times and around each of the zone's
+ * clock changes from 1970 to 2040.  Local times in gaps and overlaps,
+ * DST flags that don't match the date, and fields out of range are
+ * all asked for.  Mismatches are written with the times concerned,
+ * and the exit status is non-zero if there were any. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../date.h"
+
+enum {
+    SECSPERDAY = 86400,
+    MAXCHANGES = 400,  /* clock changes looked at */
+    NRANDOM = 20000,   /* random times checked */
+    MAXREPORT = 20     /* mismatches written */
+};
+
+static unsigned long long seed = 88172645463325252ULL;
+static int nfailed = 0;
+
+/* xorshift, so each run checks the same times */
+static unsigned long long rnd(void)
+{
+    seed ^= seed << 13;
+    seed ^= seed >> 7;
+    seed ^= seed << 17;
+    return seed;
+}
+
+static bool tm_same(struct tm* a, struct tm* b)
+{
+    return (a->tm_year == b->tm_year && a->tm_mon == b->tm_mon &&
+            a->tm_mday == b->tm_mday && a->tm_hour == b->tm_hour &&
+            a->tm_min == b->tm_min && a->tm_sec == b->tm_sec &&
+            a->tm_wday == b->tm_wday && a->tm_yday == b->tm_yday &&
+            a->tm_isdst == b->tm_isdst && a->tm_gmtoff == b->tm_gmtoff);
+}
+
+static void tm_print(char* what, struct tm* tm)
+{
+    printf("  %s: %04d-%02d-%02d %02d:%02d:%02d wday %d yday %d "
+           "dst %d off %ld\n",what,tm->tm_year+1900,tm->tm_mon+1,
+           tm->tm_mday,tm->tm_hour,tm->tm_min,tm->tm_sec,tm->tm_wday,
+           tm->tm_yday,tm->tm_isdst,(long) tm->tm_gmtoff);
+}
+
+static void check_local(time_t t)
+{
+    struct tm want, got;
+
+    localtime_r(&t,&want);
+    date_local(t,&got);
+    if (!tm_same(&want,&got) && nfailed++ < MAXREPORT) {
+        printf("date_local(%lld) differs\n",(long long) t);
+        tm_print("localtime",&want);
+        tm_print("date_local",&got);
+    }
+    return;
+}
+
+/* Start glibc's mktime, which starts from the offset its previous call
+ * found, from the offset in force at t, as date_mktime starts, by
+ * asking it for a time near t with that offset and a local time that
+ * occurs only once */
+static void prime_mktime(time_t t)
+{
+    struct tm u;
+    long off;
+
+    localtime_r(&t,&u);
+    off = u.tm_gmtoff;
+    for (int k=0; k<=48; k++) {
+        time_t v = t + (k%2 == 0? k/2 : -(k+1)/2) * 3600;
+
+        localtime_r(&v,&u);
+        if (u.tm_gmtoff == off && mktime(&u) == v) return;
+    }
+    return;
+}
+
+/* Ask both for the time of tm, as mktime and as date_mktime, with
+ * mktime started from the offset date_mktime starts from: that at the
+ * local time asked for, read as UTC */
+static void check_mktime(struct tm* tm)
+{
+    struct tm want = *tm, got = *tm, u = *tm;
+    time_t a, b;
+
+    if (u.tm_sec < 0) u.tm_sec = 0;
+    if (u.tm_sec > 59) u.tm_sec = 59;
+    prime_mktime(timegm(&u));
+    a = mktime(&want);
+    b = date_mktime(&got);
+
+    if ((a != b || (a != (time_t) -1 && !tm_same(&want,&got))) &&
+        nfailed++ < MAXREPORT) {
+        printf("date_mktime differs: mktime %lld, date_mktime %lld\n",
+               (long long) a,(long long) b);
+        tm_print("asked",tm);
+        tm_print("mktime",&want);
+        tm_print("date_mktime",&got);
+    }
+    return;
+}
+
+/* Check local times near t: the local time itself, moved by up to a few
+ * hours, with each DST flag, and some with fields out of range */
+static void check_near(time_t t)
+{
+    struct tm tm;
+
+    for (int i=0; i<8; i++) {
+        time_t u = t + (time_t) (rnd()%(6*3600)) - 3*3600;
+
+        check_local(u);
+        localtime_r(&u,&tm);
+        tm.tm_min = (int) (rnd()%60);
+        for (int dst=-1; dst<=1; dst++) {
+            tm.tm_isdst = dst;
+            check_mktime(&tm);
+        }
+        switch (rnd()%4) {
+        case 0:
+            tm.tm_mday += 40;
+            break;
+        case 1:
+            tm.tm_hour -= 30;
+            break;
+        case 2:
+            tm.tm_mon += 13;
+            break;
+        default:
+            tm.tm_sec = 60;
+            break;
+        }
+        tm.tm_isdst = (int) (rnd()%3) - 1;
+        check_mktime(&tm);
+    }
+    check_local(t-1);
+    check_local(t);
+    return;
+}
+
+int main(void)
+{
+    time_t from = 0, to = (time_t) 70*365*SECSPERDAY;
+    time_t t, lo, hi;
+    struct tm a, b;
+    int nchanges = 0;
+
+    /* clock changes: step by days, then bisect to the second */
+    localtime_r(&from,&a);
+    for (t = from; t < to && nchanges < MAXCHANGES; t += SECSPERDAY) {
+        time_t u = t+SECSPERDAY;
+
+        localtime_r(&u,&b);
+        if (b.tm_gmtoff == a.tm_gmtoff && b.tm_isdst == a.tm_isdst)
+            continue;
+        for (lo = t, hi = u; hi-lo > 1; ) {
+            time_t mid = lo + (hi-lo)/2;
+            struct tm m;
+
+            localtime_r(&mid,&m);
+            if (m.tm_gmtoff == a.tm_gmtoff && m.tm_isdst == a.tm_isdst)
+                lo = mid;
+            else
+                hi = mid;
+        }
+        check_near(hi);
+        nchanges++;
+        a = b;
+    }
+    for (int i=0; i<NRANDOM; i++) {
+        t = from + (time_t) (rnd()%(unsigned long long) (to-from));
+        if (i%64 == 0)
+            check_near(t);
+        else
+            check_local(t);
+    }
+    if (nfailed > 0) {
+        printf("datecheck: %s: %d mismatches\n",getenv("TZ"),nfailed);
+        return EXIT_FAILURE;
+    }
+    printf("datecheck: %s: ok\n",getenv("TZ"));
+    return EXIT_SUCCESS;
+}
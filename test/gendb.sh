@@ -0,0 +1,81 @@
+#!/bin/sh
+# Generate a synthetic remind database for benchmarking.
+#
+# usage: sh test/gendb.sh [-p periodic] [-s standard] [-r y:m:w:n]
+#                         [-F free%] [-S seed] file
+#
+# -p and -s give the numbers of periodic and standard actions, -r the
+# relative weights of yearly, monthly, weekly and nth weekday repeats
+# among the periodic ones, and -F the percentage of the actions to
+# delete again, leaving their records on the free list.  The actions
+# are imported as tab separated records with the remind given by
+# $REMIND, ./remind by default.
+
+REMIND=${REMIND:-./remind}
+periodic=1000
+standard=1000
+mix=60:20:15:5
+free=0
+seed=1
+
+while getopts p:s:r:F:S: opt; do
+    case $opt in
+    p) periodic=$OPTARG ;;
+    s) standard=$OPTARG ;;
+    r) mix=$OPTARG ;;
+    F) free=$OPTARG ;;
+    S) seed=$OPTARG ;;
+    *) echo "usage: gendb.sh [-p n] [-s n] [-r y:m:w:n] [-F free%]" \
+            "[-S seed] file" >&2
+       exit 1 ;;
+    esac
+done
+shift $((OPTIND-1))
+if [ $# -ne 1 ]; then
+    echo "gendb.sh: no database file given" >&2
+    exit 1
+fi
+file=$1
+
+awk -v np="$periodic" -v ns="$standard" -v mix="$mix" -v seed="$seed" '
+BEGIN {
+    srand(seed)
+    split(mix,w,":")
+    total = w[1]+w[2]+w[3]+w[4]
+    for (i=0; i<np; i++) {
+        r = rand()*total
+        day = int(rand()*28)+1
+        month = int(rand()*12)+1
+        if (r < w[1]) repeat = "y"
+        else if (r < w[1]+w[2]) repeat = "m"
+        else if (r < w[1]+w[2]+w[3]) repeat = "w" int(rand()*7)
+        else repeat = "n" int(rand()*7) "," int(rand()*4)+1
+        printf "1\t%d\t%d\t%02d/%02d/2026\t0\t%s\tPeriodic action %d\n",
+               int(rand()*5), int(rand()*15), day, month, repeat, i
+    }
+    for (i=0; i<ns; i++) {
+        day = int(rand()*28)+1
+        month = int(rand()*12)+1
+        timeout = (rand() < 0.5? int(rand()*30)+1 : 0)
+        printf "2\t%d\t7\t%02d/%02d/2026\t%d\ty\tStandard action %d\n",
+               int(rand()*5), day, month, timeout, i
+    }
+}' | $REMIND -q -f "$file" -I - || exit 1
+
+# delete a random selection, a hundred actions to a batch line
+[ "$free" -gt 0 ] || exit 0
+awk -v n=$((periodic+standard)) -v free="$free" -v seed="$seed" '
+BEGIN {
+    srand(seed+1)
+    k = 0
+    for (i=1; i<=n; i++) {
+        if (rand()*100 >= free) continue
+        line = line (k == 0? "-qD " : ",") i
+        if (++k == 100) {
+            print line
+            line = ""
+            k = 0
+        }
+    }
+    if (k > 0) print line
+}' | $REMIND -f "$file" -b >/dev/null 2>&1
@@ -40,6 +40,8 @@ echo Display standard actions
 echo Advance time to trigger timeout
 REMIND_TIME=02/01/2030
 ./remind -s
+./remind -u 0 -t 1 Background action for timeout delete
+REMIND_TIME=04/01/2030 ./remind
 echo List actions with header
 ./remind -L
 echo Re-initialise
@@ -142,3 +144,219 @@ REMIND_TIME=01/01/2030 ./remind -m 1 -z
 REMIND_TIME=01/01/2030 ./remind
 REMIND_TIME=06/02/2030 ./remind
 REMIND_TIME=07/02/2030 ./remind
+echo Compact
+export REMIND_TIME=01/01/2030
+./remind -iq
+./remind -r m 5/1 Monthly on the 5th
+./remind Standard action one
+./remind 3/1 Yearly, 3rd January
+./remind -u 2 Standard action two
+./remind -D 2
+./remind -r w3 -w 3 Every Wednesday
+./remind -D 3,1
+./remind -L
+./remind -C
+./remind -L
+./remind
+echo Import
+./remind -r n2,1 -u 1 Second Monday
+./remind -s 03/01 Standard action three
+./remind -e >/tmp/remind$$.sh
+./remind -iq
+yes | ./remind -I /tmp/remind$$.sh
+rm /tmp/remind$$.sh
+./remind -L
+printf '1\t2\t5\t04/01/2030\t0\tm0,1\tMonthly from TSV\n2\t0\t7\t01/01/2030\t0\ty0,0\tBackground from TSV\n' | ./remind -qI -
+./remind -L
+./remind
+printf 'remind -uwtqsd 4 7 0 04/01/2030 "Standard\twith tab"\n' |
+    ./remind -f ./third.db -qI -
+./remind -f ./third.db -s -l
+rm -f ./third.db
+echo Batch
+./remind -b <<'END'
+-u 1 -d 03/01 Batch action one
+# comment
+remind -r w4 Every Thursday
+-D 99
+-u 9 Bad urgency
+-i
+-m 1 -u 2
+-a
+END
+./remind -L
+echo Daemon
+./remind -R &
+pid=$!
+n=0
+while [ ! -S ./remind.db.sock ] && [ $n -lt 50 ]; do sleep 0.1; n=$((n+1)); done
+./remind -u 2 -d 04/01 Defined through the daemon
+./remind -R
+./remind -i
+./remind -L
+./remind
+./remind -f ./remind.db -f ./nonesuch.db -l 2>&1 | sort
+kill $pid
+wait $pid
+./remind -l
+echo Long message
+./remind -u 3 This message runs past the eighty characters that earlier versions of remind allowed for one
+./remind -m 5 -u 1 "& - and is modified"
+./remind -e | grep eighty
+./remind -l
+echo Upgrade from 1.4
+cp test/remind-1.4.db ./remind.db
+./remind -L
+./remind
+./remind -l
+echo Wake times
+./remind -iq
+./remind -w 3 -r y 10/01 Tenth of January
+./remind -w 1 -r w2 Every Tuesday
+./remind -w 2 -r n5,5 Fifth Friday in the month
+REMIND_TIME=05/01/2030 ./remind
+REMIND_TIME=07/01/2030 ./remind
+REMIND_TIME=12/01/2030 ./remind
+REMIND_TIME=06/01/2030 ./remind
+REMIND_TIME=27/02/2030 ./remind
+REMIND_TIME=24/03/2030 ./remind
+REMIND_TIME=26/04/2030 ./remind
+./remind -l
+echo Agenda
+./remind -iq
+./remind -r w1 -d 05/01/2030 Every Monday
+./remind -r w3,2 -d 09/01/2030 Every other Wednesday
+./remind -r m -d 31/01/2030 Last of the month
+./remind -r n5,5 -d 01/01/2030 Last Friday
+./remind -u 2 -d 29/02/2028 Leap day
+./remind -s -d 20/01/2030 Dated standard action
+./remind -u 0 -d 15/01/2030 Background
+./remind -t 30 -r w5 -d 04/01/2030 Fridays for a month
+./remind -r w2 -d 08/01/2030 Snoozed Tuesday
+REMIND_TIME=07/01/2030 ./remind -m 9 -z
+REMIND_TIME=01/01/2030 ./remind -A 28/02/2030
+./remind -A 01/02/2030,01/03/2030 -p
+./remind -A 01/03/2030,01/02/2030
+./remind -A 01/01/2030,31/01/2030 -u 0
+echo Several files
+./remind -iq -f ./other.db
+./remind -f ./other.db -u 1 -r y 03/01 Other periodic
+./remind -f ./other.db -u 2 Other standard
+./remind -f ./remind.db -f ./other.db
+REMIND_FILE=./other.db:./remind.db ./remind -l
+./remind -f ./other.db -f ./remind.db -e | head -3
+./remind -f ./remind.db -f ./nonesuch.db -s
+./remind -f ./remind.db -f ./other.db -D 1
+rm -f ./other.db
+echo Sweep timed out actions
+./remind -iq
+./remind -s -t 3 -d 01/01/2030 Standard for three days
+./remind -s -u 0 -t 2 -d 01/01/2030 Background for two days
+./remind -s -t 10 -d 01/01/2030 Standard for ten days
+./remind -t 5 -r w3 -d 02/01/2030 Wednesdays for five days
+./remind -s -d 01/01/2030 Standard without timeout
+REMIND_TIME=02/01/2030 ./remind -E
+REMIND_TIME=08/01/2030 ./remind -s
+REMIND_TIME=08/01/2030 ./remind -E -u 1
+REMIND_TIME=08/01/2030 ./remind -E
+./remind -L
+./remind -m 5 -t 12
+REMIND_TIME=20/01/2030 ./remind -Eq
+./remind -L
+echo Output formats
+./remind -iq
+./remind -u 2 -r y -d 03/01/2030 'Periodic "quoted" event'
+./remind -s -t 3 -d 01/01/2030 'Standard	with tab\'
+REMIND_TIME=01/01/2030 ./remind -o tsv
+REMIND_TIME=01/01/2030 ./remind -o json
+./remind -o json -L
+./remind -o tsv -L
+./remind -o json -X 2 | sed "s/\"next_event\":\"[^\"]*\",//"
+REMIND_TIME=01/01/2030 ./remind -o json -A 01/01/2030,31/12/2031
+./remind -o xml
+./remind -o tsv -l >/tmp/remind$$.tsv
+yes | ./remind -f ./other.db -I /tmp/remind$$.tsv
+rm -f /tmp/remind$$.tsv
+REMIND_TIME=01/01/2030 ./remind -f ./remind.db -f ./other.db -o json
+./remind -f ./remind.db -f ./other.db -o tsv -l
+rm -f ./other.db
+echo Statistics
+./remind -iq
+./remind -s -t 2 -d 01/01/2030 Standard for two days
+./remind -u 2 -r w3 -d 02/01/2030 Wednesdays
+./remind -r y -d 03/01/2030 Yearly
+REMIND_TIME=01/01/2030 ./remind -S 2>&1 | grep -v seconds
+REMIND_TIME=05/01/2030 ./remind -S 2>&1 | grep -v seconds
+./remind -S -l 2>&1 >/dev/null | grep -v seconds
+./remind -S -D 2 2>&1 | grep -v seconds
+echo Tracing
+REMIND_TRACE=./trace.json REMIND_TIME=01/01/2030 ./remind >/dev/null
+head -1 ./trace.json
+tail -1 ./trace.json
+grep -c '"ph":"B"' ./trace.json
+grep -c '"ph":"E"' ./trace.json
+grep -o '"name":"[a-z_ ]*"' ./trace.json | sort | uniq -c
+REMIND_TRACE=./nonesuch/trace.json ./remind -l
+rm -f ./trace.json
+echo Search
+./remind -iq
+./remind -s Buy milk
+./remind -s Pay the rent
+./remind -u 2 -r y -d 03/01/2030 "Mum's birthday, take MILKshake"
+./remind -g milk
+./remind -g MILK -o tsv
+./remind -s -g milk
+./remind -g "ay "
+./remind -g cheese
+./remind -m 2 "& and buy milk"
+./remind -g milk
+./remind -X $(./remind -g rent) | grep Msg
+./remind -D $(./remind -g "buy milk")
+./remind -g milk
+./remind -s Oat milk
+./remind -g milk
+./remind -Cq
+./remind -g milk
+rm -f ./remind.db.idx
+./remind -g milk
+rm -f ./remind.db.idx
+echo Bulk delete
+./remind -iq
+./remind -s First standard
+./remind -s -u 2 -d 02/01/2030 Second standard
+./remind -s -u 2 -d 05/01/2030 Third standard
+./remind -u 2 -r y -d 03/01/2030 Periodic birthday
+./remind -s Fifth standard
+./remind -s Sixth standard
+./remind -X 2-3 | grep Msg
+./remind -D 3-1
+./remind -D 9-
+./remind -D 1- -g fifth
+./remind -s -F
+./remind -D 1-6 -F -s -u 2 -d 04/01/2030
+./remind -l
+./remind -D 1- -F -g standard -p
+./remind -DF 0-9 -g fifth
+./remind -l
+./remind -D 6 -u 2 -p
+./remind -D 3,3,4,6
+./remind -l
+./remind -Dq 1-
+./remind -L | head -1
+./remind -l
+echo Dates against libc
+for tz in UTC Europe/London Europe/Dublin America/New_York America/Sao_Paulo \
+    America/St_Johns Australia/Lord_Howe Europe/Moscow Pacific/Apia \
+    Asia/Kolkata; do
+    TZ=$tz test/datecheck
+done
+echo Journal recovery
+./remind -iq
+./remind -s Before the crash
+printf 'torn' >./remind.db.wal
+./remind -l
+test -f ./remind.db.wal && echo journal kept || echo journal cleared
+printf 'torn' >./remind.db.wal
+test/crash ./remind.db "Committed after a torn journal"
+./remind -l
+test -f ./remind.db.wal && echo journal kept || echo journal cleared
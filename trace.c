@@ -0,0 +1,61 @@
+/* Tracing of a run as Chrome trace events, to be opened in a trace
+ * viewer (chrome://tracing or Perfetto).  The file is a JSON array of
+ * events, each written with a single call so that threads can't mix
+ * them up.  Timestamps are microseconds on the monotonic clock. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdatomic.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "trace.h"
+
+FILE* trace_file = NULL;
+
+static atomic_int nthreads = 0;
+static _Thread_local int tid = 0;  /* thread's number, from 1 */
+
+/* Name the process and end the array, once the run is done */
+static void trace_close(void)
+{
+    fprintf(trace_file,"{\"name\":\"process_name\",\"ph\":\"M\","
+            "\"pid\":%d,\"args\":{\"name\":\"remind\"}}\n]\n",
+            (int) getpid());
+    fclose(trace_file);
+    trace_file = NULL;
+    return;
+}
+
+/* Start tracing to the file filename, if one is given.  Returns false
+ * if it can't be opened. */
+bool trace_open(char* filename)
+{
+    if (filename == NULL || *filename == '\0') return true;
+    if ((trace_file = fopen(filename,"w")) == NULL) return false;
+    fputs("[\n",trace_file);
+    atexit(trace_close);
+    return true;
+}
+
+/* Write an event of phase ph ('B' begin, 'E' end) for the span name,
+ * which must need no quoting, with integer argument arg if not NULL */
+void trace_event(char ph, char* name, char* arg, long long value)
+{
+    struct timespec now;
+    double ts;
+
+    clock_gettime(CLOCK_MONOTONIC,&now);
+    ts = (double) now.tv_sec*1e6 + (double) now.tv_nsec/1e3;
+    if (tid == 0) tid = atomic_fetch_add(&nthreads,1)+1;
+    if (arg == NULL) {
+        fprintf(trace_file,"{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,"
+                "\"pid\":%d,\"tid\":%d},\n",name,ph,ts,(int) getpid(),tid);
+    }
+    else {
+        fprintf(trace_file,"{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,"
+                "\"pid\":%d,\"tid\":%d,\"args\":{\"%s\":%lld}},\n",
+                name,ph,ts,(int) getpid(),tid,arg,value);
+    }
+    return;
+}
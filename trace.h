@@ -0,0 +1,26 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdbool.h>
+#include <stdio.h>
+
+/* trace file, or NULL if not tracing */
+extern FILE* trace_file;
+
+extern bool trace_open(char*);
+extern void trace_event(char, char*, char*, long long);
+
+/* Begin and end a span called name, optionally with a named integer
+ * argument (arg NULL for none).  Spans nest, and each thread's are
+ * kept apart.  Nothing is done unless tracing. */
+static inline void trace_begin(char* name, char* arg, long long value)
+{
+    if (trace_file != NULL) trace_event('B',name,arg,value);
+}
+
+static inline void trace_end(char* name, char* arg, long long value)
+{
+    if (trace_file != NULL) trace_event('E',name,arg,value);
+}
+
+#endif